@@ -1,12 +1,504 @@
 #include "t2fs.h"
 #include "fs_helper.h"
+#include "apidisk.h"
+#include "buffer_cache.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 // define max size of name
 #define NAME_SIZE 4096
 
+/**
+ * Two handles writing to the same cluster keep each other's bytes once
+ * both are closed, fsync2 makes data written through a handle visible
+ * to handles opened afterwards, a handle closed last keeps size set
+ * through another one and a handle left open on a deleted file never
+ * writes to clusters given to another file.
+ *
+ * returns - number of failed checks.
+**/
+static int test_write_back(void) {
+	int errors = 0;
+	char buffer[16];
+	char fill[4096];
+
+	// create an empty file
+	FILE2 created = create2("/wbfile");
+	errors += created < 0;
+	errors += close2(created);
+
+	// open it twice and write to both ends of its first cluster
+	FILE2 first = open2("/wbfile");
+	FILE2 second = open2("/wbfile");
+
+	errors += write2(first, "AAAA", 4) != 4;
+	errors += seek2(second, 8);
+	errors += write2(second, "BBBB", 4) != 4;
+
+	errors += close2(first);
+	errors += close2(second);
+
+	// bytes of both handles must be there
+	FILE2 reader = open2("/wbfile");
+	memset(buffer, 0x00, sizeof(buffer));
+	errors += read2(reader, buffer, sizeof(buffer)) != 12;
+	errors += memcmp(buffer, "AAAA", 4) != 0;
+	errors += memcmp(&buffer[8], "BBBB", 4) != 0;
+	errors += close2(reader);
+
+	// append through a handle kept open and sync it
+	FILE2 writer = open2("/wbfile");
+	errors += seek2(writer, -1);
+	errors += write2(writer, "CCCC", 4) != 4;
+	errors += fsync2(writer);
+
+	// a handle opened after fsync2 must see appended bytes
+	reader = open2("/wbfile");
+	memset(buffer, 0x00, sizeof(buffer));
+	errors += read2(reader, buffer, sizeof(buffer)) != 16;
+	errors += memcmp(&buffer[12], "CCCC", 4) != 0;
+	errors += close2(reader);
+
+	errors += close2(writer);
+
+	// a handle that grew the file less does not shrink it on close
+	first = open2("/wbfile");
+	second = open2("/wbfile");
+	errors += seek2(first, 16);
+	errors += write2(first, "DDDD", 4) != 4;
+	errors += seek2(second, 20);
+	errors += write2(second, "EEEE", 4) != 4;
+	errors += close2(second);
+	errors += close2(first);
+
+	reader = open2("/wbfile");
+	errors += read2(reader, buffer, sizeof(buffer)) != 16;
+	errors += read2(reader, buffer, sizeof(buffer)) != 8;
+	errors += close2(reader);
+
+	// nor grows it back after a truncate made through another handle
+	first = open2("/wbfile");
+	second = open2("/wbfile");
+	errors += seek2(first, -1);
+	errors += write2(first, "FFFF", 4) != 4;
+	errors += seek2(second, 8);
+	errors += truncate2(second);
+	errors += close2(second);
+
+	reader = open2("/wbfile");
+	int truncated = read2(reader, buffer, sizeof(buffer));
+	errors += truncated < 4 || truncated >= 8;
+	errors += close2(reader);
+
+	errors += close2(first);
+
+	reader = open2("/wbfile");
+	errors += read2(reader, buffer, sizeof(buffer)) != truncated;
+	errors += close2(reader);
+
+	errors += delete2("/wbfile");
+
+	// keep bytes pending on a handle of a file about to be deleted
+	FILE2 stale = create2("/wbstale");
+	errors += stale < 0;
+	errors += write2(stale, "AAAA", 4) != 4;
+
+	// fill disk so that the deleted file cluster is the only free one
+	memset(fill, 0x00, sizeof(fill));
+	FILE2 filler = create2("/wbfill");
+	errors += filler < 0;
+	while (write2(filler, fill, sizeof(fill)) == sizeof(fill))
+		;
+	errors += close2(filler);
+
+	// next file takes slot and cluster of the deleted one
+	errors += delete2("/wbstale");
+	FILE2 other = create2("/wbother");
+	errors += other < 0;
+	errors += write2(other, "GGGGGGGG", 8) != 8;
+	errors += close2(other);
+
+	// stale handle can no longer write and stores nothing on close
+	errors += write2(stale, "X", 1) >= 0;
+	errors += close2(stale);
+
+	errors += open2("/wbstale") >= 0;
+	reader = open2("/wbother");
+	memset(buffer, 0x00, sizeof(buffer));
+	errors += read2(reader, buffer, sizeof(buffer)) != 8;
+	errors += memcmp(buffer, "GGGGGGGG", 8) != 0;
+	errors += close2(reader);
+
+	errors += delete2("/wbother");
+	errors += delete2("/wbfill");
+
+	return errors;
+}
+
+// threads of test_threads and files created by each one
+#define TEST_THREADS 4
+#define TEST_FILES 16
+
+/**
+ * Work of one thread of test_threads in shared directory /mt: each file
+ * is created holding its own name, odd ones are deleted again and a
+ * directory is made at the end.
+ *
+ * returns - number of failed checks.
+**/
+static void *test_threads_worker(void *arg) {
+	long id = (long) arg;
+	long errors = 0;
+	char name[64];
+	int index;
+
+	for (index = 0; index < TEST_FILES; index++) {
+		sprintf(name, "/mt/t%ldf%d", id, index);
+
+		FILE2 handle = create2(name);
+		errors += handle < 0;
+		errors += write2(handle, name, strlen(name)) != (int) strlen(name);
+		errors += close2(handle);
+
+		if (index % 2 == 1) errors += delete2(name);
+	}
+
+	sprintf(name, "/mt/t%ldd", id);
+	errors += mkdir2(name);
+
+	return (void *) errors;
+}
+
+/**
+ * Several threads creating, writing and deleting files and making
+ * directories in the same directory leave exactly the entries they
+ * kept, each file with its own content.
+ *
+ * returns - number of failed checks.
+**/
+static int test_threads(void) {
+	int errors = 0;
+	pthread_t threads[TEST_THREADS];
+	char name[64];
+	char content[64];
+	long id;
+	int index;
+
+	errors += mkdir2("/mt");
+
+	for (id = 0; id < TEST_THREADS; id++)
+		errors += pthread_create(&threads[id], NULL, test_threads_worker, (void *) id) != 0;
+
+	for (id = 0; id < TEST_THREADS; id++) {
+		void *result;
+
+		errors += pthread_join(threads[id], &result) != 0;
+		errors += (long) result;
+	}
+
+	// count entries left besides . and ..
+	int entries = 0;
+	DIRENT2 entry;
+
+	DIR2 dir = opendir2("/mt");
+	errors += dir < 0;
+
+	while (readdir2(dir, &entry) == 0) {
+		if (entry.name[0] != '.') entries++;
+	}
+
+	errors += closedir2(dir);
+	errors += entries != TEST_THREADS * (TEST_FILES / 2 + 1);
+
+	// kept files hold their names and deleted ones are gone
+	for (id = 0; id < TEST_THREADS; id++) {
+		for (index = 0; index < TEST_FILES; index++) {
+			sprintf(name, "/mt/t%ldf%d", id, index);
+
+			FILE2 handle = open2(name);
+
+			if (index % 2 == 1) {
+				errors += handle >= 0;
+				continue;
+			}
+
+			memset(content, 0x00, sizeof(content));
+			errors += handle < 0;
+			errors += read2(handle, content, sizeof(content)) != (int) strlen(name);
+			errors += strcmp(content, name) != 0;
+			errors += close2(handle);
+			errors += delete2(name);
+		}
+
+		sprintf(name, "/mt/t%ldd", id);
+		errors += rmdir2(name);
+	}
+
+	errors += rmdir2("/mt");
+
+	return errors;
+}
+
+/**
+ * Copy a file of host file system.
+ *
+ * returns - SUCCESS if file was copied ERROR otherwise.
+**/
+static int copy_host_file(const char *from, const char *to) {
+	FILE *source = fopen(from, "rb");
+	if (source == NULL)
+		return ERROR;
+
+	FILE *target = fopen(to, "wb");
+	if (target == NULL) {
+		fclose(source);
+		return ERROR;
+	}
+
+	char chunk[4096];
+	size_t count;
+	int result = SUCCESS;
+
+	while ((count = fread(chunk, 1, sizeof(chunk), source)) > 0) {
+		if (fwrite(chunk, 1, count, target) != count)
+			result = ERROR;
+	}
+
+	fclose(source);
+
+	if (fclose(target) != 0)
+		result = ERROR;
+
+	return result;
+}
+
+/**
+ * Write a file holding its own name through a mount.
+ *
+ * returns - number of failed checks.
+**/
+static int write_name_m(T2FS_MOUNT *mount, char *name) {
+	int errors = 0;
+
+	FILE2 handle = create2_m(mount, name);
+	errors += handle < 0;
+	errors += write2_m(mount, handle, name, strlen(name)) != (int) strlen(name);
+	errors += close2_m(mount, handle);
+
+	return errors;
+}
+
+/**
+ * Check through a mount that a file exists holding its own name.
+ *
+ * returns - number of failed checks.
+**/
+static int check_name_m(T2FS_MOUNT *mount, char *name) {
+	int errors = 0;
+	char content[64];
+
+	memset(content, 0x00, sizeof(content));
+
+	FILE2 handle = open2_m(mount, name);
+	errors += handle < 0;
+	errors += read2_m(mount, handle, content, sizeof(content)) != (int) strlen(name);
+	errors += strcmp(content, name) != 0;
+	errors += close2_m(mount, handle);
+
+	return errors;
+}
+
+/**
+ * Two images mounted side by side through the _m API keep their own
+ * files, directories and current directory, before and after being
+ * unmounted and mounted again. Default image is left alone.
+ *
+ * returns - number of failed checks.
+**/
+static int test_mounts(void) {
+	int errors = 0;
+	char name[NAME_SIZE];
+
+	// both images start as copies of default one
+	errors += sync2();
+	errors += copy_host_file("t2fs_disk.dat", "t2fs_disk_a.dat");
+	errors += copy_host_file("t2fs_disk.dat", "t2fs_disk_b.dat");
+
+	T2FS_MOUNT *first = t2fs_mount("t2fs_disk_a.dat");
+	T2FS_MOUNT *second = t2fs_mount("t2fs_disk_b.dat");
+	errors += first == NULL || second == NULL;
+
+	// same names get different content on each image
+	errors += mkdir2_m(first, "/mnt");
+	errors += mkdir2_m(second, "/mnt");
+	errors += write_name_m(first, "/mnt/a");
+	errors += write_name_m(second, "/mnt/b");
+
+	// current directory of one mount does not move the other
+	errors += chdir2_m(first, "/mnt");
+	errors += getcwd2_m(second, name, NAME_SIZE);
+	errors += strcmp(name, "/") != 0;
+
+	FILE2 relative = open2_m(first, "a");
+	errors += relative < 0;
+	errors += close2_m(first, relative);
+
+	// each image only sees its own file
+	errors += check_name_m(first, "/mnt/a");
+	errors += check_name_m(second, "/mnt/b");
+	errors += open2_m(first, "/mnt/b") >= 0;
+	errors += open2_m(second, "a") >= 0;
+	errors += open2("/mnt/a") >= 0;
+
+	errors += t2fs_umount(first);
+	errors += t2fs_umount(second);
+
+	// files survive a new mount of each image
+	first = t2fs_mount("t2fs_disk_a.dat");
+	second = t2fs_mount("t2fs_disk_b.dat");
+	errors += first == NULL || second == NULL;
+
+	errors += check_name_m(first, "/mnt/a");
+	errors += check_name_m(second, "/mnt/b");
+	errors += open2_m(second, "/mnt/a") >= 0;
+
+	errors += t2fs_umount(first);
+	errors += t2fs_umount(second);
+
+	remove("t2fs_disk_a.dat");
+	remove("t2fs_disk_b.dat");
+
+	return errors;
+}
+
+/**
+ * Check whether superblock sector of an image holds a clean unmount
+ * summary (its id sits at start of last 20 bytes of sector).
+ *
+ * returns - TRUE if summary id is found FALSE otherwise.
+**/
+static int has_summary(const char *path) {
+	unsigned char sector[SECTOR_SIZE];
+
+	FILE *image = fopen(path, "rb");
+	if (image == NULL)
+		return FALSE;
+
+	size_t count = fread(sector, 1, SECTOR_SIZE, image);
+	fclose(image);
+
+	return count == SECTOR_SIZE && memcmp(sector + SECTOR_SIZE - 20, "FSUM", 4) == 0;
+}
+
+/**
+ * A clean unmount stores FAT summary and next mount uses it, first dirty
+ * FAT write erases it and a copy of image taken then (as after a crash)
+ * is mounted by scanning FAT. Files are intact along both paths.
+ *
+ * returns - number of failed checks.
+**/
+static int test_summary(void) {
+	int errors = 0;
+
+	errors += sync2();
+	errors += copy_host_file("t2fs_disk.dat", "t2fs_disk_s.dat");
+
+	T2FS_MOUNT *mount = t2fs_mount("t2fs_disk_s.dat");
+	errors += mount == NULL;
+	errors += write_name_m(mount, "/sum1");
+	errors += t2fs_umount(mount);
+
+	// clean unmount left a summary behind
+	errors += !has_summary("t2fs_disk_s.dat");
+
+	// mount from summary finds file and allocates around it
+	mount = t2fs_mount("t2fs_disk_s.dat");
+	errors += mount == NULL;
+	errors += check_name_m(mount, "/sum1");
+
+	FILE2 handle = create2_m(mount, "/sum2");
+	errors += handle < 0;
+	errors += write2_m(mount, handle, "/sum2", 5) != 5;
+	errors += fsync2_m(mount, handle);
+
+	// FAT went to disk so summary no longer describes it
+	errors += has_summary("t2fs_disk_s.dat");
+	errors += copy_host_file("t2fs_disk_s.dat", "t2fs_disk_c.dat");
+
+	errors += close2_m(mount, handle);
+	errors += t2fs_umount(mount);
+
+	// copy taken while mounted has no summary and FAT gets scanned
+	mount = t2fs_mount("t2fs_disk_c.dat");
+	errors += mount == NULL;
+	errors += check_name_m(mount, "/sum1");
+	errors += check_name_m(mount, "/sum2");
+	errors += write_name_m(mount, "/sum3");
+	errors += check_name_m(mount, "/sum1");
+	errors += check_name_m(mount, "/sum2");
+	errors += t2fs_umount(mount);
+
+	remove("t2fs_disk_s.dat");
+	remove("t2fs_disk_c.dat");
+
+	return errors;
+}
+
+/**
+ * Buffer cache evicts clean sectors first: a dirty sector stays cached
+ * and off disk while twice the cache capacity is read through it, and
+ * reaches disk on sync2.
+ *
+ * returns - number of failed checks.
+**/
+static int test_cache(void) {
+	int errors = 0;
+	BYTE sector[SECTOR_SIZE];
+	BYTE raw[SECTOR_SIZE];
+	PathLookup path;
+
+	// first sector of a file of ours is safe to overwrite
+	FILE2 handle = create2("/cachefile");
+	errors += handle < 0;
+	errors += close2(handle);
+	errors += sync2();
+	errors += resolve_path("/cachefile", &path) != TRUE;
+
+	DWORD target = cluster_to_log_sector(path.record.firstCluster);
+
+	memset(sector, 0xAB, SECTOR_SIZE);
+	errors += cache_write_sectors(target, 1, sector);
+
+	// read clean sectors of data area until cache was filled twice
+	Mount *mount = current_mount();
+	DWORD last = mount->super.DataSectorStart + 2 * mount->options.cache_sectors;
+	DWORD current;
+
+	if (last > mount->super.NofSectors)
+		last = mount->super.NofSectors;
+
+	for (current = mount->super.DataSectorStart; current < last; current++) {
+		if (current != target)
+			errors += cache_read_sectors(current, 1, raw);
+	}
+
+	// dirty sector was not written back to make room
+	errors += read_sector(target, raw) != 0;
+	errors += raw[0] == 0xAB;
+	errors += cache_read_sectors(target, 1, raw);
+	errors += raw[0] != 0xAB;
+
+	errors += sync2();
+	errors += read_sector(target, raw) != 0;
+	errors += raw[0] != 0xAB;
+
+	errors += delete2("/cachefile");
+
+	return errors;
+}
+
 int main() {
 
 	// printing test header warning in blue
@@ -150,6 +642,21 @@ int main() {
 
 	// make sure we can work with ../..
 	has_errors += chdir2("../../dir5");
+
+	// handles sharing a cluster and fsync2
+	has_errors += test_write_back();
+
+	// concurrent create, write, delete and mkdir
+	has_errors += test_threads();
+
+	// several images used side by side
+	has_errors += test_mounts();
+
+	// clean unmount summary and FAT scan after a crash
+	has_errors += test_summary();
+
+	// buffer cache keeps dirty sectors while clean ones can be evicted
+	has_errors += test_cache();
 	
 
 	printf("\n");
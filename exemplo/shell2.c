@@ -616,27 +616,13 @@ void cmdCp(void) {
         printf ("Missing parameter\n");
         return;
     }
-    // Abre o arquivo origem, que deve existir
-    FILE2 hSrc = open2 (src);
-    if (hSrc<0) {
-        printf ("Open source file error: %d\n", hSrc);
-        return;
-    }
-    // Cria o arquivo de destino, que ser resetado se existir
-    FILE2 hDst = create2 (dst);
-    if (hDst<0) {
-        close2(hSrc);
-        printf ("Create destination file error: %d\n", hDst);
+    // Copia os dados de source para destination em blocos de clusters
+    // (destino  criado, ou resetado se existir)
+    int err = copy2 (src, dst);
+    if (err) {
+        printf ("Copy error: %d\n", err);
         return;
     }
-    // Copia os dados de source para destination
-    char buffer[2];
-    while( read2(hSrc, buffer, 1) == 1 ) {
-        write2(hDst, buffer, 1);
-    }
-    // Fecha os arquicos
-    close2(hSrc);
-    close2(hDst);
 
     printf ("Files successfully copied\n");
 }
@@ -660,62 +646,27 @@ void cmdFscp(void) {
         return;
     }
     // Valida direo
+    int err;
     if (strncmp(direcao, "-t", 2)==0) {
         // src == host
         // dst == T2FS
-
-        // Abre o arquivo origem, que deve existir
-        FILE *hSrc = fopen(src, "r+");
-        if (hSrc==NULL) {
-            printf ("Open source file error\n");
-            return;
-        }
-        // Cria o arquivo de destino, que ser resetado se existir
-        FILE2 hDst = create2 (dst);
-        if (hDst<0) {
-            fclose(hSrc);
-            printf ("Create destination file error: %d\n", hDst);
-            return;
-        }
-        // Copia os dados de source para destination
-        char buffer[2];
-        while( fread((void *)buffer, (size_t)1, (size_t)1, hSrc) == 1 ) {
-            write2(hDst, buffer, 1);
-        }
-        // Fecha os arquicos
-        fclose(hSrc);
-        close2(hDst);
+        err = import2 (src, dst);
     }
     else if (strncmp(direcao, "-f", 2)==0) {
         // src == T2FS
         // dst == host
-
-        // Abre o arquivo origem, que deve existir
-        FILE2 hSrc = open2 (src);
-        if (hSrc<0) {
-            printf ("Open source file error: %d\n", hSrc);
-            return;
-        }
-        // Cria o arquivo de destino, que ser resetado se existir
-        FILE *hDst = fopen(dst, "w+");
-        if (hDst==NULL) {
-            printf ("Open destination file error\n");
-            return;
-        }
-        // Copia os dados de source para destination
-        char buffer[2];
-        while ( read2(hSrc, buffer, 1) == 1 ) {
-            fwrite((void *)buffer, (size_t)1, (size_t)1, hDst);
-        }
-        // Fecha os arquicos
-        close2(hSrc);
-        fclose(hDst);
+        err = export2 (src, dst);
     }
     else {
         printf ("Invalid copy direction\n");
         return;
     }
 
+    if (err) {
+        printf ("Copy error: %d\n", err);
+        return;
+    }
+
     printf ("Files successfully copied\n");
 }
 
@@ -39,6 +39,100 @@ Retorna:"0", se a leitura foi realizada corretamente
 ------------------------------------------------------------------------*/
 int write_sector (unsigned int sector, unsigned char *buffer);
 
+
+/*------------------------------------------------------------------------
+Função:	Realiza leitura de setores lógicos consecutivos do disco
+
+Entra:	sector -> primeiro setor lógico a ser lido, iniciando em ZERO
+	count  -> quantidade de setores a serem lidos
+	buffer -> ponteiro para a área de memória (count * SECTOR_SIZE bytes)
+		  onde colocar os dados lidos do disco
+
+Retorna:"0", se a leitura foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int read_sectors (unsigned int sector, unsigned int count, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+Função:	Realiza escrita de setores lógicos consecutivos do disco
+
+Entra:	sector -> primeiro setor lógico a ser escrito, iniciando em ZERO
+	count  -> quantidade de setores a serem escritos
+	buffer -> ponteiro para a área de memória (count * SECTOR_SIZE bytes)
+		  onde estão os dados a serem escritos no disco
+
+Retorna:"0", se a escrita foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int write_sectors (unsigned int sector, unsigned int count, unsigned char *buffer);
+
+
+/*------------------------------------------------------------------------
+Segmento de memória usado pelas operações de E/S vetorizadas.
+Cada segmento ocupa "count" setores consecutivos no disco.
+------------------------------------------------------------------------*/
+typedef struct {
+	unsigned char *buffer;	/* área de memória do segmento */
+	unsigned int count;	/* quantidade de setores do segmento */
+} SECTOR_VEC;
+
+
+/*------------------------------------------------------------------------
+Função:	Realiza leitura vetorizada (scatter) de setores lógicos consecutivos
+	do disco, espalhando os dados entre vários segmentos de memória
+
+Entra:	sector -> primeiro setor lógico a ser lido, iniciando em ZERO
+	vec    -> segmentos de memória, preenchidos na ordem do vetor
+	nvec   -> quantidade de segmentos
+
+Retorna:"0", se a leitura foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int readv_sectors (unsigned int sector, const SECTOR_VEC *vec, int nvec);
+
+
+/*------------------------------------------------------------------------
+Função:	Realiza escrita vetorizada (gather) de setores lógicos consecutivos
+	do disco, juntando os dados de vários segmentos de memória
+
+Entra:	sector -> primeiro setor lógico a ser escrito, iniciando em ZERO
+	vec    -> segmentos de memória, escritos na ordem do vetor
+	nvec   -> quantidade de segmentos
+
+Retorna:"0", se a escrita foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int writev_sectors (unsigned int sector, const SECTOR_VEC *vec, int nvec);
+
+
+/*------------------------------------------------------------------------
+Função:	Garante que todas as escritas feitas no disco foram persistidas
+	(fsync no backend pread/pwrite, msync no backend mmap)
+
+Retorna:"0", se a operação foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int sync_disk (void);
+
+
+/*------------------------------------------------------------------------
+Função:	Cria o estado de acesso ao disco do mount corrente. A imagem só
+	é aberta no primeiro acesso a um setor.
+
+Retorna:"0", se a operação foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro
+	(no backend legado apenas t2fs_disk.dat é aceito).
+------------------------------------------------------------------------*/
+int disk_create (void);
+
+
+/*------------------------------------------------------------------------
+Função:	Fecha a imagem do mount corrente e libera seu estado de acesso
+	ao disco. Não persiste escritas pendentes (ver sync_disk).
+------------------------------------------------------------------------*/
+void disk_destroy (void);
+
 #endif
 
 
@@ -0,0 +1,114 @@
+#ifndef __buffer_cache_h__
+#define __buffer_cache_h__
+
+#include "t2fs.h"
+
+/***************************************************************************
+* definitions
+***************************************************************************/
+
+// default number of sectors kept in buffer cache (override with -D or
+// with T2FS_OPTIONS)
+#ifndef BUFFER_CACHE_SECTORS
+#define BUFFER_CACHE_SECTORS 1024
+#endif
+
+// share of cache (in percent) that may hold dirty sectors before all of
+// them are written back together (override with -D)
+#ifndef BUFFER_CACHE_DIRTY_PERCENT
+#define BUFFER_CACHE_DIRTY_PERCENT 50
+#endif
+
+// number of independently locked cache shards (power of two)
+#ifndef BUFFER_CACHE_SHARDS
+#define BUFFER_CACHE_SHARDS 16
+#endif
+
+/***************************************************************************
+* functions
+*
+* Every sector read or written by the file system goes through the cache
+* of current mount. Sectors are found by a hash on sector number and
+* replaced in least recently used order, clean ones first. Dirty sectors
+* are written back to disk only when cache_flush is called, when they
+* exceed BUFFER_CACHE_DIRTY_PERCENT of cache or when a shard holding
+* nothing else needs room, always sorted so that adjacent ones are
+* merged into single requests instead of trickling out on eviction.
+*
+* Sectors are spread over shards, each with its own lock and lru list,
+* so threads working on different parts of disk proceed in parallel.
+***************************************************************************/
+
+/**
+ * Create empty buffer cache of current mount. It holds no sector until
+ * cache_init is called.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int cache_create(void);
+
+/**
+ * Release buffer cache of current mount without writing anything back.
+**/
+void cache_destroy(void);
+
+/**
+ * Initialize buffer cache holding up to capacity sectors. If cache is
+ * already initialized its dirty sectors are flushed and it is rebuilt
+ * with new capacity.
+ *
+ * on error - returns ERROR if memory cannot be allocated or dirty sectors
+ *            cannot be written otherwise SUCCESS.
+**/
+int cache_init(DWORD capacity);
+
+/**
+ * Read a sector through buffer cache.
+ *
+ * on error - returns ERROR if sector cannot be read from disk otherwise SUCCESS.
+**/
+int cache_read_sector(DWORD sector, BYTE *buffer);
+
+/**
+ * Write a sector through buffer cache. Sector is only marked as dirty
+ * and reaches disk when evicted or flushed.
+ *
+ * on error - returns ERROR if an evicted dirty sector cannot be written otherwise SUCCESS.
+**/
+int cache_write_sector(DWORD sector, BYTE *buffer);
+
+/**
+ * Read count consecutive sectors through buffer cache. Sectors missing
+ * from cache are fetched with one multi-sector request per run.
+ *
+ * on error - returns ERROR if sectors cannot be read from disk otherwise SUCCESS.
+**/
+int cache_read_sectors(DWORD sector, DWORD count, BYTE *buffer);
+
+/**
+ * Bring count consecutive sectors into buffer cache without copying them
+ * anywhere. Sectors already cached are left as they are and each run of
+ * missing ones is fetched with a single multi-sector request.
+ *
+ * on error - returns ERROR if sectors cannot be read from disk or memory
+ *            cannot be allocated otherwise SUCCESS.
+**/
+int cache_prefetch_sectors(DWORD sector, DWORD count);
+
+/**
+ * Write count consecutive sectors through buffer cache. Every dirty
+ * sector is written back once too many of them pile up.
+ *
+ * on error - returns ERROR if an evicted dirty sector cannot be written otherwise SUCCESS.
+**/
+int cache_write_sectors(DWORD sector, DWORD count, BYTE *buffer);
+
+/**
+ * Write every dirty sector back to disk. Consecutive dirty sectors are
+ * gathered into a single vectored request.
+ *
+ * on error - returns ERROR if a sector cannot be written otherwise SUCCESS.
+**/
+int cache_flush(void);
+
+#endif
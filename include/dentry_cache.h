@@ -0,0 +1,74 @@
+#ifndef __dentry_cache_h__
+#define __dentry_cache_h__
+
+#include "t2fs.h"
+
+/***************************************************************************
+* definitions
+***************************************************************************/
+
+// default number of names kept in dentry cache (override with -D or
+// with T2FS_OPTIONS)
+#ifndef DENTRY_CACHE_ENTRIES
+#define DENTRY_CACHE_ENTRIES 512
+#endif
+
+/***************************************************************************
+* functions
+*
+* Directory entries found (or known to be missing) while resolving paths
+* are remembered by (parent cluster, name) in the dentry cache of current
+* mount. Names not found are kept as negative entries so repeated
+* existence checks do not rescan the parent. Operations that change a
+* directory entry must invalidate it.
+***************************************************************************/
+
+/**
+ * Create empty dentry cache of current mount holding up to capacity
+ * names.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int dcache_create(DWORD capacity);
+
+/**
+ * Release dentry cache of current mount.
+**/
+void dcache_destroy(void);
+
+/**
+ * Lookup a name in dentry cache.
+ *
+ * param cluster - first cluster of parent directory
+ * param name    - record name
+ * param record  - if cached as existing then receives its record
+ * param slot    - if not NULL and cached as existing then receives record position in parent
+ *
+ * returns - TRUE if cached as existing, FALSE if cached as missing
+ *           or ERROR if name is not cached.
+**/
+int dcache_lookup(DWORD cluster, char *name, Record *record, DWORD *slot);
+
+/**
+ * Remember result of a directory scan. Replaces any previous entry for
+ * the same name.
+ *
+ * param cluster - first cluster of parent directory
+ * param name    - record name
+ * param record  - record found or NULL to remember name as missing
+ * param slot    - record position in parent (ignored for missing names)
+**/
+void dcache_insert(DWORD cluster, char *name, Record *record, DWORD slot);
+
+/**
+ * Forget a single name of a directory.
+**/
+void dcache_invalidate(DWORD cluster, char *name);
+
+/**
+ * Forget every name cached for a directory. Used when a directory
+ * cluster is released or reused.
+**/
+void dcache_invalidate_dir(DWORD cluster);
+
+#endif
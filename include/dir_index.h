@@ -0,0 +1,122 @@
+#ifndef __dir_index_h__
+#define __dir_index_h__
+
+#include "t2fs.h"
+
+/***************************************************************************
+* definitions
+***************************************************************************/
+
+// default number of directories indexed at the same time (override with -D)
+#ifndef DIR_INDEX_DIRS
+#define DIR_INDEX_DIRS 32
+#endif
+
+/***************************************************************************
+* functions
+*
+* Each directory gets an in-memory index built from its record array on
+* first use. The index maps name hashes to record slots and keeps a bitmap
+* of free slots, so finding a name or a free entry does not scan the whole
+* directory. Indexes are kept up to date by write_dir_record and rebuilt
+* from disk when evicted. Every mount keeps its own set of indexes.
+***************************************************************************/
+
+/**
+ * Create empty directory index of current mount.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int dir_index_create(void);
+
+/**
+ * Release every index of current mount.
+**/
+void dir_index_destroy(void);
+
+/**
+ * Find slot holding a valid record with given name in a directory.
+ *
+ * param cluster - first cluster of directory
+ * param name    - record name
+ * param record  - if found then receives record
+ * param slot    - if found then receives record position in directory
+ *
+ * returns - TRUE if found FALSE otherwise.
+ * on error - returns ERROR if directory cannot be read or indexed.
+**/
+int dir_index_lookup(DWORD cluster, char *name, Record *record, DWORD *slot);
+
+/**
+ * Find lowest free slot of a directory.
+ *
+ * param cluster - first cluster of directory
+ * param slot    - receives free record position in directory
+ *
+ * on error - returns ERROR if directory is full, cannot be read or indexed
+ *            otherwise SUCCESS.
+**/
+int dir_index_free_slot(DWORD cluster, DWORD *slot);
+
+/**
+ * Keep index of a directory in sync with a record update. Called by
+ * write_dir_record for every record it changes.
+ *
+ * param cluster    - first cluster of directory
+ * param slot       - record position in directory
+ * param old_record - previous record content
+ * param new_record - current record content
+**/
+void dir_index_note_change(DWORD cluster, DWORD slot, Record *old_record, Record *new_record);
+
+/**
+ * Drop index of a directory. Used when its cluster is released, reused
+ * or rewritten as a whole.
+**/
+void dir_index_drop(DWORD cluster);
+
+/**
+ * Cluster at a given position of a directory chain, answered from index
+ * so that deep slots do not walk the FAT.
+ *
+ * param cluster  - first cluster of directory
+ * param position - zero-based position in chain
+ *
+ * returns - cluster number or END_OF_FILE if chain is shorter than position.
+**/
+DWORD dir_index_cluster_at(DWORD cluster, DWORD position);
+
+/**
+ * Find first slot holding a valid record at or after a given slot.
+ *
+ * param cluster - first cluster of directory
+ * param from    - slot where search starts
+ * param slot    - if found then receives slot of valid record
+ *
+ * returns - TRUE if found FALSE if there are no more valid records.
+ * on error - returns ERROR if directory cannot be read or indexed.
+**/
+int dir_index_next_used(DWORD cluster, DWORD from, DWORD *slot);
+
+/**
+ * Number of valid records in a directory.
+ *
+ * on error - returns ERROR if directory cannot be read or indexed.
+**/
+int dir_index_entries(DWORD cluster);
+
+/**
+ * Append an empty cluster to index of a directory after its chain grew.
+ * Bucket heads are rehashed from stored slot hashes when slots outgrow
+ * them, without reading directory again. If directory is not indexed
+ * nothing is done since index is built from whole chain on next use.
+ *
+ * param cluster     - first cluster of directory
+ * param new_cluster - cluster appended to directory chain
+ *
+ * on error - returns ERROR if memory cannot be allocated (index is dropped)
+ *            otherwise SUCCESS.
+**/
+int dir_index_extend(DWORD cluster, DWORD new_cluster);
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef __fat_alloc_h__
+#define __fat_alloc_h__
+
+#include "t2fs.h"
+
+/***************************************************************************
+* functions
+***************************************************************************/
+
+/**
+ * Create empty allocator state of current mount. Bitmap is built later
+ * by alloc_init.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int alloc_create(void);
+
+/**
+ * Release allocator state of current mount.
+**/
+void alloc_destroy(void);
+
+/**
+ * Build free cluster bitmap. Must be called after in-memory FAT
+ * is prepared.
+ *
+ * When disk holds a clean unmount summary, free counter and rotor come
+ * from it and the bitmap is filled as FAT sectors are paged in, so no
+ * FAT sector is read here. Otherwise the whole FAT is read (one request
+ * per run of sectors) and counted.
+ *
+ * on error - returns ERROR if bitmap cannot be allocated or FAT cannot
+ *            be read otherwise SUCCESS.
+**/
+int alloc_init(void);
+
+/**
+ * Mark free clusters of FAT entries just read into in-memory FAT in bitmap.
+ * Called by FAT paging for every range it reads. Free counter is left
+ * alone since it already accounts for clusters not read yet.
+ *
+ * param first - first cluster whose entry was read
+ * param count - number of entries read
+**/
+void alloc_note_fat_loaded(DWORD first, DWORD count);
+
+/**
+ * Erase clean unmount summary from disk before FAT on disk changes. The
+ * erase is made durable first, so a crash never leaves a stale summary
+ * next to an updated FAT. Does nothing once erased.
+ *
+ * on error - returns ERROR if summary cannot be erased otherwise SUCCESS.
+**/
+int alloc_summary_clear(void);
+
+/**
+ * Store free counter and rotor as clean unmount summary so next mount
+ * needs no FAT scan. Every dirty FAT sector must be flushed before.
+ *
+ * on error - returns ERROR if summary cannot be written otherwise SUCCESS.
+**/
+int alloc_summary_write(void);
+
+/**
+ * Allocate a free cluster marking its FAT entry as END_OF_FILE.
+ *
+ * Search starts at the next-fit rotor (one past the last allocated
+ * cluster) and wraps around, testing 64 clusters at a time.
+ *
+ * returns  - allocated cluster number.
+ * on error - returns ERROR if there is no free cluster or FAT cant be written.
+**/
+DWORD alloc_cluster(void);
+
+/**
+ * Allocate count clusters and append them to a chain.
+ *
+ * Clusters are reserved as contiguous runs: a single run holding all
+ * of them is preferred and, when free space is fragmented, the largest
+ * runs available are taken one after another. Each run is linked in
+ * FAT as consecutive entries and the last cluster is marked END_OF_FILE.
+ * Callers should wrap this in a FAT batch.
+ *
+ * param last  - last cluster of chain being extended or END_OF_FILE for a new chain
+ * param count - number of clusters wanted
+ * param first - if not NULL receives first allocated cluster
+ *
+ * returns  - number of clusters allocated (less than count if disk is full).
+ * on error - returns ERROR if FAT cant be written.
+**/
+int alloc_chain(DWORD last, DWORD count, DWORD *first);
+
+/**
+ * Release a cluster marking its FAT entry as FREE_CLUSTER.
+ *
+ * on error - returns ERROR if FAT cant be written otherwise SUCCESS.
+**/
+int alloc_release(DWORD cluster);
+
+/**
+ * Keep bitmap in sync with a FAT entry update. Called by
+ * set_value_to_fat for every entry it changes.
+ *
+ * param cluster   - FAT entry that changed
+ * param old_value - previous entry value
+ * param new_value - current entry value
+**/
+void alloc_note_fat_change(DWORD cluster, DWORD old_value, DWORD new_value);
+
+/**
+ * Number of free clusters in data area.
+ *
+ * returns - free cluster counter.
+**/
+DWORD alloc_free_count(void);
+
+/**
+ * Take allocator lock guarding FAT and free cluster bitmap. Recursive,
+ * so functions above may be called while holding it.
+**/
+void alloc_lock(void);
+
+/**
+ * Release allocator lock.
+**/
+void alloc_unlock(void);
+
+#endif
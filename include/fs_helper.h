@@ -1,4 +1,7 @@
+#include <pthread.h>
 #include "t2fs.h"
+#include "mount.h"
+#include "readahead.h"
 
 /***************************************************************************
 * definitions
@@ -18,11 +21,25 @@
 // define file system identifier
 #define FS_ID "T2FS"
 
+// number of low handle bits holding handle table index (the
+// remaining bits hold slot generation to catch stale handles)
+#define HANDLE_INDEX_BITS 20
+
+// mask of generation kept in a handle (keeps handles positive)
+#define HANDLE_GENERATION_MASK 0x7FF
+
 // define max number of open files in file system
-#define MAX_OPENED_FILES 10
+#define MAX_OPENED_FILES (1 << HANDLE_INDEX_BITS)
 
 //define max number of opened directories at the same time
-#define MAX_OPENED_DIRS 65536
+#define MAX_OPENED_DIRS (1 << HANDLE_INDEX_BITS)
+
+// number of handle table slots allocated on first open (log2 and value)
+#define HANDLE_TABLE_INITIAL_BITS 4
+#define HANDLE_TABLE_INITIAL (1 << HANDLE_TABLE_INITIAL_BITS)
+
+// cut size of an opened file whose chain was not cut since last use
+#define NO_CUT 0xFFFFFFFF
 
 // defines a free cluster
 #define FREE_CLUSTER 0x00000000
@@ -48,6 +65,21 @@
 // define max chars in a path name
 #define MAX_PATH_SIZE 4096
 
+// longest name a record holds (name field keeps its terminator)
+#define MAX_RECORD_NAME_LEN 50
+
+// default max number of FAT sectors read together when a missing one is
+// touched (override with -D or with T2FS_OPTIONS)
+#ifndef FAT_READAHEAD_SECTORS
+#define FAT_READAHEAD_SECTORS 16
+#endif
+
+// clusters moved per request by copy2, import2 and export2 (override
+// with -D)
+#ifndef COPY_CHUNK_CLUSTERS
+#define COPY_CHUNK_CLUSTERS 64
+#endif
+
 
 /***************************************************************************
 * typedefs
@@ -59,42 +91,121 @@ typedef struct t2fs_record Record;
 
 
 /***************************************************************************
-* global variables and structs
+* structs
+*
+* state of the image being worked on lives in current mount (see mount.h)
 ***************************************************************************/
-Superblock superblock;
 
-DWORD curr_dir;
-
-DWORD* local_fat;
+// path component as a slice of caller string (not terminated)
+typedef struct {
+	const char *name;
+	int len;
+} PathPart;
 
-BYTE buffer[SECTOR_SIZE];
+// walks components of a path without copying it
+typedef struct {
+	const char *cursor;
+	PathPart part;
+} PathIter;
 
+// outcome of resolving a path
 typedef struct {
-	char head[MAX_PATH_SIZE];
-	char tail[MAX_PATH_SIZE];
-	char both[MAX_PATH_SIZE];
-} Path;
+	// first cluster of directory holding last component
+	DWORD parent;
+
+	// last component as a record name
+	char name[MAX_RECORD_NAME_LEN + 1];
+
+	// record and its slot in parent (only when last component exists)
+	Record record;
+	DWORD slot;
+} PathLookup;
 
 typedef struct {
+	// held by the thread using this handle (see file_handle_acquire)
+	pthread_mutex_t lock;
+
 	int is_used;
 	int current_pointer;
     Record  file;
-	char path[MAX_PATH_SIZE];
+
+	// directory record location: first cluster of parent dir and slot
+	// of the file entry there, so size updates need no path lookup
+	DWORD parent_cluster;
+	DWORD slot;
+
+	// bumped on close so old handles to this slot are rejected
+	int generation;
+
+	// next slot in free list when not used and own table index
+	int next_free;
+	int index;
+
+	// chain cursor: last cluster touched and its position in chain
+	DWORD cursor_cluster;
+	DWORD cursor_index;
+
+	// cluster numbers of chain built lazily on backward seeks
+	DWORD *chain;
+	DWORD chain_len;
+
+	// chain epoch seen when cursor was last valid
+	DWORD chain_epoch;
+
+	// sequential read detection and prefetch window
+	ReadaheadState readahead;
+
+	// cluster written through handle and not yet handed to buffer cache:
+	// its chain position and dirty byte range (empty when tail_low
+	// equals tail_high)
+	BYTE *tail_data;
+	DWORD tail_cluster;
+	DWORD tail_index;
+	int tail_low;
+	int tail_high;
+
+	// record changed by writes and not yet stored in parent directory
+	int record_dirty;
+
+	// first cluster of file while slot is used (FREE_CLUSTER otherwise)
+	// so that chain cuts find every handle of a file
+	DWORD open_cluster;
+
+	// cut made on chain by another handle, delete2 or create2 since the
+	// handle last applied one (see file_apply_cut): clusters and bytes
+	// kept (NO_CUT when none) and whether whole file was released. Set
+	// holding table lock and file node lock
+	DWORD cut_clusters;
+	DWORD cut_bytes;
+	int is_released;
 } OpenedFile;
 
 typedef struct {
+	// held by the thread using this handle (see dir_handle_acquire)
+	pthread_mutex_t lock;
+
 	int is_used;
 	int current_pointer;
 	Record  record;
+
+	// path stored in path arena
 	char* path;
-} OpenedDir;
 
+	// bumped on close so old handles to this slot are rejected
+	int generation;
+
+	// next slot in free list when not used and own table index
+	int next_free;
+	int index;
 
-OpenedFile opened_files[MAX_OPENED_FILES];
-OpenedDir opened_dirs[MAX_OPENED_DIRS];
-int num_opened_files;
-int num_opened_dirs;
-int unusedDirHandles;
+	// directory cluster last read by readdir and its position in chain
+	// (END_OF_FILE when buffer holds nothing valid)
+	BYTE *cluster_data;
+	DWORD cluster_position;
+
+	// directory epoch seen when cluster was read
+	DWORD dir_epoch;
+} OpenedDir;
 /***************************************************************************
 * functions
 ***************************************************************************/
@@ -111,19 +222,57 @@ int unusedDirHandles;
 int lookup_descriptor_by_name(DWORD cluster, char *name, Record *record);
 
 /**
- * Lookup parent record descriptor by parent path.
+ * Lookup record descriptor and its position by name in cluster. Result
+ * is answered from dentry cache when possible and from directory index
+ * otherwise, being stored in dentry cache afterwards (names not found are
+ * stored as negative entries).
  *
- * eg.: name -> /dir1/file1.txt
- *
- * parent -> /dir
- * name   -> file1.txt
- *
- * param name    - parent path that this function will try to match (/dir in example above)
+ * param cluster - logical cluster number
+ * param name    - record name that this function will try to match
  * param record  - if matched then this variable will store record found during lookup
+ * param slot    - if not NULL and matched then receives record position in cluster
  *
  * returns - TRUE if found FALSE otherwise.
+ * on error - returns ERROR if cluster cannot be read.
+**/
+int lookup_entry_by_name(DWORD cluster, char *name, Record *record, DWORD *slot);
+
+/**
+ * Read a single record of a directory.
+ *
+ * param cluster - first cluster of directory
+ * param slot    - record position in directory
+ * param record  - receives record
+ *
+ * on error - returns ERROR if record cannot be read otherwise SUCCESS.
+**/
+int read_dir_record(DWORD cluster, DWORD slot, Record *record);
+
+/**
+ * Write a single record of a directory keeping directory index and
+ * dentry cache in sync. Every change to a directory entry should go
+ * through this function.
+ *
+ * param cluster - first cluster of directory
+ * param slot    - record position in directory
+ * param record  - record to be written (TYPEVAL_INVALIDO frees slot)
+ *
+ * on error - returns ERROR if record cannot be written otherwise SUCCESS.
 **/
-int lookup_parent_descriptor_by_name(char *name, Record *record);
+int write_dir_record(DWORD cluster, DWORD slot, Record *record);
+
+/**
+ * Find a free record slot in a directory growing it by one cluster
+ * along its FAT chain when every slot is taken. Directory node must be
+ * locked for writing.
+ *
+ * param cluster - first cluster of directory
+ * param slot    - receives free record position in directory
+ *
+ * on error - returns ERROR if disk is full or directory cannot be
+ *            written otherwise SUCCESS.
+**/
+int alloc_dir_slot(DWORD cluster, DWORD *slot);
 
 /**
  * Number of records per sector.
@@ -140,27 +289,6 @@ int records_per_sector(void);
 DWORD curr_data_cluster(void);
 
 
-/**
- * Lookup a record returning a contiguous logical position 
- * of found record accumulating positions from previous
- * sectors util a entry with a given type
- * is found or end of cluster is reached
- *
- * e.g:
- * parent_dir      -> /dir1 -> sector 149 
- * child_record(0) -> .     -> sector 149 
- * child_record(1) -> ..    -> sector 149
- * child_record(2) -> dir2  -> sector 149
- * child_record(3) -> dir3  -> sector 149
- * child_record(4) -> this  -> sector 150
- *
- * param cluster - logical cluster number
- * param type    - record type
- *
- * returns - contiguous record position in a cluster.
-**/
-DWORD lookup_cont_record_by_type(DWORD cluster, BYTE type);
-
 /**
  * Lookup record descriptor by its cluster number.
  *
@@ -179,65 +307,85 @@ int lookup_descriptor_by_cluster(DWORD cluster, Record *record);
 DWORD cluster_to_log_sector(DWORD cluster);
 
 /**
- * Check wheter a given name exists.
- *
- * returns - physical cluster size.
- * on error - returns -1 if name does not exists or 0 if it exists.
+ * Start walking components of a path. Components are handed out as
+ * slices of name so nothing is copied or allocated.
 **/
-int does_name_exists(char *name);
+void path_iter_init(PathIter *iter, const char *name);
 
 /**
- * Splits path name into head and tail parts storing
- * it on result parameter.
+ * Move to next component of a path skipping repeated and trailing slashes.
  *
- * eg.: path consisting of the following name will be split as:
- *  
- *  name -> /home/aluno/sisop/t2fs 
- *  
- *  tail -> /home/aluno/sisop 
- *  head -> t2fs
- * 
- * on error - returns -1 if name does not exists or 0 if it exists.
+ * eg.: name -> ../dir1//file1.txt/
+ *
+ *  ite(1): ..
+ *  ite(2): dir1
+ *  ite(3): file1.txt
+ *
+ * returns - TRUE if a component was found FALSE at end of path.
 **/
-int path_from_name(char *name, Path *result);
+int path_iter_next(PathIter *iter);
 
 /**
- * Prepend str2 in str1.
+ * Resolve a path in a single walk from root directory (absolute path) or
+ * current directory (relative path) down to its last component.
+ *
+ * Repeated and trailing slashes are ignored, "." components are skipped
+ * and ".." components follow the parent entry of each directory. A path
+ * made only of slashes names root directory itself (its "." entry).
+ *
+ * eg.: name -> /dir1/file1.txt
+ *
+ *  parent -> first cluster of /dir1
+ *  name   -> file1.txt
+ *
+ * param name   - absolute or relative path
+ * param result - receives parent directory, last component name and, if
+ *                last component exists, its record and slot
+ *
+ * returns  - TRUE if last component exists FALSE if only its parent does.
+ * on error - returns ERROR if path is empty or too long, a component does
+ *            not fit in a record name or a middle component is missing or
+ *            is not a directory.
 **/
-void str_prepend(char *str1, char *str2);
+int resolve_path(const char *name, PathLookup *result);
 
 /**
- * Physical cluster size calculated by sector per cluster from superblock.
- * 
- * returns  - physical cluster size.
+ * Resolve a path like resolve_path and lock for writing its parent
+ * directory and, if last component exists, its node too. Path is
+ * resolved again whenever locked entry no longer matches the one found
+ * while walking (a concurrent change raced with this one).
+ *
+ * returns  - same as resolve_path. Nodes stay locked when TRUE or FALSE
+ *            is returned and are released by unlock_path.
+ * on error - returns ERROR if path cannot be resolved or parent directory
+ *            was removed meanwhile (nothing stays locked).
 **/
-DWORD phys_cluster_size(void);
+int lock_path(const char *name, PathLookup *result);
 
 /**
- * Convert logical FAT sector entry to physical sector entry.
- * 
- * returns  - physical sector entry in FAT.
+ * Release nodes locked by lock_path.
+ *
+ * param exists - value returned by lock_path
 **/
-DWORD fat_log_to_phys(DWORD lsector);
+void unlock_path(PathLookup *path, int exists);
 
 /**
- * Convert phyisical FAT sector entry to logical sector entry.
- * 
- * returns  - logical sector entry in FAT.
+ * Prepend str2 in str1.
 **/
-DWORD fat_phys_to_log(DWORD psector);
+void str_prepend(char *str1, char *str2);
 
 /**
- * Finds first free physical entry in FAT.
+ * Physical cluster size calculated by sector per cluster from superblock.
  * 
- * returns  - physical entry index since first sector in FAT.
- * on error - returns -1 if cant read fat partition or theres no free entry.
+ * returns  - physical cluster size.
 **/
-
-DWORD phys_fat_first_fit(void);
+DWORD phys_cluster_size(void);
 
 /*
- *  Refresh in-memmory fat table.
+ *  Prepare in-memmory fat table.
+ *
+ * Nothing is read here: FAT sectors are paged into in-memory FAT on first
+ * touch (see fat_page_in), so mount cost does not grow with disk size.
  *
  * This function is declared here because is not supposed 
  * to be accessed from outside.
@@ -245,9 +393,14 @@ DWORD phys_fat_first_fit(void);
 int set_local_fat();
 
 /**
- * Initialize curr_dir position to data sector after root sectors.
+ * Initialize current directory position to data sector after root sectors.
 **/
-int initialize_curr_dir(Superblock *superblock);
+int initialize_curr_dir(Superblock *block);
+
+/**
+ * Change current directory pointer (a logical sector) atomically.
+**/
+void set_curr_dir(DWORD sector);
 
 /**
  * Read superblock from sector zero
@@ -270,38 +423,336 @@ int read_cluster(int cluster, unsigned char *result);
 **/
 int write_cluster(int cluster, unsigned char *content);
 
+/**
+ * Read count contiguous logical clusters starting at cluster with
+ * a single multi-sector disk request.
+ *
+ * on error - returns ERROR if cant read from clusters otherwise SUCCESS.
+**/
+int read_clusters(DWORD cluster, DWORD count, unsigned char *result);
+
+/**
+ * Write count contiguous logical clusters starting at cluster with
+ * a single multi-sector disk request.
+ *
+ * on error - returns ERROR if cant write to clusters otherwise SUCCESS.
+**/
+int write_clusters(DWORD cluster, DWORD count, unsigned char *content);
+
+/**
+ * Cluster number at a given position of a FAT chain.
+ *
+ * param first - first cluster of chain
+ * param index - zero-based position in chain
+ *
+ * returns - cluster number or END_OF_FILE if chain is shorter than index.
+**/
+DWORD chain_cluster_at(DWORD first, DWORD index);
+
+/**
+ * Cluster number at a given position of an opened file chain.
+ *
+ * Sequential access walks forward from the handle cursor so each new
+ * cluster costs one FAT step. Going backwards builds the cluster array
+ * of the handle once and answers from it afterwards.
+ *
+ * param opened - opened file (handle lock held)
+ * param index  - zero-based position in chain
+ *
+ * returns - cluster number or END_OF_FILE if chain is shorter than index.
+**/
+DWORD file_cluster_at(OpenedFile *opened, DWORD index);
+
+/**
+ * Move cursor of an opened file to a known chain position.
+**/
+void file_cursor_set(OpenedFile *opened, DWORD index, DWORD cluster);
+
+/**
+ * Make chain cursor and cluster array of every handle opened on the
+ * file starting at first_cluster stale, so they are reset on next use.
+ * Must be called whenever that chain is cut or released.
+**/
+void invalidate_file_cursors(DWORD first_cluster);
+
+/**
+ * Tell every handle opened on the file starting at first_cluster that
+ * its chain was released, so their pending writes are dropped instead
+ * of landing on clusters given to another file. File node must be
+ * locked for writing.
+**/
+void files_release_chain(DWORD first_cluster);
+
+/**
+ * Tell every handle opened on the file starting at first_cluster, but
+ * except, that its chain was cut keeping clusters clusters and bytes
+ * bytes. File node must be locked for writing.
+**/
+void files_cut_chain(DWORD first_cluster, DWORD clusters, DWORD bytes, OpenedFile *except);
+
+/**
+ * Apply to an opened file the cut left by files_cut_chain or
+ * files_release_chain since its last use. File node must be locked.
+ *
+ * returns - FALSE if file was released (handle can only be closed)
+ *           TRUE otherwise.
+**/
+int file_apply_cut(OpenedFile *opened);
+
+/**
+ * Make directory cluster kept by every handle opened on the directory
+ * starting at first_cluster stale. Must be called whenever one of its
+ * records is written.
+**/
+void invalidate_dir_buffers(DWORD first_cluster);
+
+/**
+ * Number of physically contiguous clusters of a FAT chain starting
+ * at cluster (ie: cluster, cluster + 1, ... linked in this order).
+ *
+ * param cluster - first cluster of run
+ * param max     - max run length to report
+ *
+ * returns - run length (at least 1 when max is not zero).
+**/
+DWORD chain_run_length(DWORD cluster, DWORD max);
+
 /**
  * Save a record on the list of opened files
  *
- * Returns -1 on Error; index of the opened file on Success
+ * param parent_cluster - first cluster of directory holding the file entry
+ * param slot           - slot of the file entry in that directory
+ *
+ * Returns -1 on Error; handle of the opened file on Success
+**/
+int save_as_opened(Record record, DWORD parent_cluster, DWORD slot);
+
+/**
+ * Write the record of an opened file back to its directory slot.
+ * Nothing is written if the entry was deleted or replaced since open
+ * (entry name and first cluster must both match).
+ *
+ * param keep_larger - TRUE to keep size and cluster count of entry when
+ *                     larger, FALSE to store handle record as is
+ *
+ * on error - returns ERROR if directory sector cannot be read or written
+ *            otherwise SUCCESS.
+**/
+int update_opened_record(OpenedFile *opened, int keep_larger);
+
+
+/**
+ * Copy bytes into a cluster of an opened file through its tail buffer.
+ * Writes landing on the dirty range of tail (or right next to it) only
+ * touch handle memory, anything else hands current tail to buffer cache
+ * first. File node must be locked for writing.
+ *
+ * param index  - chain position of cluster
+ * param offset - offset of first byte inside cluster
+ *
+ * on error - returns ERROR if previous tail cannot be written or memory
+ *            cannot be allocated otherwise SUCCESS.
+**/
+int file_tail_write(OpenedFile *opened, DWORD index, DWORD cluster, int offset,
+                    const char *data, int size);
+
+/**
+ * Drop tail of an opened file when it is one of count clusters starting
+ * at chain position index (they were just overwritten whole).
+**/
+void file_tail_discard(OpenedFile *opened, DWORD index, DWORD count);
+
+/**
+ * Store pending writes of an opened file: tail cluster goes to buffer
+ * cache and changed record to its parent directory. Writes past a cut
+ * of the chain, or of a released file, are dropped. Handle lock must be
+ * held, file and parent nodes are locked here.
+ *
+ * on error - returns ERROR if cluster or record cannot be written
+ *            otherwise SUCCESS (pending writes are dropped either way).
 **/
-int save_as_opened(Record record, char* path);
+int file_flush_writes(OpenedFile *opened);
 
+/**
+ * Store pending writes of every opened file of current mount. Calling
+ * thread must hold no handle lock.
+ *
+ * on error - returns ERROR if any file cannot be flushed otherwise SUCCESS.
+**/
+int files_flush_writes(void);
 
 /*
-Similar to save_as_opened, only now returning a directory handler and having a higher limit of concurrent opened dirs
+Similar to save_as_opened, only now returning a directory handler
 */
 int save_as_opened_dir(Record record, char* path);
 
+/**
+ * Create empty handle tables of current mount.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int handles_create(void);
 
-/* Finds the next valid entry for a directory.
-returns -1 on errors; returns valid next address if viable*/
-int findValidEntry(Record record, int address);
+/**
+ * Release handle tables of current mount. Handles still opened are
+ * closed without writing anything back.
+**/
+void handles_destroy(void);
 
-/* Finds the path pointed by link*/
-Path* findLinkPath(Record link);
+/**
+ * Lock opened file of a handle for exclusive use by calling thread.
+ *
+ * returns  - opened file (release with file_handle_release).
+ * on error - returns NULL if handle is not opened or is stale (its slot
+ *            was closed and reused).
+**/
+OpenedFile *file_handle_acquire(FILE2 handle);
 
-/* Finds the record pointed by link*/
-Record* findLinkRecord(Record link);
+/**
+ * Unlock opened file taken by file_handle_acquire.
+**/
+void file_handle_release(OpenedFile *opened);
+
+/**
+ * Lock opened directory of a handle for exclusive use by calling thread.
+ *
+ * returns  - opened directory (release with dir_handle_release).
+ * on error - returns NULL if handle is not opened or is stale.
+**/
+OpenedDir *dir_handle_acquire(DIR2 handle);
+
+/**
+ * Unlock opened directory taken by dir_handle_acquire.
+**/
+void dir_handle_release(OpenedDir *opened);
+
+/**
+ * Close an opened file taken by file_handle_acquire putting its slot
+ * back in free list. Handle lock is released.
+**/
+void release_opened_file(OpenedFile *opened);
+
+/**
+ * Close an opened directory taken by dir_handle_acquire putting its
+ * slot back in free list. Handle lock is released.
+**/
+void release_opened_dir(OpenedDir *opened);
+
+/**
+ * Record at a slot of an opened directory taken from the directory
+ * cluster kept by its handle. A whole cluster is read only when slot
+ * lies outside the cluster already kept.
+ *
+ * returns  - record inside handle cluster buffer.
+ * on error - returns NULL if slot is past end of directory or its
+ *            cluster cannot be read.
+**/
+Record *opened_dir_record(OpenedDir *opened, DWORD slot);
+
+
+/**
+ * Finds first valid entry of a directory at or after a given address.
+ * Whole cluster chain of directory is considered and free slots are
+ * skipped through directory index.
+ *
+ * param record - directory record
+ * param end    - byte address (record position * RECORD_SIZE) where search starts
+ *
+ * returns - byte address of valid entry.
+ * on error - returns ERROR if there are no more valid entries.
+**/
+int findValidEntry(Record record, int end);
+
+/**
+ * Resolve path stored in a soft link. Relative targets are taken from
+ * current directory like any other path.
+ *
+ * returns  - same as resolve_path.
+**/
+int resolve_link(Record link, PathLookup *result);
+
+/**
+ * Resolve path stored in a soft link and lock it like lock_path.
+ *
+ * returns  - same as lock_path.
+**/
+int lock_link(Record link, PathLookup *result);
 
 /**
  * Save a dword on a given position of local FAT
  * Also update the FAT position on disk according to the local FAT
  *
+ * Only the FAT sector holding position is marked as dirty. If no batch
+ * is open it is written back right away, otherwise it is written once
+ * when the outermost batch ends.
+ *
  * Returns the result of write_sector (to raise an error, if necessary)
 **/
 int set_value_to_fat(int position, DWORD value);
 
+/**
+ * Make sure FAT sector holding entry of a cluster is in memory. A
+ * missing sector is read together with the missing sectors following
+ * it (up to fat_readahead option) since chains and allocator scans
+ * usually move forward.
+ *
+ * on error - returns ERROR if cluster is beyond FAT or its sector
+ *            cannot be read otherwise SUCCESS.
+**/
+int fat_page_in(DWORD cluster);
+
+/**
+ * Read every FAT sector not resident yet into in-memory FAT, one request
+ * per run of missing sectors.
+ *
+ * on error - returns ERROR if a sector cannot be read otherwise SUCCESS.
+**/
+int fat_page_in_all(void);
+
+/**
+ * Read FAT entry of a cluster paging its sector in on first touch.
+ *
+ * returns - FAT entry or END_OF_FILE if it cannot be read (so chain
+ *           walks stop there).
+**/
+DWORD get_value_from_fat(DWORD position);
+
+/**
+ * Number of sectors occupied by FAT on disk.
+ *
+ * returns - number of FAT sectors.
+**/
+DWORD fat_sectors_count(void);
+
+/**
+ * Open a FAT update batch. While a batch is open set_value_to_fat
+ * only marks sectors as dirty so a whole chain update touches each
+ * FAT sector on disk once. Batches may be nested.
+**/
+void fat_begin_batch(void);
+
+/**
+ * Close a FAT update batch flushing dirty FAT sectors when the
+ * outermost batch is closed.
+ *
+ * on error - returns ERROR if cant write a FAT sector otherwise SUCCESS.
+**/
+int fat_end_batch(void);
+
+/**
+ * Close a FAT update batch without writing anything back. Dirty FAT
+ * sectors stay in memory until next flush_fat (close2, fsync2, sync2,
+ * unmount or a batch closed by fat_end_batch).
+**/
+void fat_end_batch_deferred(void);
+
+/**
+ * Write every dirty FAT sector back to disk.
+ *
+ * on error - returns ERROR if cant write a FAT sector otherwise SUCCESS.
+**/
+int flush_fat(void);
+
 /**
  * Helper functions to print data, fat and super blocks from disk.
 **/
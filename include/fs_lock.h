@@ -0,0 +1,71 @@
+#ifndef __fs_lock_h__
+#define __fs_lock_h__
+
+#include "t2fs.h"
+
+/***************************************************************************
+* definitions
+***************************************************************************/
+
+// number of reader-writer locks shared by all nodes (power of two)
+#ifndef NODE_LOCK_STRIPES
+#define NODE_LOCK_STRIPES 256
+#endif
+
+/***************************************************************************
+* functions
+*
+* Every file and directory (a node) is locked through the reader-writer
+* lock of the stripe its first cluster (and mount) hashes to. Lookups and
+* reads take a node shared while record and chain updates take it
+* exclusive. A thread holds node locks of a single mount at a time.
+*
+* Lock order, outermost first:
+*
+*  - opened file or directory handle lock
+*  - node locks (two nodes are taken together through node_lock_pair)
+*  - allocator lock (FAT and free cluster bitmap)
+*  - internal locks of handle tables, dentry cache, directory index,
+*    buffer cache and path arena, which never call back into outer
+*    layers
+***************************************************************************/
+
+/**
+ * Lock a node for reading.
+ *
+ * param cluster - first cluster of file or directory
+**/
+void node_lock_shared(DWORD cluster);
+
+/**
+ * Lock a node for writing.
+ *
+ * param cluster - first cluster of file or directory
+**/
+void node_lock_exclusive(DWORD cluster);
+
+/**
+ * Try to lock a node for writing without blocking.
+ *
+ * returns - TRUE if node was locked FALSE otherwise.
+**/
+int node_trylock_exclusive(DWORD cluster);
+
+/**
+ * Unlock a node locked by any function above.
+**/
+void node_unlock(DWORD cluster);
+
+/**
+ * Lock two nodes for writing in stripe order so that callers locking
+ * the same pair in any order never deadlock. Nodes sharing a stripe are
+ * locked once.
+**/
+void node_lock_pair(DWORD first, DWORD second);
+
+/**
+ * Unlock two nodes locked by node_lock_pair.
+**/
+void node_unlock_pair(DWORD first, DWORD second);
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef __mount_h__
+#define __mount_h__
+
+#include <pthread.h>
+#include "t2fs.h"
+
+/***************************************************************************
+* definitions
+***************************************************************************/
+
+// disk image used by the default mount
+#define DEFAULT_DISK_NAME "t2fs_disk.dat"
+
+/***************************************************************************
+* mount context
+*
+* Everything tied to a disk image (superblock, FAT, caches, handle tables
+* and disk backend) lives in a mount. Each thread works on one mount at a
+* time: the one it entered through mount_enter or, when none, the default
+* mount over DEFAULT_DISK_NAME. Functions fetch that mount with
+* current_mount() (or their module state from it) once and access its
+* fields explicitly.
+***************************************************************************/
+
+struct t2fs_mount {
+    // disk image file name
+    const char *disk_name;
+
+    // options in effect (zero fields already replaced by defaults)
+    T2FS_OPTIONS options;
+
+    // image state below is built on first use (see mount_load)
+    int is_loaded;
+    pthread_mutex_t load_lock;
+
+    // superblock and logical sector of current directory (use
+    // curr_data_cluster and set_curr_dir since it is shared by every
+    // thread)
+    struct t2fs_superbloco super;
+    DWORD cwd_sector;
+
+    // in-memory FAT (read entries through get_value_from_fat which pages
+    // sectors in), one flag per FAT sector telling whether it differs
+    // from disk and one telling whether it was read, and nesting depth of
+    // fat_begin_batch/fat_end_batch calls
+    DWORD *fat;
+    BYTE *fat_dirty;
+    BYTE *fat_resident;
+    int batch_depth;
+
+    // state of each module (defined privately by its source file)
+    struct DiskState *disk_state;
+    struct AllocState *alloc_state;
+    struct BufferCache *buffer_cache;
+    struct DentryCache *dentry_cache;
+    struct DirIndexState *dir_index;
+    struct HandleTables *handle_tables;
+
+    // next mount created by t2fs_mount
+    struct t2fs_mount *next;
+};
+
+typedef struct t2fs_mount Mount;
+
+// mount entered by calling thread (NULL means default mount)
+extern __thread Mount *thread_mount;
+
+// mount over DEFAULT_DISK_NAME used by threads that entered none
+extern Mount default_mount;
+
+/***************************************************************************
+* functions
+***************************************************************************/
+
+/**
+ * Mount used by calling thread.
+**/
+static inline Mount *current_mount(void) {
+    Mount *mount = thread_mount;
+
+    return mount != NULL ? mount : &default_mount;
+}
+
+/**
+ * Make calling thread work on a mount.
+ *
+ * returns - mount used before (give it back to mount_leave).
+**/
+Mount *mount_enter(Mount *mount);
+
+/**
+ * Make calling thread work again on mount returned by mount_enter.
+**/
+void mount_leave(Mount *previous);
+
+/**
+ * Set options of default mount and of mounts created from now on. Zero
+ * fields (and NULL options) take default values.
+ *
+ * on error - returns ERROR if default mount is already loaded, an option
+ *            is invalid or memory cannot be allocated otherwise SUCCESS.
+**/
+int mount_configure(T2FS_OPTIONS *options);
+
+/**
+ * Create a mount over a disk image. Nothing is read until the mount is
+ * first used.
+ *
+ * returns  - new mount.
+ * on error - returns NULL if memory cannot be allocated.
+**/
+Mount *mount_create(const char *disk_name);
+
+/**
+ * Build image state of a mount (superblock, FAT, caches and handle
+ * tables) unless already built. Safe to call from many threads.
+ *
+ * on error - returns ERROR if disk image cannot be read or is not a
+ *            T2FS image otherwise SUCCESS.
+**/
+int mount_load(Mount *mount);
+
+/**
+ * Write back dirty state of a mount and release it. Handles opened on
+ * it become invalid. Must not race with other calls on the mount.
+ *
+ * on error - returns ERROR if dirty sectors cannot be written otherwise
+ *            SUCCESS (mount is released either way).
+**/
+int mount_destroy(Mount *mount);
+
+/**
+ * Write back pending writes of opened files and dirty FAT and cache
+ * sectors of every loaded mount and store their clean unmount summaries.
+**/
+void mount_flush_all(void);
+
+/**
+ * Destroy every mount created by mount_create and unload default mount
+ * restoring default options. Must not race with other calls.
+ *
+ * on error - returns ERROR if dirty sectors of any mount cannot be
+ *            written otherwise SUCCESS (mounts are released either way).
+**/
+int mount_shutdown(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __path_arena_h__
+#define __path_arena_h__
+
+/***************************************************************************
+* functions
+*
+* Path strings kept by opened directory handles are stored out
+* of line in a shared arena. Space is carved from large blocks in power
+* of two size classes and released strings are reused by later stores
+* of the same class, so a handle only costs as much as its path.
+***************************************************************************/
+
+/**
+ * Store a copy of a path in arena.
+ *
+ * returns  - arena copy of path.
+ * on error - returns NULL if memory cannot be allocated.
+**/
+char *path_store(const char *path);
+
+/**
+ * Give back arena space of a path returned by path_store.
+**/
+void path_release(char *path);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __readahead_h__
+#define __readahead_h__
+
+#include "t2fs.h"
+
+/***************************************************************************
+* definitions
+***************************************************************************/
+
+// readahead window in clusters set when sequential reading is detected
+#ifndef READAHEAD_MIN_CLUSTERS
+#define READAHEAD_MIN_CLUSTERS 4
+#endif
+
+// default largest readahead window in clusters (override with -D or with
+// T2FS_OPTIONS)
+#ifndef READAHEAD_MAX_CLUSTERS
+#define READAHEAD_MAX_CLUSTERS 64
+#endif
+
+// readahead state kept by each opened file
+typedef struct {
+	// byte offset right after last read
+	DWORD next_position;
+
+	// current window in clusters (0 while reads look random)
+	DWORD window;
+
+	// chain position of first cluster not prefetched yet
+	DWORD limit;
+} ReadaheadState;
+
+/***************************************************************************
+* functions
+*
+* Each opened file watches where its reads start. A read starting where
+* the previous one ended is sequential: once the reader gets within half
+* a window of the clusters already prefetched, the next window of the
+* FAT chain is brought into the buffer cache (one multi-sector request
+* per contiguous run) and the window doubles up to the data_readahead
+* option. Any other read halves the window, so random access soon stops
+* prefetching altogether.
+***************************************************************************/
+
+/**
+ * Forget access history of a file (window closed, nothing prefetched).
+**/
+void readahead_reset(ReadaheadState *state);
+
+/**
+ * Account a read of an opened file and prefetch clusters following it
+ * when reads are sequential. File node must be locked so that its chain
+ * cannot change meanwhile. Prefetching is only a hint: failures are
+ * ignored.
+ *
+ * param position  - byte offset where read started
+ * param size      - number of bytes read
+ * param file_size - file size in bytes
+ * param index     - a chain position at or before last cluster read
+ * param cluster   - cluster number at that chain position
+**/
+void readahead_after_read(ReadaheadState *state, DWORD position, DWORD size, DWORD file_size,
+                          DWORD index, DWORD cluster);
+
+#endif
@@ -118,6 +118,7 @@ FILE2 open2 (char *filename);
 
 /*-----------------------------------------------------------------------------
 Funo:	Fecha o arquivo identificado pelo parmetro "handle".
+	Escritas ainda mantidas pelo handle so gravadas antes do fechamento.
 
 Entra:	handle -> identificador do arquivo a ser fechado
 
@@ -147,6 +148,8 @@ int read2 (FILE2 handle, char *buffer, int size);
 Funo:	Realiza a escrita de "size" bytes no arquivo identificado por "handle".
 	Os bytes a serem escritos esto na rea apontada por "buffer".
 	Aps a escrita, o contador de posio (current pointer) deve ser ajustado para o byte seguinte ao ltimo escrito.
+	Escritas pequenas e o novo tamanho do arquivo ficam no handle at close2, fsync2
+	ou sync2; at l outros handles do mesmo arquivo podem no v-los.
 
 Entra:	handle -> identificador do arquivo a ser escrito
 	buffer -> buffer de onde pegar os bytes a serem escritos no arquivo
@@ -158,6 +161,39 @@ Sa
 int write2 (FILE2 handle, char *buffer, int size);
 
 
+/*-----------------------------------------------------------------------------
+Funo:	Realiza a leitura de "size" bytes do arquivo identificado por "handle"
+	a partir da posio "offset", sem usar nem alterar o contador de posio
+	(current pointer) do arquivo.
+
+Entra:	handle -> identificador do arquivo a ser lido
+	buffer -> buffer onde colocar os bytes lidos do arquivo
+	size -> nmero de bytes a serem lidos
+	offset -> posio, em bytes a partir do incio do arquivo, onde a leitura comea
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna o nmero de bytes lidos.
+	Se "offset" estiver no final do arquivo ou alm dele, ser retornado o valor zero.
+	Em caso de erro, ser retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int pread2 (FILE2 handle, char *buffer, int size, DWORD offset);
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Realiza a escrita de "size" bytes no arquivo identificado por "handle"
+	a partir da posio "offset", sem usar nem alterar o contador de posio
+	(current pointer) do arquivo.
+
+Entra:	handle -> identificador do arquivo a ser escrito
+	buffer -> buffer de onde pegar os bytes a serem escritos no arquivo
+	size -> nmero de bytes a serem escritos
+	offset -> posio, em bytes a partir do incio do arquivo, onde a escrita comea
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna o nmero de bytes efetivamente escritos.
+	Em caso de erro, ser retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int pwrite2 (FILE2 handle, char *buffer, int size, DWORD offset);
+
+
 /*-----------------------------------------------------------------------------
 Funo:	Funo usada para truncar um arquivo.
 	Remove do arquivo todos os bytes a partir da posio atual do contador de posio (CP)
@@ -287,6 +323,21 @@ Sa
 int readdir2 (DIR2 handle, DIRENT2 *dentry);
 
 
+/*-----------------------------------------------------------------------------
+Funo:	L vrias entradas de um diretrio de uma s vez.
+	Entradas so lidas a partir da posio atual do diretrio, como em
+	readdir2, e cada cluster do diretrio  lido do disco uma nica vez.
+
+Entra:	handle -> identificador do diretrio cujas entradas deseja-se ler.
+	dentries -> vetor onde colocar as informaes das entradas lidas.
+	max -> nmero mximo de entradas a serem lidas.
+
+Sada:	Retorna o nmero de entradas lidas (zero quando no h mais entradas).
+	Em caso de erro, ser retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int readdirn2 (DIR2 handle, DIRENT2 *dentries, int max);
+
+
 /*-----------------------------------------------------------------------------
 Funo:	Fecha o diretrio identificado pelo parmetro "handle".
 
@@ -309,6 +360,196 @@ Sa
 -----------------------------------------------------------------------------*/
 int ln2(char *linkname, char *filename);
 
+/*-----------------------------------------------------------------------------
+Funo:	Copia o arquivo src para dst dentro do T2FS. O arquivo dst  criado ou,
+	se j existir, tem seu contedo removido. Os dados so movidos em blocos
+	de vrios clusters e os clusters de dst so reservados de uma s vez.
+
+Entra:	src -> nome do arquivo origem
+	dst -> nome do arquivo destino (no pode ser o prprio src)
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna "0" (zero).
+	Em caso de erro, ser retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int copy2 (char *src, char *dst);
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Copia um arquivo do sistema de arquivos do host para o T2FS. O arquivo
+	t2fs_path  criado ou, se j existir, tem seu contedo removido.
+
+Entra:	host_path -> nome do arquivo origem no host
+	t2fs_path -> nome do arquivo destino no T2FS
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna "0" (zero).
+	Em caso de erro, ser retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int import2 (char *host_path, char *t2fs_path);
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Copia um arquivo do T2FS para o sistema de arquivos do host. O arquivo
+	host_path  criado ou, se j existir, truncado.
+
+Entra:	t2fs_path -> nome do arquivo origem no T2FS
+	host_path -> nome do arquivo destino no host
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna "0" (zero).
+	Em caso de erro, ser retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int export2 (char *t2fs_path, char *host_path);
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Grava as escritas mantidas pelo handle e, em seguida, todos os setores
+	modificados que ainda esto apenas na memria, garantindo que o disco
+	os persistiu.
+
+Entra:	handle -> identificador do arquivo a ser sincronizado
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna "0" (zero).
+	Em caso de erro, ser retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int fsync2 (FILE2 handle);
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Grava no disco todos os setores modificados que ainda esto apenas
+	na memria (escritas mantidas por handles abertos, FAT e cache de setores)
+	e garante que o disco os persistiu.
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna "0" (zero).
+	Em caso de erro, ser retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int sync2 (void);
+
+
+/*-----------------------------------------------------------------------------
+Backends de acesso  imagem de disco (campo "backend" de T2FS_OPTIONS).
+-----------------------------------------------------------------------------*/
+#define T2FS_BACKEND_DEFAULT	0	/* escolhido na compilao (DISK=native ou DISK=mmap) */
+#define T2FS_BACKEND_PREAD	1	/* pread/pwrite com descritor persistente */
+#define T2FS_BACKEND_MMAP	2	/* imagem mapeada em memria uma nica vez */
+
+/** Opes de inicializao da biblioteca (campos zerados usam o valor padro) */
+typedef struct {
+	char	*disk_name;		/* Imagem montada por padro (NULL: t2fs_disk.dat). */
+	DWORD	cache_sectors;		/* Setores mantidos no cache de setores de cada montagem. */
+	DWORD	dentry_entries;		/* Nomes mantidos no cache de entradas de diretrio de cada montagem. */
+	int	backend;		/* Backend de acesso ao disco (T2FS_BACKEND_*). Ignorado com DISK=legacy. */
+	DWORD	fat_readahead;		/* Mximo de setores da FAT lidos juntos quando um setor ausente  acessado. */
+	DWORD	data_readahead;		/* Mximo de clusters lidos antecipadamente quando read2 detecta leitura sequencial. */
+} T2FS_OPTIONS;
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Inicializa a biblioteca e monta a imagem padro.
+	Sem t2fs_init, a imagem padro  montada na primeira chamada de uma
+	funo da API, de forma que processos que no usam o sistema de arquivos
+	no pagam o custo da montagem. As opes valem para a imagem padro e
+	para as imagens montadas depois com t2fs_mount.
+	Compilando a biblioteca com AUTO_MOUNT=1 a imagem padro  montada
+	antes da execuo de main, como nas verses anteriores.
+
+Entra:	options -> opes de inicializao (NULL: valores padro).
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna "0" (zero).
+	Em caso de erro (biblioteca j inicializada ou imagem padro invlida),
+	ser retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int t2fs_init (T2FS_OPTIONS *options);
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Encerra a biblioteca: grava no disco todos os setores modificados de
+	todas as montagens, desmonta as imagens montadas com t2fs_mount e libera
+	a imagem padro. Arquivos e diretrios abertos so fechados. Nenhuma
+	outra thread pode estar usando a biblioteca durante a chamada.
+	Depois dela t2fs_init pode ser chamada novamente.
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna "0" (zero).
+	Em caso de erro, ser retornado um valor diferente de zero (as montagens
+	so liberadas mesmo assim).
+-----------------------------------------------------------------------------*/
+int t2fs_shutdown (void);
+
+
+/*-----------------------------------------------------------------------------
+Contexto de montagem de uma imagem de disco T2FS.
+As funes acima operam sobre a imagem padro (ver t2fs_init). Outras imagens
+so montadas com t2fs_mount e usadas atravs das variantes "_m" abaixo. Cada
+montagem possui sua prpria FAT, caches, tabelas de arquivos abertos e
+descritor do disco, de forma que vrias imagens podem ser usadas ao mesmo
+tempo por threads diferentes.
+-----------------------------------------------------------------------------*/
+typedef struct t2fs_mount T2FS_MOUNT;
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Cria uma montagem para a imagem de disco indicada por "path".
+	Nada  lido do disco at a primeira operao feita sobre a montagem,
+	de forma que imagens nunca acessadas no tm custo de montagem.
+
+Entra:	path -> nome do arquivo que contm a imagem de disco.
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna a montagem.
+	Em caso de erro, ser retornado NULL.
+-----------------------------------------------------------------------------*/
+T2FS_MOUNT *t2fs_mount (char *path);
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Desmonta uma imagem montada por t2fs_mount, gravando no disco todos os
+	setores modificados e liberando a montagem. Arquivos e diretrios ainda
+	abertos na montagem so fechados. Nenhuma outra thread pode estar usando
+	a montagem durante a chamada.
+
+Entra:	mount -> montagem retornada por t2fs_mount.
+
+Sada:	Se a operao foi realizada com sucesso, a funo retorna "0" (zero).
+	Em caso de erro, ser retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int t2fs_umount (T2FS_MOUNT *mount);
+
+
+/*-----------------------------------------------------------------------------
+Funo:	Variantes das funes acima que operam sobre a montagem "mount" em vez
+	da imagem padro. Cada uma recebe os mesmos parmetros e retorna os
+	mesmos valores da funo correspondente. Handles so vlidos apenas
+	na montagem em que foram abertos e cada montagem tem seu prprio
+	diretrio corrente.
+
+Entra:	mount -> montagem retornada por t2fs_mount.
+
+Sada:	Se a imagem no puder ser lida ou no for uma imagem T2FS, ser
+	retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+FILE2 create2_m (T2FS_MOUNT *mount, char *filename);
+int delete2_m (T2FS_MOUNT *mount, char *filename);
+FILE2 open2_m (T2FS_MOUNT *mount, char *filename);
+int close2_m (T2FS_MOUNT *mount, FILE2 handle);
+int read2_m (T2FS_MOUNT *mount, FILE2 handle, char *buffer, int size);
+int write2_m (T2FS_MOUNT *mount, FILE2 handle, char *buffer, int size);
+int pread2_m (T2FS_MOUNT *mount, FILE2 handle, char *buffer, int size, DWORD offset);
+int pwrite2_m (T2FS_MOUNT *mount, FILE2 handle, char *buffer, int size, DWORD offset);
+int truncate2_m (T2FS_MOUNT *mount, FILE2 handle);
+int seek2_m (T2FS_MOUNT *mount, FILE2 handle, DWORD offset);
+int mkdir2_m (T2FS_MOUNT *mount, char *pathname);
+int rmdir2_m (T2FS_MOUNT *mount, char *pathname);
+int chdir2_m (T2FS_MOUNT *mount, char *pathname);
+int getcwd2_m (T2FS_MOUNT *mount, char *pathname, int size);
+DIR2 opendir2_m (T2FS_MOUNT *mount, char *pathname);
+int readdir2_m (T2FS_MOUNT *mount, DIR2 handle, DIRENT2 *dentry);
+int readdirn2_m (T2FS_MOUNT *mount, DIR2 handle, DIRENT2 *dentries, int max);
+int closedir2_m (T2FS_MOUNT *mount, DIR2 handle);
+int ln2_m (T2FS_MOUNT *mount, char *linkname, char *filename);
+int copy2_m (T2FS_MOUNT *mount, char *src, char *dst);
+int import2_m (T2FS_MOUNT *mount, char *host_path, char *t2fs_path);
+int export2_m (T2FS_MOUNT *mount, char *t2fs_path, char *host_path);
+int fsync2_m (T2FS_MOUNT *mount, FILE2 handle);
+int sync2_m (T2FS_MOUNT *mount);
+
+
 #endif
 
 
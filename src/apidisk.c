@@ -0,0 +1,402 @@
+/*************************************************************************
+
+	Native implementation of apidisk.h
+
+	Keeps a descriptor to the disk image of each mount, opened on first
+	access, and transfers sectors through one of two backends:
+
+	- pread: preadv/pwritev using 64-bit offsets (default)
+	- mmap:  whole image is mapped once and sectors are copied with
+	         memcpy, leaving page-cache eviction to the kernel
+	         (default when built with DISK=mmap)
+
+	Each mount may pick its backend through T2FS_OPTIONS.
+
+	Build with DISK=legacy to link the prebuilt lib/apidisk.o instead.
+	Multi-sector functions are then emulated sector by sector and only
+	the default disk image (t2fs_disk.dat) can be mounted.
+
+*************************************************************************/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include "../include/apidisk.h"
+#include "../include/mount.h"
+
+#ifndef T2FS_LEGACY_APIDISK
+
+// max number of segments handed to a single preadv/pwritev call
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// backend used when options ask for T2FS_BACKEND_DEFAULT
+#ifdef T2FS_MMAP_DISK
+#define DISK_BACKEND_BUILD T2FS_BACKEND_MMAP
+#else
+#define DISK_BACKEND_BUILD T2FS_BACKEND_PREAD
+#endif
+
+// disk backend state of a mount
+struct DiskState {
+    // descriptor kept open while mount is loaded
+    int fd;
+
+    // disk image mapping used by mmap backend
+    unsigned char *map;
+
+    // disk image size in bytes (mmap backend)
+    off_t size;
+
+    // serializes opening and mapping disk image among threads
+    pthread_mutex_t open_lock;
+
+    // T2FS_BACKEND_PREAD or T2FS_BACKEND_MMAP
+    int backend;
+};
+
+/*------------------------------------------------------------------------
+Função:	Cria o estado de acesso ao disco do mount corrente
+------------------------------------------------------------------------*/
+int disk_create (void) {
+    struct DiskState *state = calloc(1, sizeof(struct DiskState));
+
+    if (state == NULL) return -1;
+
+    state->fd = -1;
+    state->backend = current_mount()->options.backend;
+    pthread_mutex_init(&state->open_lock, NULL);
+
+    if (state->backend == T2FS_BACKEND_DEFAULT) state->backend = DISK_BACKEND_BUILD;
+
+    current_mount()->disk_state = state;
+
+    return 0;
+}
+
+/*------------------------------------------------------------------------
+Função:	Libera o estado de acesso ao disco do mount corrente
+------------------------------------------------------------------------*/
+void disk_destroy (void) {
+    struct DiskState *disk = current_mount()->disk_state;
+
+    if (disk == NULL) return;
+
+    if (disk->map != NULL) munmap(disk->map, disk->size);
+    if (disk->fd >= 0) close(disk->fd);
+
+    pthread_mutex_destroy(&disk->open_lock);
+
+    free(disk);
+    current_mount()->disk_state = NULL;
+}
+
+/**
+ * Open disk image once and reuse its descriptor.
+ *
+ * returns  - disk descriptor.
+ * on error - returns -1 if disk image cannot be opened.
+**/
+static int disk_descriptor(void) {
+    struct DiskState *disk = current_mount()->disk_state;
+
+    int fd = __atomic_load_n(&disk->fd, __ATOMIC_ACQUIRE);
+
+    if (fd >= 0) return fd;
+
+    pthread_mutex_lock(&disk->open_lock);
+
+    // another thread may have opened it while waiting
+    if (disk->fd < 0)
+        __atomic_store_n(&disk->fd, open(current_mount()->disk_name, O_RDWR), __ATOMIC_RELEASE);
+
+    fd = disk->fd;
+
+    pthread_mutex_unlock(&disk->open_lock);
+
+    return fd;
+}
+
+/**
+ * Byte offset of a logical sector in disk image.
+**/
+static off_t sector_offset(unsigned int sector) {
+    return (off_t) sector * SECTOR_SIZE;
+}
+
+/**
+ * Transfer a list of segments to or from disk starting at offset.
+ *
+ * preadv/pwritev may move less than asked so segments already
+ * transferred are skipped and the call is issued again.
+ *
+ * returns - 0 on success, -1 on error or end of disk.
+**/
+static int transfer(struct iovec *iov, int iovcnt, off_t offset, int is_write) {
+    int fd = disk_descriptor();
+
+    if (fd < 0) return -1;
+
+    while (iovcnt > 0) {
+        int chunk = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        ssize_t count = is_write ? pwritev(fd, iov, chunk, offset) : preadv(fd, iov, chunk, offset);
+
+        if (count < 0 && errno == EINTR) continue;
+
+        // error or transfer beyond end of disk
+        if (count <= 0) return -1;
+
+        offset += count;
+
+        // skip fully transferred segments and trim a partial one
+        while (iovcnt > 0 && (size_t) count >= iov->iov_len) {
+            count -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + count;
+            iov->iov_len -= count;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Map whole disk image once and reuse mapping.
+ *
+ * returns  - disk mapping.
+ * on error - returns NULL if disk image cannot be opened or mapped.
+**/
+static unsigned char *disk_mapping(void) {
+    struct DiskState *disk = current_mount()->disk_state;
+
+    unsigned char *map = __atomic_load_n(&disk->map, __ATOMIC_ACQUIRE);
+
+    if (map != NULL) return map;
+
+    int fd = disk_descriptor();
+
+    if (fd < 0) return NULL;
+
+    pthread_mutex_lock(&disk->open_lock);
+
+    struct stat info;
+
+    // another thread may have mapped it while waiting
+    if (disk->map == NULL && fstat(fd, &info) == 0 && info.st_size > 0) {
+        void *mapped = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (mapped != MAP_FAILED) {
+            disk->size = info.st_size;
+            __atomic_store_n(&disk->map, mapped, __ATOMIC_RELEASE);
+        }
+    }
+
+    map = disk->map;
+
+    pthread_mutex_unlock(&disk->open_lock);
+
+    return map;
+}
+
+/**
+ * Copy a vector of sector segments from or into disk mapping.
+ *
+ * returns - 0 on success, -1 on error or end of disk.
+**/
+static int mmap_transfer_vec(unsigned int sector, const SECTOR_VEC *vec, int nvec, int is_write) {
+    struct DiskState *disk = current_mount()->disk_state;
+
+    unsigned char *map = disk_mapping();
+
+    if (map == NULL) return -1;
+
+    off_t offset = sector_offset(sector);
+
+    int index;
+
+    for (index = 0; index < nvec; index++) {
+        size_t length = (size_t) vec[index].count * SECTOR_SIZE;
+
+        // transfer beyond end of disk
+        if (offset + (off_t) length > disk->size) return -1;
+
+        if (is_write) memcpy(map + offset, vec[index].buffer, length);
+        else memcpy(vec[index].buffer, map + offset, length);
+
+        offset += length;
+    }
+
+    return 0;
+}
+
+/**
+ * Transfer a vector of sector segments to or from disk.
+**/
+static int transfer_vec(unsigned int sector, const SECTOR_VEC *vec, int nvec, int is_write) {
+    struct DiskState *disk = current_mount()->disk_state;
+
+    if (nvec <= 0) return 0;
+
+    if (disk->backend == T2FS_BACKEND_MMAP)
+        return mmap_transfer_vec(sector, vec, nvec, is_write);
+
+    struct iovec iov[nvec];
+
+    int index;
+
+    for (index = 0; index < nvec; index++) {
+        iov[index].iov_base = vec[index].buffer;
+        iov[index].iov_len = (size_t) vec[index].count * SECTOR_SIZE;
+    }
+
+    return transfer(iov, nvec, sector_offset(sector), is_write);
+}
+
+/*------------------------------------------------------------------------
+Função:	Realiza leitura de um setor lógico do disco
+
+Entra:	sector -> setor lógico a ser lido, iniciando em ZERO
+	buffer -> ponteiro para a área de memória onde colocar os dados lidos do disco
+
+Retorna:"0", se a leitura foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int read_sector (unsigned int sector, unsigned char *buffer) {
+    return read_sectors(sector, 1, buffer);
+}
+
+/*------------------------------------------------------------------------
+Função:	Realiza escrita de um setor lógico do disco
+
+Entra:	sector -> setor lógico a ser escrito, iniciando em ZERO
+	buffer -> ponteiro para a área de memória onde estão os dados a serem escritos no disco
+
+Retorna:"0", se a leitura foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int write_sector (unsigned int sector, unsigned char *buffer) {
+    return write_sectors(sector, 1, buffer);
+}
+
+/*------------------------------------------------------------------------
+Função:	Realiza leitura de setores lógicos consecutivos do disco
+------------------------------------------------------------------------*/
+int read_sectors (unsigned int sector, unsigned int count, unsigned char *buffer) {
+    SECTOR_VEC vec = { buffer, count };
+
+    return transfer_vec(sector, &vec, 1, 0);
+}
+
+/*------------------------------------------------------------------------
+Função:	Realiza escrita de setores lógicos consecutivos do disco
+------------------------------------------------------------------------*/
+int write_sectors (unsigned int sector, unsigned int count, unsigned char *buffer) {
+    SECTOR_VEC vec = { buffer, count };
+
+    return transfer_vec(sector, &vec, 1, 1);
+}
+
+/*------------------------------------------------------------------------
+Função:	Realiza leitura vetorizada (scatter) de setores lógicos consecutivos
+------------------------------------------------------------------------*/
+int readv_sectors (unsigned int sector, const SECTOR_VEC *vec, int nvec) {
+    return transfer_vec(sector, vec, nvec, 0);
+}
+
+/*------------------------------------------------------------------------
+Função:	Realiza escrita vetorizada (gather) de setores lógicos consecutivos
+------------------------------------------------------------------------*/
+int writev_sectors (unsigned int sector, const SECTOR_VEC *vec, int nvec) {
+    return transfer_vec(sector, vec, nvec, 1);
+}
+
+/*------------------------------------------------------------------------
+Função:	Garante que todas as escritas feitas no disco foram persistidas
+------------------------------------------------------------------------*/
+int sync_disk (void) {
+    struct DiskState *disk = current_mount()->disk_state;
+
+    // nothing was written yet
+    if (disk->fd < 0) return 0;
+
+    if (disk->map != NULL)
+        return msync(disk->map, disk->size, MS_SYNC) == 0 ? 0 : -1;
+
+    return fsync(disk->fd) == 0 ? 0 : -1;
+}
+
+#else
+
+int disk_create (void) {
+    // lib/apidisk.o always works on t2fs_disk.dat
+    return strcmp(current_mount()->disk_name, DEFAULT_DISK_NAME) == 0 ? 0 : -1;
+}
+
+void disk_destroy (void) {
+    // lib/apidisk.o keeps no state
+}
+
+/**
+ * Transfer a vector of sector segments one sector at a time through
+ * lib/apidisk.o.
+**/
+static int transfer_vec(unsigned int sector, const SECTOR_VEC *vec, int nvec, int is_write) {
+    int index;
+
+    for (index = 0; index < nvec; index++) {
+        unsigned int offset;
+
+        for (offset = 0; offset < vec[index].count; offset++) {
+            unsigned char *buffer = vec[index].buffer + offset * SECTOR_SIZE;
+
+            int result = is_write ? write_sector(sector, buffer) : read_sector(sector, buffer);
+
+            if (result != 0) return -1;
+
+            sector++;
+        }
+    }
+
+    return 0;
+}
+
+int read_sectors (unsigned int sector, unsigned int count, unsigned char *buffer) {
+    SECTOR_VEC vec = { buffer, count };
+
+    return transfer_vec(sector, &vec, 1, 0);
+}
+
+int write_sectors (unsigned int sector, unsigned int count, unsigned char *buffer) {
+    SECTOR_VEC vec = { buffer, count };
+
+    return transfer_vec(sector, &vec, 1, 1);
+}
+
+int readv_sectors (unsigned int sector, const SECTOR_VEC *vec, int nvec) {
+    return transfer_vec(sector, vec, nvec, 0);
+}
+
+int writev_sectors (unsigned int sector, const SECTOR_VEC *vec, int nvec) {
+    return transfer_vec(sector, vec, nvec, 1);
+}
+
+int sync_disk (void) {
+    // lib/apidisk.o closes the image after every access
+    return 0;
+}
+
+#endif
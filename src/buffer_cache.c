@@ -0,0 +1,657 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../include/fs_helper.h"
+#include "../include/buffer_cache.h"
+#include "../include/apidisk.h"
+
+// a cached sector
+typedef struct CacheEntry {
+    DWORD sector;
+    int is_valid;
+    int is_dirty;
+    BYTE *data;
+
+    // next entry in same hash bucket
+    struct CacheEntry *hash_next;
+
+    // neighbours in lru list (head is most recently used)
+    struct CacheEntry *lru_prev;
+    struct CacheEntry *lru_next;
+} CacheEntry;
+
+// a cache shard: sectors hash to a shard which has its own lock, hash
+// table and lru list so threads touching different shards never wait
+typedef struct {
+    pthread_mutex_t lock;
+    DWORD capacity;
+    DWORD bucket_mask;
+    CacheEntry *entries;
+    CacheEntry **buckets;
+    CacheEntry *lru_head;
+    CacheEntry *lru_tail;
+} CacheShard;
+
+// buffer cache state of a mount
+struct BufferCache {
+    DWORD capacity;
+    BYTE *data;
+
+    // number of dirty entries over every shard
+    DWORD dirty_count;
+
+    CacheShard shards[BUFFER_CACHE_SHARDS];
+};
+
+/**
+ * Shard holding a sector. Runs of 8 sectors (a couple of clusters) share
+ * a shard so that small multi-sector requests mostly lock once.
+**/
+static CacheShard *shard_of(DWORD sector) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    return &cache->shards[((sector >> 3) * 2654435761u >> 16) & (BUFFER_CACHE_SHARDS - 1)];
+}
+
+/**
+ * Hash a sector number into a bucket index of its shard.
+**/
+static DWORD bucket_of(CacheShard *shard, DWORD sector) {
+    return (sector * 2654435761u) & shard->bucket_mask;
+}
+
+/**
+ * Remove entry from lru list.
+**/
+static void lru_unlink(CacheShard *shard, CacheEntry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+/**
+ * Insert entry as most recently used.
+**/
+static void lru_push_front(CacheShard *shard, CacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    else shard->lru_tail = entry;
+
+    shard->lru_head = entry;
+}
+
+/**
+ * Remove entry from its hash bucket.
+**/
+static void hash_unlink(CacheShard *shard, CacheEntry *entry) {
+    CacheEntry **link = &shard->buckets[bucket_of(shard, entry->sector)];
+
+    while (*link != NULL && *link != entry)
+        link = &(*link)->hash_next;
+
+    if (*link == entry) *link = entry->hash_next;
+
+    entry->hash_next = NULL;
+}
+
+/**
+ * Find a cached sector in its shard (which must be locked) marking it as
+ * most recently used.
+ *
+ * returns - cache entry or NULL if sector is not cached.
+**/
+static CacheEntry *lookup(CacheShard *shard, DWORD sector) {
+    CacheEntry *entry = shard->buckets[bucket_of(shard, sector)];
+
+    while (entry != NULL && entry->sector != sector)
+        entry = entry->hash_next;
+
+    if (entry != NULL && entry != shard->lru_head) {
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+    }
+
+    return entry;
+}
+
+/**
+ * Whether a sector is cached without touching lru order.
+**/
+static int is_cached(DWORD sector) {
+    CacheShard *shard = shard_of(sector);
+
+    pthread_mutex_lock(&shard->lock);
+
+    CacheEntry *entry = shard->buckets[bucket_of(shard, sector)];
+
+    while (entry != NULL && entry->sector != sector)
+        entry = entry->hash_next;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return entry != NULL;
+}
+
+/**
+ * Compare cache entries by sector number.
+**/
+static int compare_entries(const void *first, const void *second) {
+    DWORD a = (*(CacheEntry * const *) first)->sector;
+    DWORD b = (*(CacheEntry * const *) second)->sector;
+
+    return (a > b) - (a < b);
+}
+
+/**
+ * Write dirty entries sorted by sector back to disk gathering each run
+ * of consecutive sectors into a single vectored request, and mark them
+ * clean. Shards holding them must be locked.
+ *
+ * param vec - scratch vector with room for count segments
+ *
+ * on error - returns ERROR if a sector cannot be written otherwise SUCCESS.
+**/
+static int write_runs(CacheEntry **dirty, DWORD count, SECTOR_VEC *vec) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    DWORD index = 0;
+
+    while (index < count) {
+        DWORD run = 0;
+
+        // gather run of consecutive sectors
+        do {
+            vec[run].buffer = dirty[index + run]->data;
+            vec[run].count = 1;
+            run++;
+        } while (index + run < count && dirty[index + run]->sector == dirty[index]->sector + run);
+
+        if (writev_sectors(dirty[index]->sector, vec, run) != SUCCESS) return ERROR;
+
+        DWORD offset;
+        for (offset = 0; offset < run; offset++)
+            dirty[index + offset]->is_dirty = FALSE;
+
+        __atomic_sub_fetch(&cache->dirty_count, run, __ATOMIC_RELAXED);
+
+        index += run;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Write every dirty sector of a shard (which must be locked) back to
+ * disk in merged runs. When scratch memory cannot be allocated only its
+ * least recently used entry is written.
+ *
+ * on error - returns ERROR if a sector cannot be written otherwise SUCCESS.
+**/
+static int flush_shard(CacheShard *shard) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    CacheEntry **dirty = malloc(shard->capacity * sizeof(CacheEntry *));
+    SECTOR_VEC *vec = malloc(shard->capacity * sizeof(SECTOR_VEC));
+
+    if (dirty == NULL || vec == NULL) {
+        free(dirty);
+        free(vec);
+
+        CacheEntry *entry = shard->lru_tail;
+
+        if (write_sector(entry->sector, entry->data) != SUCCESS) return ERROR;
+
+        entry->is_dirty = FALSE;
+        __atomic_sub_fetch(&cache->dirty_count, 1, __ATOMIC_RELAXED);
+
+        return SUCCESS;
+    }
+
+    DWORD count = 0;
+    DWORD index;
+
+    for (index = 0; index < shard->capacity; index++) {
+        CacheEntry *entry = &shard->entries[index];
+
+        if (entry->is_valid && entry->is_dirty) dirty[count++] = entry;
+    }
+
+    qsort(dirty, count, sizeof(CacheEntry *), compare_entries);
+
+    int result = write_runs(dirty, count, vec);
+
+    free(dirty);
+    free(vec);
+
+    return result;
+}
+
+/**
+ * Take least recently used clean entry of a shard (which must be locked)
+ * and bind it to sector. Dirty entries are left for cache_flush, which
+ * writes them in merged runs; when every entry of shard is dirty the
+ * whole shard is written back at once the same way.
+ *
+ * returns  - cache entry bound to sector (data not filled).
+ * on error - returns NULL if dirty sectors of shard cannot be written.
+**/
+static CacheEntry *take_entry(CacheShard *shard, DWORD sector) {
+    CacheEntry *entry = shard->lru_tail;
+
+    while (entry != NULL && entry->is_valid && entry->is_dirty)
+        entry = entry->lru_prev;
+
+    if (entry == NULL) {
+        if (flush_shard(shard) != SUCCESS) return NULL;
+
+        entry = shard->lru_tail;
+    }
+
+    if (entry->is_valid) hash_unlink(shard, entry);
+
+    entry->sector = sector;
+    entry->is_valid = TRUE;
+    entry->is_dirty = FALSE;
+
+    DWORD bucket = bucket_of(shard, sector);
+    entry->hash_next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+
+    lru_unlink(shard, entry);
+    lru_push_front(shard, entry);
+
+    return entry;
+}
+
+/**
+ * Release cache memory without writing anything back.
+**/
+static void release(void) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    int index;
+
+    for (index = 0; index < BUFFER_CACHE_SHARDS; index++) {
+        CacheShard *shard = &cache->shards[index];
+
+        free(shard->entries);
+        free(shard->buckets);
+
+        shard->entries = NULL;
+        shard->buckets = NULL;
+        shard->lru_head = shard->lru_tail = NULL;
+        shard->capacity = 0;
+    }
+
+    free(cache->data);
+
+    cache->data = NULL;
+    cache->capacity = 0;
+    cache->dirty_count = 0;
+}
+
+/**
+ * Initialize buffer cache holding up to capacity sectors. If cache is
+ * already initialized its dirty sectors are flushed and it is rebuilt
+ * with new capacity.
+ *
+ * on error - returns ERROR if memory cannot be allocated or dirty sectors
+ *            cannot be written otherwise SUCCESS.
+**/
+int cache_init(DWORD capacity) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    if (cache->data != NULL) {
+        if (cache_flush() != SUCCESS) return ERROR;
+
+        release();
+    }
+
+    // every shard holds the same share of capacity (at least one sector)
+    DWORD per_shard = (capacity + BUFFER_CACHE_SHARDS - 1) / BUFFER_CACHE_SHARDS;
+    if (per_shard == 0) per_shard = 1;
+
+    // number of buckets is the next power of two above shard capacity
+    DWORD buckets = 1;
+    while (buckets < per_shard) buckets <<= 1;
+
+    cache->capacity = per_shard * BUFFER_CACHE_SHARDS;
+    cache->data = malloc((size_t) cache->capacity * SECTOR_SIZE);
+
+    if (cache->data == NULL) return ERROR;
+
+    int index;
+
+    for (index = 0; index < BUFFER_CACHE_SHARDS; index++) {
+        CacheShard *shard = &cache->shards[index];
+
+        shard->capacity = per_shard;
+        shard->bucket_mask = buckets - 1;
+        shard->entries = calloc(per_shard, sizeof(CacheEntry));
+        shard->buckets = calloc(buckets, sizeof(CacheEntry *));
+
+        if (shard->entries == NULL || shard->buckets == NULL) {
+            release();
+            return ERROR;
+        }
+
+        DWORD entry;
+
+        // every entry starts empty in lru list
+        for (entry = 0; entry < per_shard; entry++) {
+            DWORD position = index * per_shard + entry;
+
+            shard->entries[entry].data = cache->data + (size_t) position * SECTOR_SIZE;
+            lru_push_front(shard, &shard->entries[entry]);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Create empty buffer cache of current mount. It holds no sector until
+ * cache_init is called.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int cache_create(void) {
+    struct BufferCache *state = calloc(1, sizeof(struct BufferCache));
+
+    if (state == NULL) return ERROR;
+
+    int index;
+    for (index = 0; index < BUFFER_CACHE_SHARDS; index++)
+        pthread_mutex_init(&state->shards[index].lock, NULL);
+
+    current_mount()->buffer_cache = state;
+
+    return SUCCESS;
+}
+
+/**
+ * Release buffer cache of current mount without writing anything back.
+**/
+void cache_destroy(void) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    if (cache == NULL) return;
+
+    release();
+
+    int index;
+    for (index = 0; index < BUFFER_CACHE_SHARDS; index++)
+        pthread_mutex_destroy(&cache->shards[index].lock);
+
+    free(cache);
+    current_mount()->buffer_cache = NULL;
+}
+
+/**
+ * Make sure cache is initialized before use. Cache is normally built
+ * when its mount is loaded, before any thread can call into it.
+**/
+static int ensure_cache(void) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    if (cache->data != NULL) return SUCCESS;
+
+    return cache_init(current_mount()->options.cache_sectors);
+}
+
+/**
+ * Read a sector through buffer cache.
+ *
+ * on error - returns ERROR if sector cannot be read from disk otherwise SUCCESS.
+**/
+int cache_read_sector(DWORD sector, BYTE *buffer) {
+    return cache_read_sectors(sector, 1, buffer);
+}
+
+/**
+ * Write a sector through buffer cache. Sector is only marked as dirty
+ * and reaches disk when evicted or flushed.
+ *
+ * on error - returns ERROR if an evicted dirty sector cannot be written otherwise SUCCESS.
+**/
+int cache_write_sector(DWORD sector, BYTE *buffer) {
+    return cache_write_sectors(sector, 1, buffer);
+}
+
+/**
+ * Read count consecutive sectors through buffer cache. Sectors missing
+ * from cache are fetched with one multi-sector request per run.
+ *
+ * on error - returns ERROR if sectors cannot be read from disk otherwise SUCCESS.
+**/
+int cache_read_sectors(DWORD sector, DWORD count, BYTE *buffer) {
+    if (ensure_cache() != SUCCESS) return ERROR;
+
+    DWORD index = 0;
+
+    while (index < count) {
+        CacheShard *shard = shard_of(sector + index);
+
+        pthread_mutex_lock(&shard->lock);
+
+        CacheEntry *entry = lookup(shard, sector + index);
+
+        // cache hit
+        if (entry != NULL) {
+            memcpy(buffer + (size_t) index * SECTOR_SIZE, entry->data, SECTOR_SIZE);
+            pthread_mutex_unlock(&shard->lock);
+            index++;
+            continue;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+
+        // measure run of missing sectors
+        DWORD run = 1;
+        while (index + run < count && !is_cached(sector + index + run))
+            run++;
+
+        BYTE *target = buffer + (size_t) index * SECTOR_SIZE;
+
+        // fetch the whole run straight into caller buffer without holding
+        // any shard lock
+        if (read_sectors(sector + index, run, target) != SUCCESS) return ERROR;
+
+        // keep a copy of fetched sectors
+        DWORD offset;
+        for (offset = 0; offset < run; offset++) {
+            BYTE *data = target + (size_t) offset * SECTOR_SIZE;
+
+            shard = shard_of(sector + index + offset);
+
+            pthread_mutex_lock(&shard->lock);
+
+            entry = lookup(shard, sector + index + offset);
+
+            // another thread cached sector meanwhile and its copy may be
+            // newer than disk so hand that one to caller
+            if (entry != NULL) {
+                memcpy(data, entry->data, SECTOR_SIZE);
+            } else {
+                entry = take_entry(shard, sector + index + offset);
+
+                if (entry != NULL) memcpy(entry->data, data, SECTOR_SIZE);
+            }
+
+            pthread_mutex_unlock(&shard->lock);
+
+            if (entry == NULL) return ERROR;
+        }
+
+        index += run;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Bring count consecutive sectors into buffer cache without copying them
+ * anywhere. Sectors already cached are left as they are (lru order
+ * included) and each run of missing ones is fetched with a single
+ * multi-sector request.
+ *
+ * on error - returns ERROR if sectors cannot be read from disk or memory
+ *            cannot be allocated otherwise SUCCESS.
+**/
+int cache_prefetch_sectors(DWORD sector, DWORD count) {
+    if (ensure_cache() != SUCCESS) return ERROR;
+
+    BYTE *buffer = NULL;
+    DWORD index = 0;
+
+    while (index < count) {
+        if (is_cached(sector + index)) {
+            index++;
+            continue;
+        }
+
+        // measure run of missing sectors
+        DWORD run = 1;
+        while (index + run < count && !is_cached(sector + index + run))
+            run++;
+
+        // room for longest possible run, taken on first miss only
+        if (buffer == NULL && (buffer = malloc((size_t) count * SECTOR_SIZE)) == NULL)
+            return ERROR;
+
+        if (read_sectors(sector + index, run, buffer) != SUCCESS) {
+            free(buffer);
+            return ERROR;
+        }
+
+        DWORD offset;
+        for (offset = 0; offset < run; offset++) {
+            CacheShard *shard = shard_of(sector + index + offset);
+
+            pthread_mutex_lock(&shard->lock);
+
+            CacheEntry *entry = lookup(shard, sector + index + offset);
+
+            // a copy cached meanwhile may be newer than disk so keep it
+            if (entry == NULL) {
+                entry = take_entry(shard, sector + index + offset);
+
+                if (entry != NULL) memcpy(entry->data, buffer + (size_t) offset * SECTOR_SIZE, SECTOR_SIZE);
+            }
+
+            pthread_mutex_unlock(&shard->lock);
+
+            if (entry == NULL) {
+                free(buffer);
+                return ERROR;
+            }
+        }
+
+        index += run;
+    }
+
+    free(buffer);
+
+    return SUCCESS;
+}
+
+/**
+ * Write count consecutive sectors through buffer cache. Every dirty
+ * sector is written back once too many of them pile up.
+ *
+ * on error - returns ERROR if an evicted dirty sector cannot be written otherwise SUCCESS.
+**/
+int cache_write_sectors(DWORD sector, DWORD count, BYTE *buffer) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    if (ensure_cache() != SUCCESS) return ERROR;
+
+    DWORD index;
+
+    for (index = 0; index < count; index++) {
+        CacheShard *shard = shard_of(sector + index);
+
+        pthread_mutex_lock(&shard->lock);
+
+        CacheEntry *entry = lookup(shard, sector + index);
+
+        if (entry == NULL) entry = take_entry(shard, sector + index);
+
+        if (entry != NULL) {
+            memcpy(entry->data, buffer + (size_t) index * SECTOR_SIZE, SECTOR_SIZE);
+
+            if (!entry->is_dirty) __atomic_add_fetch(&cache->dirty_count, 1, __ATOMIC_RELAXED);
+
+            entry->is_dirty = TRUE;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+
+        if (entry == NULL) return ERROR;
+    }
+
+    // write dirty sectors back in sorted runs before eviction has to
+    // write them one by one
+    if ((size_t) __atomic_load_n(&cache->dirty_count, __ATOMIC_RELAXED) * 100 >
+        (size_t) cache->capacity * BUFFER_CACHE_DIRTY_PERCENT)
+        return cache_flush();
+
+    return SUCCESS;
+}
+
+/**
+ * Write every dirty sector back to disk. Consecutive dirty sectors are
+ * gathered into a single vectored request. Every shard stays locked
+ * while flushing so sectors of one run are written together.
+ *
+ * on error - returns ERROR if a sector cannot be written otherwise SUCCESS.
+**/
+int cache_flush(void) {
+    struct BufferCache *cache = current_mount()->buffer_cache;
+
+    if (cache->data == NULL) return SUCCESS;
+
+    CacheEntry **dirty = malloc(cache->capacity * sizeof(CacheEntry *));
+    SECTOR_VEC *vec = malloc(cache->capacity * sizeof(SECTOR_VEC));
+
+    if (dirty == NULL || vec == NULL) {
+        free(dirty);
+        free(vec);
+        return ERROR;
+    }
+
+    DWORD count = 0;
+    DWORD index;
+    int shard;
+
+    // collect dirty sectors of every shard (locked in index order)
+    for (shard = 0; shard < BUFFER_CACHE_SHARDS; shard++) {
+        pthread_mutex_lock(&cache->shards[shard].lock);
+
+        for (index = 0; index < cache->shards[shard].capacity; index++) {
+            CacheEntry *entry = &cache->shards[shard].entries[index];
+
+            if (entry->is_valid && entry->is_dirty) dirty[count++] = entry;
+        }
+    }
+
+    // sort them so consecutive sectors become neighbours
+    qsort(dirty, count, sizeof(CacheEntry *), compare_entries);
+
+    int result = write_runs(dirty, count, vec);
+
+    for (shard = BUFFER_CACHE_SHARDS - 1; shard >= 0; shard--)
+        pthread_mutex_unlock(&cache->shards[shard].lock);
+
+    free(dirty);
+    free(vec);
+
+    return result;
+}
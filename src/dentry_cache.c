@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../include/fs_helper.h"
+#include "../include/dentry_cache.h"
+
+// a cached directory entry
+typedef struct Dentry {
+    DWORD cluster;
+    char name[FILE_NAME_SIZE];
+    int is_valid;
+    int is_negative;
+    Record record;
+    DWORD slot;
+
+    // next entry in same hash bucket
+    struct Dentry *hash_next;
+
+    // neighbours in lru list (head is most recently used)
+    struct Dentry *lru_prev;
+    struct Dentry *lru_next;
+} Dentry;
+
+// dentry cache state of a mount
+struct DentryCache {
+    // serializes every public function below (they only touch memory)
+    pthread_mutex_t lock;
+
+    int is_ready;
+
+    // number of entries and of hash buckets (twice the number of entries
+    // keeps chains short)
+    DWORD capacity;
+    DWORD bucket_count;
+
+    Dentry *entries;
+    Dentry **buckets;
+    Dentry *lru_head;
+    Dentry *lru_tail;
+};
+
+/**
+ * Hash parent cluster and name into a bucket index (FNV-1a).
+**/
+static DWORD bucket_of(DWORD cluster, const char *name) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    DWORD hash = 2166136261u ^ cluster;
+
+    while (*name) {
+        hash ^= (BYTE) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash % dcache->bucket_count;
+}
+
+/**
+ * Remove entry from lru list.
+**/
+static void lru_unlink(Dentry *entry) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else dcache->lru_head = entry->lru_next;
+
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else dcache->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+/**
+ * Insert entry as most recently used.
+**/
+static void lru_push_front(Dentry *entry) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = dcache->lru_head;
+
+    if (dcache->lru_head) dcache->lru_head->lru_prev = entry;
+    else dcache->lru_tail = entry;
+
+    dcache->lru_head = entry;
+}
+
+/**
+ * Insert entry as least recently used so it is reused first.
+**/
+static void lru_push_back(Dentry *entry) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    entry->lru_next = NULL;
+    entry->lru_prev = dcache->lru_tail;
+
+    if (dcache->lru_tail) dcache->lru_tail->lru_next = entry;
+    else dcache->lru_head = entry;
+
+    dcache->lru_tail = entry;
+}
+
+/**
+ * Put every entry in lru list on first use.
+**/
+static void ensure_dcache(void) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    if (dcache->is_ready) return;
+
+    int index;
+
+    for (index = 0; index < dcache->capacity; index++)
+        lru_push_front(&dcache->entries[index]);
+
+    dcache->is_ready = TRUE;
+}
+
+/**
+ * Whether name fits in a cache entry.
+**/
+static int is_cacheable(const char *name) {
+    return strlen(name) < FILE_NAME_SIZE;
+}
+
+/**
+ * Find a cached name.
+ *
+ * returns - cache entry or NULL if name is not cached.
+**/
+static Dentry *find(DWORD cluster, const char *name) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    Dentry *entry = dcache->buckets[bucket_of(cluster, name)];
+
+    while (entry != NULL && (entry->cluster != cluster || strcmp(entry->name, name) != 0))
+        entry = entry->hash_next;
+
+    return entry;
+}
+
+/**
+ * Drop entry from its bucket and make it the next one to be reused.
+**/
+static void forget(Dentry *entry) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    Dentry **link = &dcache->buckets[bucket_of(entry->cluster, entry->name)];
+
+    while (*link != NULL && *link != entry)
+        link = &(*link)->hash_next;
+
+    if (*link == entry) *link = entry->hash_next;
+
+    entry->hash_next = NULL;
+    entry->is_valid = FALSE;
+
+    lru_unlink(entry);
+    lru_push_back(entry);
+}
+
+/**
+ * Lookup a name in dentry cache.
+ *
+ * param cluster - first cluster of parent directory
+ * param name    - record name
+ * param record  - if cached as existing then receives its record
+ * param slot    - if not NULL and cached as existing then receives record position in parent
+ *
+ * returns - TRUE if cached as existing, FALSE if cached as missing
+ *           or ERROR if name is not cached.
+**/
+static int dcache_lookup_locked(DWORD cluster, char *name, Record *record, DWORD *slot) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    ensure_dcache();
+
+    if (!is_cacheable(name)) return ERROR;
+
+    Dentry *entry = find(cluster, name);
+
+    if (entry == NULL) return ERROR;
+
+    // mark as most recently used
+    if (entry != dcache->lru_head) {
+        lru_unlink(entry);
+        lru_push_front(entry);
+    }
+
+    if (entry->is_negative) return FALSE;
+
+    memcpy(record, &entry->record, RECORD_SIZE);
+
+    if (slot != NULL) *slot = entry->slot;
+
+    return TRUE;
+}
+
+/**
+ * Remember result of a directory scan. Replaces any previous entry for
+ * the same name.
+ *
+ * param cluster - first cluster of parent directory
+ * param name    - record name
+ * param record  - record found or NULL to remember name as missing
+ * param slot    - record position in parent (ignored for missing names)
+**/
+static void dcache_insert_locked(DWORD cluster, char *name, Record *record, DWORD slot) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    ensure_dcache();
+
+    if (!is_cacheable(name)) return;
+
+    Dentry *entry = find(cluster, name);
+
+    // reuse least recently used entry
+    if (entry == NULL) {
+        entry = dcache->lru_tail;
+
+        if (entry->is_valid) forget(entry);
+
+        entry->cluster = cluster;
+        strcpy(entry->name, name);
+        entry->is_valid = TRUE;
+
+        DWORD bucket = bucket_of(cluster, name);
+        entry->hash_next = dcache->buckets[bucket];
+        dcache->buckets[bucket] = entry;
+    }
+
+    entry->is_negative = record == NULL;
+    entry->slot = slot;
+
+    if (record != NULL) memcpy(&entry->record, record, RECORD_SIZE);
+
+    lru_unlink(entry);
+    lru_push_front(entry);
+}
+
+/**
+ * Forget a single name of a directory.
+**/
+static void dcache_invalidate_locked(DWORD cluster, char *name) {
+    ensure_dcache();
+
+    if (!is_cacheable(name)) return;
+
+    Dentry *entry = find(cluster, name);
+
+    if (entry != NULL) forget(entry);
+}
+
+/**
+ * Forget every name cached for a directory. Used when a directory
+ * cluster is released or reused.
+**/
+static void dcache_invalidate_dir_locked(DWORD cluster) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    ensure_dcache();
+
+    int index;
+
+    for (index = 0; index < dcache->capacity; index++) {
+        Dentry *entry = &dcache->entries[index];
+
+        if (entry->is_valid && entry->cluster == cluster) forget(entry);
+    }
+}
+
+/**
+ * Create empty dentry cache of current mount holding up to capacity
+ * names.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int dcache_create(DWORD capacity) {
+    struct DentryCache *state = calloc(1, sizeof(struct DentryCache));
+
+    if (state == NULL) return ERROR;
+
+    if (capacity == 0) capacity = 1;
+
+    state->capacity = capacity;
+    state->bucket_count = capacity * 2;
+    state->entries = calloc(state->capacity, sizeof(Dentry));
+    state->buckets = calloc(state->bucket_count, sizeof(Dentry *));
+
+    if (state->entries == NULL || state->buckets == NULL) {
+        free(state->entries);
+        free(state->buckets);
+        free(state);
+        return ERROR;
+    }
+
+    pthread_mutex_init(&state->lock, NULL);
+    current_mount()->dentry_cache = state;
+
+    return SUCCESS;
+}
+
+/**
+ * Release dentry cache of current mount.
+**/
+void dcache_destroy(void) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    if (dcache == NULL) return;
+
+    pthread_mutex_destroy(&dcache->lock);
+
+    free(dcache->entries);
+    free(dcache->buckets);
+    free(dcache);
+    current_mount()->dentry_cache = NULL;
+}
+
+/**
+ * Public entry points: each one runs its _locked counterpart holding dentry cache lock.
+**/
+int dcache_lookup(DWORD cluster, char *name, Record *record, DWORD *slot) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    pthread_mutex_lock(&dcache->lock);
+    int result = dcache_lookup_locked(cluster, name, record, slot);
+    pthread_mutex_unlock(&dcache->lock);
+
+    return result;
+}
+
+void dcache_insert(DWORD cluster, char *name, Record *record, DWORD slot) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    pthread_mutex_lock(&dcache->lock);
+    dcache_insert_locked(cluster, name, record, slot);
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+void dcache_invalidate(DWORD cluster, char *name) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    pthread_mutex_lock(&dcache->lock);
+    dcache_invalidate_locked(cluster, name);
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+void dcache_invalidate_dir(DWORD cluster) {
+    struct DentryCache *dcache = current_mount()->dentry_cache;
+
+    pthread_mutex_lock(&dcache->lock);
+    dcache_invalidate_dir_locked(cluster);
+    pthread_mutex_unlock(&dcache->lock);
+}
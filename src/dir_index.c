@@ -0,0 +1,647 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "../include/fs_helper.h"
+#include "../include/dir_index.h"
+
+// number of slots tracked by each free bitmap word
+#define BITS_PER_WORD 64
+
+// marks end of a bucket list
+#define NO_SLOT 0xFFFFFFFF
+
+// per slot hash node (a slot holds at most one name)
+typedef struct {
+    DWORD hash;
+    DWORD next;
+} SlotNode;
+
+// index of a single directory
+typedef struct {
+    int is_valid;
+    DWORD cluster;
+
+    // last time index was used (for eviction)
+    DWORD last_use;
+
+    // number of record slots in directory
+    DWORD slots;
+
+    // clusters of directory chain in order
+    DWORD *clusters;
+    DWORD cluster_count;
+
+    // one node per slot and bucket heads pointing to slots
+    SlotNode *nodes;
+    DWORD *buckets;
+    DWORD bucket_mask;
+
+    // bitmap with one bit per slot where a set bit means free slot
+    uint64_t *free_map;
+    DWORD free_map_words;
+} DirIndex;
+
+// directory index state of a mount
+struct DirIndexState {
+    DirIndex indexes[DIR_INDEX_DIRS];
+
+    // use counter driving eviction
+    DWORD use_clock;
+
+    // serializes every public function below. Building an index reads the
+    // directory through read_dir_record which comes back here for cluster
+    // positions, so the same thread may take it again.
+    pthread_mutex_t lock;
+};
+
+/**
+ * Hash a record name (FNV-1a).
+**/
+static DWORD name_hash(const char *name) {
+    DWORD hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (BYTE) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Release index memory.
+**/
+static void release(DirIndex *index) {
+    free(index->clusters);
+    free(index->nodes);
+    free(index->buckets);
+    free(index->free_map);
+
+    memset(index, 0, sizeof(DirIndex));
+}
+
+/**
+ * Link slot into bucket of its hash.
+**/
+static void link_slot(DirIndex *index, DWORD slot, DWORD hash) {
+    DWORD bucket = hash & index->bucket_mask;
+
+    index->nodes[slot].hash = hash;
+    index->nodes[slot].next = index->buckets[bucket];
+    index->buckets[bucket] = slot;
+
+    index->free_map[slot / BITS_PER_WORD] &= ~((uint64_t) 1 << (slot % BITS_PER_WORD));
+}
+
+/**
+ * Unlink slot from bucket of its hash.
+**/
+static void unlink_slot(DirIndex *index, DWORD slot) {
+    DWORD *link = &index->buckets[index->nodes[slot].hash & index->bucket_mask];
+
+    while (*link != NO_SLOT && *link != slot)
+        link = &index->nodes[*link].next;
+
+    if (*link == slot) *link = index->nodes[slot].next;
+
+    index->nodes[slot].next = NO_SLOT;
+
+    index->free_map[slot / BITS_PER_WORD] |= (uint64_t) 1 << (slot % BITS_PER_WORD);
+}
+
+/**
+ * Whether slot holds an indexed name.
+**/
+static int is_used(DirIndex *index, DWORD slot) {
+    return (index->free_map[slot / BITS_PER_WORD] & ((uint64_t) 1 << (slot % BITS_PER_WORD))) == 0;
+}
+
+/**
+ * Build index of a directory reading its whole cluster chain.
+ *
+ * on error - returns ERROR if directory cannot be read or memory cannot
+ *            be allocated otherwise SUCCESS.
+**/
+static int build(DirIndex *index, DWORD cluster) {
+    Mount *mount = current_mount();
+
+    DWORD per_cluster = records_per_sector() * mount->super.SectorsPerCluster;
+
+    // count clusters in directory chain
+    DWORD clusters = 0;
+    DWORD current = cluster;
+    while (current != END_OF_FILE && current != FREE_CLUSTER) {
+        clusters++;
+        current = get_value_from_fat(current);
+    }
+
+    if (clusters == 0) return ERROR;
+
+    DWORD slots = clusters * per_cluster;
+    DWORD slot;
+
+    index->clusters = malloc(clusters * sizeof(DWORD));
+
+    if (index->clusters == NULL) return ERROR;
+
+    index->cluster_count = 0;
+
+    // number of buckets is the next power of two above slots
+    DWORD buckets = 1;
+    while (buckets < slots) buckets <<= 1;
+
+    index->slots = slots;
+    index->bucket_mask = buckets - 1;
+    index->free_map_words = (slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    index->nodes = malloc(slots * sizeof(SlotNode));
+    index->buckets = malloc(buckets * sizeof(DWORD));
+    index->free_map = calloc(index->free_map_words, sizeof(uint64_t));
+
+    if (index->nodes == NULL || index->buckets == NULL || index->free_map == NULL) {
+        release(index);
+        return ERROR;
+    }
+
+    memset(index->buckets, 0xFF, buckets * sizeof(DWORD));
+
+    // every slot starts free
+    for (slot = 0; slot < slots; slot++) {
+        index->nodes[slot].next = NO_SLOT;
+        index->free_map[slot / BITS_PER_WORD] |= (uint64_t) 1 << (slot % BITS_PER_WORD);
+    }
+
+    unsigned char content[SECTOR_SIZE * mount->super.SectorsPerCluster];
+
+    current = cluster;
+    slot = 0;
+
+    // hash every valid record of every cluster
+    while (current != END_OF_FILE && current != FREE_CLUSTER) {
+        if (read_cluster(current, content) != SUCCESS) {
+            release(index);
+            return ERROR;
+        }
+
+        index->clusters[index->cluster_count++] = current;
+
+        DWORD i;
+        for (i = 0; i < per_cluster; i++, slot++) {
+            Record *record = (Record *) &content[i * RECORD_SIZE];
+
+            if (record->TypeVal != TYPEVAL_INVALIDO)
+                link_slot(index, slot, name_hash(record->name));
+        }
+
+        current = get_value_from_fat(current);
+    }
+
+    index->cluster = cluster;
+    index->is_valid = TRUE;
+
+    return SUCCESS;
+}
+
+/**
+ * Find index of a directory building it when missing. Least recently
+ * used index is evicted when every entry is taken.
+ *
+ * returns  - directory index.
+ * on error - returns NULL if index cannot be built.
+**/
+static DirIndex *index_of(DWORD cluster) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    DirIndex *victim = &state->indexes[0];
+
+    int i;
+
+    for (i = 0; i < DIR_INDEX_DIRS; i++) {
+        if (state->indexes[i].is_valid && state->indexes[i].cluster == cluster) {
+            state->indexes[i].last_use = ++state->use_clock;
+            return &state->indexes[i];
+        }
+
+        // prefer an empty entry then the least recently used one
+        if (!state->indexes[i].is_valid) {
+            if (victim->is_valid) victim = &state->indexes[i];
+        } else if (victim->is_valid && state->indexes[i].last_use < victim->last_use) {
+            victim = &state->indexes[i];
+        }
+    }
+
+    if (victim->is_valid) release(victim);
+
+    if (build(victim, cluster) != SUCCESS) return NULL;
+
+    victim->last_use = ++state->use_clock;
+
+    return victim;
+}
+
+/**
+ * Find slot holding a valid record with given name in a directory.
+ *
+ * param cluster - first cluster of directory
+ * param name    - record name
+ * param record  - if found then receives record
+ * param slot    - if found then receives record position in directory
+ *
+ * returns - TRUE if found FALSE otherwise.
+ * on error - returns ERROR if directory cannot be read or indexed.
+**/
+static int dir_index_lookup_locked(DWORD cluster, char *name, Record *record, DWORD *slot) {
+    DirIndex *index = index_of(cluster);
+
+    if (index == NULL) return ERROR;
+
+    DWORD hash = name_hash(name);
+    DWORD candidate = index->buckets[hash & index->bucket_mask];
+
+    // confirm every slot with same hash against its record on disk
+    while (candidate != NO_SLOT) {
+        if (index->nodes[candidate].hash == hash) {
+            Record desc;
+
+            if (read_dir_record(cluster, candidate, &desc) != SUCCESS) return ERROR;
+
+            if (desc.TypeVal != TYPEVAL_INVALIDO && strcmp(desc.name, name) == 0) {
+                memcpy(record, &desc, RECORD_SIZE);
+                *slot = candidate;
+                return TRUE;
+            }
+        }
+
+        candidate = index->nodes[candidate].next;
+    }
+
+    return FALSE;
+}
+
+/**
+ * Find lowest free slot of a directory.
+ *
+ * param cluster - first cluster of directory
+ * param slot    - receives free record position in directory
+ *
+ * on error - returns ERROR if directory is full, cannot be read or indexed
+ *            otherwise SUCCESS.
+**/
+static int dir_index_free_slot_locked(DWORD cluster, DWORD *slot) {
+    DirIndex *index = index_of(cluster);
+
+    if (index == NULL) return ERROR;
+
+    DWORD word;
+
+    // lowest set bit of first non empty word is the first free slot
+    for (word = 0; word < index->free_map_words; word++) {
+        if (index->free_map[word] != 0) {
+            DWORD free_slot = word * BITS_PER_WORD + __builtin_ctzll(index->free_map[word]);
+
+            if (free_slot >= index->slots) return ERROR;
+
+            *slot = free_slot;
+            return SUCCESS;
+        }
+    }
+
+    return ERROR;
+}
+
+/**
+ * Keep index of a directory in sync with a record update. Called by
+ * write_dir_record for every record it changes.
+ *
+ * param cluster    - first cluster of directory
+ * param slot       - record position in directory
+ * param old_record - previous record content
+ * param new_record - current record content
+**/
+static void dir_index_note_change_locked(DWORD cluster, DWORD slot, Record *old_record, Record *new_record) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    int i;
+
+    for (i = 0; i < DIR_INDEX_DIRS; i++) {
+        if (!state->indexes[i].is_valid || state->indexes[i].cluster != cluster) continue;
+
+        DirIndex *index = &state->indexes[i];
+
+        // slot outside of indexed chain means directory grew so rebuild later
+        if (slot >= index->slots) {
+            release(index);
+            return;
+        }
+
+        if (old_record->TypeVal != TYPEVAL_INVALIDO && is_used(index, slot))
+            unlink_slot(index, slot);
+
+        if (new_record->TypeVal != TYPEVAL_INVALIDO)
+            link_slot(index, slot, name_hash(new_record->name));
+
+        return;
+    }
+}
+
+/**
+ * Drop index of a directory. Used when its cluster is released, reused
+ * or rewritten as a whole.
+**/
+static void dir_index_drop_locked(DWORD cluster) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    int i;
+
+    for (i = 0; i < DIR_INDEX_DIRS; i++) {
+        if (state->indexes[i].is_valid && state->indexes[i].cluster == cluster)
+            release(&state->indexes[i]);
+    }
+}
+
+/**
+ * Cluster at a given position of a directory chain, answered from index
+ * so that deep slots do not walk the FAT.
+ *
+ * param cluster  - first cluster of directory
+ * param position - zero-based position in chain
+ *
+ * returns - cluster number or END_OF_FILE if chain is shorter than position.
+**/
+static DWORD dir_index_cluster_at_locked(DWORD cluster, DWORD position) {
+    DirIndex *index = index_of(cluster);
+
+    // without an index walk the chain
+    if (index == NULL) return chain_cluster_at(cluster, position);
+
+    if (position >= index->cluster_count) return END_OF_FILE;
+
+    return index->clusters[position];
+}
+
+/**
+ * Find first slot holding a valid record at or after a given slot.
+ *
+ * param cluster - first cluster of directory
+ * param from    - slot where search starts
+ * param slot    - if found then receives slot of valid record
+ *
+ * returns - TRUE if found FALSE if there are no more valid records.
+ * on error - returns ERROR if directory cannot be read or indexed.
+**/
+static int dir_index_next_used_locked(DWORD cluster, DWORD from, DWORD *slot) {
+    DirIndex *index = index_of(cluster);
+
+    if (index == NULL) return ERROR;
+
+    if (from >= index->slots) return FALSE;
+
+    DWORD word = from / BITS_PER_WORD;
+
+    // invert free bits so that used slots are set and ignore bits below from
+    uint64_t bits = ~index->free_map[word] & (~(uint64_t) 0 << (from % BITS_PER_WORD));
+
+    while (TRUE) {
+        if (bits != 0) {
+            DWORD used = word * BITS_PER_WORD + __builtin_ctzll(bits);
+
+            if (used >= index->slots) return FALSE;
+
+            *slot = used;
+            return TRUE;
+        }
+
+        word++;
+
+        if (word >= index->free_map_words) return FALSE;
+
+        bits = ~index->free_map[word];
+    }
+}
+
+/**
+ * Number of valid records in a directory.
+ *
+ * on error - returns ERROR if directory cannot be read or indexed.
+**/
+static int dir_index_entries_locked(DWORD cluster) {
+    DirIndex *index = index_of(cluster);
+
+    if (index == NULL) return ERROR;
+
+    DWORD free_slots = 0;
+    DWORD word;
+
+    for (word = 0; word < index->free_map_words; word++)
+        free_slots += __builtin_popcountll(index->free_map[word]);
+
+    return index->slots - free_slots;
+}
+
+/**
+ * Append an empty cluster to index of a directory after its chain grew.
+ * Bucket heads are rehashed from stored slot hashes when slots outgrow
+ * them, without reading directory again. If directory is not indexed
+ * nothing is done since index is built from whole chain on next use.
+ *
+ * param cluster     - first cluster of directory
+ * param new_cluster - cluster appended to directory chain
+ *
+ * on error - returns ERROR if memory cannot be allocated (index is dropped)
+ *            otherwise SUCCESS.
+**/
+static int dir_index_extend_locked(DWORD cluster, DWORD new_cluster) {
+    Mount *mount = current_mount();
+    struct DirIndexState *state = mount->dir_index;
+
+    int i;
+
+    for (i = 0; i < DIR_INDEX_DIRS; i++) {
+        if (!state->indexes[i].is_valid || state->indexes[i].cluster != cluster) continue;
+
+        DirIndex *index = &state->indexes[i];
+
+        DWORD per_cluster = records_per_sector() * mount->super.SectorsPerCluster;
+        DWORD slots = index->slots + per_cluster;
+        DWORD words = (slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+        DWORD *clusters = realloc(index->clusters, (index->cluster_count + 1) * sizeof(DWORD));
+        if (clusters != NULL) index->clusters = clusters;
+
+        SlotNode *nodes = realloc(index->nodes, slots * sizeof(SlotNode));
+        if (nodes != NULL) index->nodes = nodes;
+
+        uint64_t *free_map = realloc(index->free_map, words * sizeof(uint64_t));
+        if (free_map != NULL) index->free_map = free_map;
+
+        if (clusters == NULL || nodes == NULL || free_map == NULL) {
+            release(index);
+            return ERROR;
+        }
+
+        index->clusters[index->cluster_count++] = new_cluster;
+
+        DWORD word;
+        for (word = index->free_map_words; word < words; word++)
+            index->free_map[word] = 0;
+
+        index->free_map_words = words;
+
+        DWORD slot;
+
+        // new slots start free
+        for (slot = index->slots; slot < slots; slot++) {
+            index->nodes[slot].next = NO_SLOT;
+            index->free_map[slot / BITS_PER_WORD] |= (uint64_t) 1 << (slot % BITS_PER_WORD);
+        }
+
+        index->slots = slots;
+
+        // keep about one bucket per slot
+        if (slots > index->bucket_mask + 1) {
+            DWORD buckets = (index->bucket_mask + 1) * 2;
+            while (buckets < slots) buckets <<= 1;
+
+            DWORD *heads = realloc(index->buckets, buckets * sizeof(DWORD));
+
+            if (heads == NULL) {
+                release(index);
+                return ERROR;
+            }
+
+            index->buckets = heads;
+            index->bucket_mask = buckets - 1;
+
+            memset(index->buckets, 0xFF, buckets * sizeof(DWORD));
+
+            // relink used slots with their stored hash
+            for (slot = 0; slot < slots; slot++) {
+                if (is_used(index, slot)) link_slot(index, slot, index->nodes[slot].hash);
+            }
+        }
+
+        return SUCCESS;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Create empty directory index of current mount.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int dir_index_create(void) {
+    struct DirIndexState *state = calloc(1, sizeof(struct DirIndexState));
+
+    if (state == NULL) return ERROR;
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&state->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    current_mount()->dir_index = state;
+
+    return SUCCESS;
+}
+
+/**
+ * Release every index of current mount.
+**/
+void dir_index_destroy(void) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    if (state == NULL) return;
+
+    int i;
+    for (i = 0; i < DIR_INDEX_DIRS; i++)
+        if (state->indexes[i].is_valid) release(&state->indexes[i]);
+
+    pthread_mutex_destroy(&state->lock);
+
+    free(state);
+    current_mount()->dir_index = NULL;
+}
+
+/**
+ * Public entry points: each one runs its _locked counterpart holding directory index lock.
+**/
+int dir_index_lookup(DWORD cluster, char *name, Record *record, DWORD *slot) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    pthread_mutex_lock(&state->lock);
+    int result = dir_index_lookup_locked(cluster, name, record, slot);
+    pthread_mutex_unlock(&state->lock);
+
+    return result;
+}
+
+int dir_index_free_slot(DWORD cluster, DWORD *slot) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    pthread_mutex_lock(&state->lock);
+    int result = dir_index_free_slot_locked(cluster, slot);
+    pthread_mutex_unlock(&state->lock);
+
+    return result;
+}
+
+void dir_index_note_change(DWORD cluster, DWORD slot, Record *old_record, Record *new_record) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    pthread_mutex_lock(&state->lock);
+    dir_index_note_change_locked(cluster, slot, old_record, new_record);
+    pthread_mutex_unlock(&state->lock);
+}
+
+void dir_index_drop(DWORD cluster) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    pthread_mutex_lock(&state->lock);
+    dir_index_drop_locked(cluster);
+    pthread_mutex_unlock(&state->lock);
+}
+
+DWORD dir_index_cluster_at(DWORD cluster, DWORD position) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    pthread_mutex_lock(&state->lock);
+    DWORD result = dir_index_cluster_at_locked(cluster, position);
+    pthread_mutex_unlock(&state->lock);
+
+    return result;
+}
+
+int dir_index_next_used(DWORD cluster, DWORD from, DWORD *slot) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    pthread_mutex_lock(&state->lock);
+    int result = dir_index_next_used_locked(cluster, from, slot);
+    pthread_mutex_unlock(&state->lock);
+
+    return result;
+}
+
+int dir_index_entries(DWORD cluster) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    pthread_mutex_lock(&state->lock);
+    int result = dir_index_entries_locked(cluster);
+    pthread_mutex_unlock(&state->lock);
+
+    return result;
+}
+
+int dir_index_extend(DWORD cluster, DWORD new_cluster) {
+    struct DirIndexState *state = current_mount()->dir_index;
+
+    pthread_mutex_lock(&state->lock);
+    int result = dir_index_extend_locked(cluster, new_cluster);
+    pthread_mutex_unlock(&state->lock);
+
+    return result;
+}
@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "../include/fs_helper.h"
+#include "../include/fat_alloc.h"
+#include "../include/apidisk.h"
+
+// number of clusters tracked by each bitmap word (same number of entries
+// a FAT sector holds, so each word maps to exactly one FAT sector)
+#define BITS_PER_WORD 64
+
+// clean unmount summary id and checksum seed
+#define SUMMARY_ID "FSUM"
+#define SUMMARY_SEED 0x54324653
+
+// clean unmount summary kept in unused tail of superblock sector. It is
+// valid only while disk FAT was not written since it was stored.
+typedef struct {
+    char id[4];
+    DWORD cluster_count;
+    DWORD free_count;
+    DWORD hint;
+    DWORD checksum;
+} FatSummary;
+
+// position of summary in superblock sector
+#define SUMMARY_OFFSET (SECTOR_SIZE - sizeof(FatSummary))
+
+// allocator state of a mount
+struct AllocState {
+    // bitmap with one bit per data cluster where a set bit means free cluster
+    uint64_t *free_map;
+
+    // number of words in free_map
+    DWORD free_map_words;
+
+    // number of clusters tracked by free_map
+    DWORD total_clusters;
+
+    // number of bits set in free_map
+    DWORD free_clusters;
+
+    // next-fit rotor pointing to cluster where next search starts
+    DWORD rotor;
+
+    // TRUE while disk holds a valid clean unmount summary
+    int summary_on_disk;
+
+    // guards FAT and bitmap. Recursive since a FAT batch holds it while
+    // allocating through functions that take it again.
+    pthread_mutex_t lock;
+};
+
+/**
+ * Create empty allocator state of current mount. Bitmap is built later
+ * by alloc_init.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int alloc_create(void) {
+    struct AllocState *state = calloc(1, sizeof(struct AllocState));
+
+    if (state == NULL) return ERROR;
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&state->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    current_mount()->alloc_state = state;
+
+    return SUCCESS;
+}
+
+/**
+ * Release allocator state of current mount.
+**/
+void alloc_destroy(void) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    if (state == NULL) return;
+
+    free(state->free_map);
+    pthread_mutex_destroy(&state->lock);
+
+    free(state);
+    current_mount()->alloc_state = NULL;
+}
+
+/**
+ * Take allocator lock guarding FAT and free cluster bitmap.
+**/
+void alloc_lock(void) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    pthread_mutex_lock(&state->lock);
+}
+
+/**
+ * Release allocator lock.
+**/
+void alloc_unlock(void) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Number of clusters that have both a FAT entry and a data area slot.
+ *
+ * returns - number of usable clusters.
+**/
+static DWORD usable_clusters(void) {
+    Mount *mount = current_mount();
+
+    // entries available in FAT
+    DWORD fat_entries = fat_sectors_count() * (SECTOR_SIZE / FAT_ENTRY_SIZE);
+
+    // clusters available in data area
+    DWORD data_clusters = (mount->super.NofSectors - mount->super.DataSectorStart) / mount->super.SectorsPerCluster;
+
+    return fat_entries < data_clusters ? fat_entries : data_clusters;
+}
+
+/**
+ * Set or clear the free bit of a cluster updating free counter.
+ **/
+static void set_free_bit(DWORD cluster, int is_free) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    if (cluster >= state->total_clusters) return;
+
+    uint64_t mask = (uint64_t) 1 << (cluster % BITS_PER_WORD);
+    uint64_t *word = &state->free_map[cluster / BITS_PER_WORD];
+
+    // nothing to do if bit already has requested state
+    if (((*word & mask) != 0) == (is_free != 0)) return;
+
+    if (is_free) {
+        *word |= mask;
+        state->free_clusters++;
+    } else {
+        *word &= ~mask;
+        state->free_clusters--;
+    }
+}
+
+/**
+ * Checksum of a summary.
+**/
+static DWORD summary_checksum(FatSummary *summary) {
+    return SUMMARY_SEED ^ summary->cluster_count ^ summary->free_count ^ summary->hint;
+}
+
+/**
+ * Read clean unmount summary from superblock sector.
+ *
+ * returns - TRUE if disk holds a valid summary for this FAT FALSE otherwise.
+**/
+static int read_summary(FatSummary *summary) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    BYTE buffer[SECTOR_SIZE];
+
+    if (read_sector(0, buffer) != SUCCESS) return FALSE;
+
+    memcpy(summary, buffer + SUMMARY_OFFSET, sizeof(FatSummary));
+
+    return memcmp(summary->id, SUMMARY_ID, 4) == 0 &&
+           summary->checksum == summary_checksum(summary) &&
+           summary->cluster_count == state->total_clusters &&
+           summary->free_count <= state->total_clusters &&
+           summary->hint < state->total_clusters;
+}
+
+/**
+ * Store a summary (or erase it when summary is NULL) in superblock
+ * sector. Superblock sector never goes through buffer cache.
+ *
+ * on error - returns ERROR if sector cannot be read or written otherwise SUCCESS.
+**/
+static int write_summary(FatSummary *summary) {
+    BYTE buffer[SECTOR_SIZE];
+
+    if (read_sector(0, buffer) != SUCCESS) return ERROR;
+
+    if (summary != NULL) memcpy(buffer + SUMMARY_OFFSET, summary, sizeof(FatSummary));
+    else memset(buffer + SUMMARY_OFFSET, 0, sizeof(FatSummary));
+
+    return write_sector(0, buffer) == SUCCESS ? SUCCESS : ERROR;
+}
+
+/**
+ * Build free cluster bitmap. Must be called after in-memory FAT
+ * is prepared.
+ *
+ * When disk holds a clean unmount summary, free counter and rotor come
+ * from it and the bitmap is filled as FAT sectors are paged in, so no
+ * FAT sector is read here. Otherwise the whole FAT is read (one request
+ * per run of sectors) and counted.
+ *
+ * on error - returns ERROR if bitmap cannot be allocated or FAT cannot
+ *            be read otherwise SUCCESS.
+**/
+int alloc_init(void) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    state->total_clusters = usable_clusters();
+    state->free_map_words = (state->total_clusters + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    free(state->free_map);
+    state->free_map = calloc(state->free_map_words, sizeof(uint64_t));
+
+    if (state->free_map == NULL) return ERROR;
+
+    FatSummary summary;
+
+    state->summary_on_disk = read_summary(&summary);
+
+    if (state->summary_on_disk) {
+        state->free_clusters = summary.free_count;
+        state->rotor = summary.hint;
+
+        return SUCCESS;
+    }
+
+    // mark every free FAT entry in bitmap while reading it
+    if (fat_page_in_all() != SUCCESS) return ERROR;
+
+    // count free clusters a word at a time
+    DWORD word;
+    state->free_clusters = 0;
+    for (word = 0; word < state->free_map_words; word++)
+        state->free_clusters += __builtin_popcountll(state->free_map[word]);
+
+    state->rotor = 0;
+
+    return SUCCESS;
+}
+
+/**
+ * Mark free clusters of FAT entries just read into in-memory FAT in bitmap.
+ * Called by FAT paging for every range it reads. Free counter is left
+ * alone since it already accounts for clusters not read yet.
+ *
+ * param first - first cluster whose entry was read
+ * param count - number of entries read
+**/
+void alloc_note_fat_loaded(DWORD first, DWORD count) {
+    Mount *mount = current_mount();
+    struct AllocState *state = mount->alloc_state;
+
+    // bitmap not built yet
+    if (state->free_map == NULL) return;
+
+    DWORD cluster;
+    DWORD end = first + count < state->total_clusters ? first + count : state->total_clusters;
+
+    for (cluster = first; cluster < end; cluster++) {
+        if (mount->fat[cluster] == FREE_CLUSTER)
+            state->free_map[cluster / BITS_PER_WORD] |= (uint64_t) 1 << (cluster % BITS_PER_WORD);
+    }
+}
+
+/**
+ * Erase clean unmount summary from disk before FAT on disk changes. The
+ * erase is made durable first, so a crash never leaves a stale summary
+ * next to an updated FAT. Does nothing once erased.
+ *
+ * on error - returns ERROR if summary cannot be erased otherwise SUCCESS.
+**/
+int alloc_summary_clear(void) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    if (!state->summary_on_disk) return SUCCESS;
+
+    alloc_lock();
+
+    int result = SUCCESS;
+
+    if (state->summary_on_disk) {
+        result = write_summary(NULL) == SUCCESS && sync_disk() == 0 ? SUCCESS : ERROR;
+
+        if (result == SUCCESS) state->summary_on_disk = FALSE;
+    }
+
+    alloc_unlock();
+
+    return result;
+}
+
+/**
+ * Store free counter and rotor as clean unmount summary so next mount
+ * needs no FAT scan. Every dirty FAT sector must be flushed before.
+ *
+ * on error - returns ERROR if summary cannot be written otherwise SUCCESS.
+**/
+int alloc_summary_write(void) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    alloc_lock();
+
+    int result = SUCCESS;
+
+    // disk summary is still valid since FAT was not written
+    if (!state->summary_on_disk) {
+        FatSummary summary;
+
+        memcpy(summary.id, SUMMARY_ID, 4);
+        summary.cluster_count = state->total_clusters;
+        summary.free_count = state->free_clusters;
+        summary.hint = state->rotor;
+        summary.checksum = summary_checksum(&summary);
+
+        result = write_summary(&summary);
+
+        if (result == SUCCESS) state->summary_on_disk = TRUE;
+    }
+
+    alloc_unlock();
+
+    return result;
+}
+
+/**
+ * Free bits of a bitmap word, paging its FAT sector in first (bits of
+ * sectors not read yet are all clear).
+**/
+static uint64_t free_word(DWORD word) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    fat_page_in(word * BITS_PER_WORD);
+
+    return state->free_map[word];
+}
+
+/**
+ * Find first free cluster at or after start without wrapping.
+ *
+ * returns  - free cluster number.
+ * on error - returns ERROR if there is no free cluster in [start, end).
+**/
+static DWORD find_free_from(DWORD start, DWORD end) {
+    if (start >= end) return ERROR;
+
+    DWORD word = start / BITS_PER_WORD;
+
+    // ignore bits below start in first word
+    uint64_t bits = free_word(word) & (~(uint64_t) 0 << (start % BITS_PER_WORD));
+
+    while (TRUE) {
+        if (bits != 0) {
+            // lowest set bit is the first free cluster in this word
+            DWORD cluster = word * BITS_PER_WORD + __builtin_ctzll(bits);
+
+            return cluster < end ? cluster : ERROR;
+        }
+
+        word++;
+
+        if (word * BITS_PER_WORD >= end) return ERROR;
+
+        bits = free_word(word);
+    }
+}
+
+/**
+ * Allocate a free cluster marking its FAT entry as END_OF_FILE.
+ *
+ * Search starts at the next-fit rotor (one past the last allocated
+ * cluster) and wraps around, testing 64 clusters at a time.
+ *
+ * returns  - allocated cluster number.
+ * on error - returns ERROR if there is no free cluster or FAT cant be written.
+**/
+DWORD alloc_cluster(void) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    alloc_lock();
+
+    DWORD cluster = ERROR;
+
+    // search from rotor to end and then from start to rotor
+    if (state->free_clusters > 0) {
+        cluster = find_free_from(state->rotor, state->total_clusters);
+
+        if (cluster == ERROR)
+            cluster = find_free_from(0, state->rotor);
+    }
+
+    // claim cluster on FAT (this clears its free bit)
+    if (cluster != ERROR && set_value_to_fat(cluster, END_OF_FILE) != SUCCESS)
+        cluster = ERROR;
+
+    if (cluster != ERROR)
+        state->rotor = cluster + 1 < state->total_clusters ? cluster + 1 : 0;
+
+    alloc_unlock();
+
+    return cluster;
+}
+
+/**
+ * Find first used cluster at or after start without wrapping.
+ *
+ * returns - used cluster number or end if all clusters in [start, end) are free.
+**/
+static DWORD find_used_from(DWORD start, DWORD end) {
+    if (start >= end) return end;
+
+    DWORD word = start / BITS_PER_WORD;
+
+    // invert free bits so that used clusters are set and ignore bits below start
+    uint64_t bits = ~free_word(word) & (~(uint64_t) 0 << (start % BITS_PER_WORD));
+
+    while (TRUE) {
+        if (bits != 0) {
+            DWORD cluster = word * BITS_PER_WORD + __builtin_ctzll(bits);
+
+            return cluster < end ? cluster : end;
+        }
+
+        word++;
+
+        if (word * BITS_PER_WORD >= end) return end;
+
+        bits = ~free_word(word);
+    }
+}
+
+/**
+ * Find a free run in [start, end) holding count clusters or the
+ * largest free run found otherwise.
+ *
+ * param run_start - receives first cluster of run
+ * param run_len   - receives run length (may be less than count)
+**/
+static void find_run_from(DWORD start, DWORD end, DWORD count, DWORD *run_start, DWORD *run_len) {
+    DWORD cluster = start;
+
+    while (cluster < end) {
+        // skip used clusters and then measure free run
+        DWORD free_start = find_free_from(cluster, end);
+
+        if (free_start == ERROR) return;
+
+        DWORD used = find_used_from(free_start, end);
+
+        if (used - free_start > *run_len) {
+            *run_start = free_start;
+            *run_len = used - free_start;
+
+            if (*run_len >= count) return;
+        }
+
+        cluster = used;
+    }
+}
+
+/**
+ * Allocate count clusters and append them to a chain with allocator
+ * lock already held (see alloc_chain).
+**/
+static int chain_locked(DWORD last, DWORD count, DWORD *first) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    DWORD allocated = 0;
+
+    if (first != NULL) *first = END_OF_FILE;
+
+    while (allocated < count && state->free_clusters > 0) {
+        DWORD wanted = count - allocated;
+        DWORD run_start = 0;
+        DWORD run_len = 0;
+
+        // look for a run from rotor to end and then from start to rotor
+        find_run_from(state->rotor, state->total_clusters, wanted, &run_start, &run_len);
+
+        if (run_len < wanted)
+            find_run_from(0, state->rotor, wanted, &run_start, &run_len);
+
+        if (run_len == 0) break;
+
+        if (run_len > wanted) run_len = wanted;
+
+        DWORD index;
+
+        // link run clusters to each other and close it with EOF
+        for (index = 0; index < run_len; index++) {
+            DWORD next = index + 1 < run_len ? run_start + index + 1 : END_OF_FILE;
+
+            if (set_value_to_fat(run_start + index, next) != SUCCESS) return ERROR;
+        }
+
+        // append run to chain
+        if (last != END_OF_FILE) {
+            if (set_value_to_fat(last, run_start) != SUCCESS) return ERROR;
+        } else if (first != NULL) {
+            *first = run_start;
+        }
+
+        last = run_start + run_len - 1;
+        allocated += run_len;
+
+        state->rotor = last + 1 < state->total_clusters ? last + 1 : 0;
+    }
+
+    return allocated;
+}
+
+/**
+ * Allocate count clusters and append them to a chain.
+ *
+ * Clusters are reserved as contiguous runs: a single run holding all
+ * of them is preferred and, when free space is fragmented, the largest
+ * runs available are taken one after another. Each run is linked in
+ * FAT as consecutive entries and the last cluster is marked END_OF_FILE.
+ * Callers should wrap this in a FAT batch.
+ *
+ * param last  - last cluster of chain being extended or END_OF_FILE for a new chain
+ * param count - number of clusters wanted
+ * param first - if not NULL receives first allocated cluster
+ *
+ * returns  - number of clusters allocated (less than count if disk is full).
+ * on error - returns ERROR if FAT cant be written.
+**/
+int alloc_chain(DWORD last, DWORD count, DWORD *first) {
+    alloc_lock();
+
+    int result = chain_locked(last, count, first);
+
+    alloc_unlock();
+
+    return result;
+}
+
+/**
+ * Release a cluster marking its FAT entry as FREE_CLUSTER.
+ *
+ * on error - returns ERROR if FAT cant be written otherwise SUCCESS.
+**/
+int alloc_release(DWORD cluster) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    if (cluster >= state->total_clusters) return ERROR;
+
+    return set_value_to_fat(cluster, FREE_CLUSTER);
+}
+
+/**
+ * Keep bitmap in sync with a FAT entry update. Called by
+ * set_value_to_fat for every entry it changes.
+ *
+ * param cluster   - FAT entry that changed
+ * param old_value - previous entry value
+ * param new_value - current entry value
+**/
+void alloc_note_fat_change(DWORD cluster, DWORD old_value, DWORD new_value) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    // bitmap not built yet
+    if (state->free_map == NULL) return;
+
+    if (old_value == FREE_CLUSTER && new_value != FREE_CLUSTER)
+        set_free_bit(cluster, FALSE);
+    else if (old_value != FREE_CLUSTER && new_value == FREE_CLUSTER)
+        set_free_bit(cluster, TRUE);
+}
+
+/**
+ * Number of free clusters in data area.
+ *
+ * returns - free cluster counter.
+**/
+DWORD alloc_free_count(void) {
+    struct AllocState *state = current_mount()->alloc_state;
+
+    alloc_lock();
+
+    DWORD count = state->free_clusters;
+
+    alloc_unlock();
+
+    return count;
+}
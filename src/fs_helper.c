@@ -2,133 +2,420 @@
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <pthread.h>
 #include "../include/fs_helper.h"
 #include "../include/t2fs.h"
 #include "../include/apidisk.h"
-
+#include "../include/fat_alloc.h"
+#include "../include/buffer_cache.h"
+#include "../include/dentry_cache.h"
+#include "../include/dir_index.h"
+#include "../include/path_arena.h"
+#include "../include/fs_lock.h"
+
+#include "../include/mount.h"
+
+// number of chunks a handle table may hold (chunk k holds
+// HANDLE_TABLE_INITIAL << k entries)
+#define HANDLE_CHUNKS (HANDLE_INDEX_BITS - HANDLE_TABLE_INITIAL_BITS + 1)
+
+// number of epoch counters shared by all chains and directories
+#define EPOCH_SLOTS 1024
+
+// opened file and directory tables of a mount
+struct HandleTables {
+    // handle table chunks (entries never move once allocated)
+    OpenedFile *file_chunks[HANDLE_CHUNKS];
+    OpenedDir *dir_chunks[HANDLE_CHUNKS];
+
+    // number of entries in allocated chunks (published after chunk setup)
+    int files_capacity;
+    int dirs_capacity;
+
+    // heads of handle table free lists (ERROR when empty)
+    int free_file_slot;
+    int free_dir_slot;
+
+    // number of handles in use
+    int num_opened_files;
+    int num_opened_dirs;
+
+    // guard free lists, growth and opened counters of each table
+    pthread_mutex_t files_lock;
+    pthread_mutex_t dirs_lock;
+
+    // bumped whenever a chain is cut or a directory record is written, so
+    // handles notice stale cursors and cluster buffers on next use without
+    // walking handle tables
+    DWORD chain_epochs[EPOCH_SLOTS];
+    DWORD dir_epochs[EPOCH_SLOTS];
+};
+
+#ifdef T2FS_AUTO_MOUNT
 /**
  * Called by gcc attributes before main execution and responsible for
- * global vars initialization
+ * loading the default mount (t2fs_disk.dat). Only built in compatibility
+ * mode (AUTO_MOUNT=1), otherwise default mount is loaded by t2fs_init or
+ * on first call.
  * 
- * on error - sigkill.
+ * on error - sigterm.
 **/
 static void initialize(void) __attribute__((constructor));
 static void initialize(void) {
-    // initialize superblock and store function exit code
-    int is_superblock_init = initialize_superblock();
-
-    // if cannot initialize superblock then kill program by sending
-    // a sigkill
-    if (is_superblock_init == ERROR) {
-        psignal(SIGTERM, "cannot initialize superblock from sector zero");
+    // if cannot read superblock or FAT then kill program by sending
+    // a sigterm
+    if (mount_load(&default_mount) != SUCCESS) {
+        psignal(SIGTERM, "cannot mount t2fs_disk.dat");
         raise(SIGTERM);
     }
+}
+#endif
 
-    // initialize current directory poiting to data dir after root
-    // based on superblock structure
-    initialize_curr_dir(&superblock);
-
-    // sets the opened file counter to 0
-    num_opened_files = 0;
-	num_opened_dirs = 0;
-
-    set_local_fat();
+/**
+ * Called by gcc attributes after main execution (or exit) and responsible
+ * for writing back every dirty sector still held by any mount.
+**/
+static void finalize(void) __attribute__((destructor));
+static void finalize(void) {
+    mount_flush_all();
 }
 
 /*
- *  Refresh in-memmory fat table.
+ *  Prepare in-memmory fat table.
+ *
+ * Nothing is read here: FAT sectors are paged into in-memory FAT on first
+ * touch (see fat_page_in), so mount cost does not grow with disk size.
  *
  * This function is declared here because is not supposed 
  * to be accessed from outside.
 */
 int set_local_fat() {
-    // allocate the necessary memory for a local instance of FAT
-    local_fat = malloc(SECTOR_SIZE * superblock.DataSectorStart - superblock.pFATSectorStart);
-    
-    int index;
+    Mount *mount = current_mount();
 
-    int can_read_write = SUCCESS;
+    // fat sectors never go through buffer cache since in-memory
+    // FAT already keeps the whole table in memory
 
-    // temp variable to save the content of a sector
-    unsigned char sector_content[SECTOR_SIZE];
+    // number of sectors that FAT occupies on disk
+    DWORD fat_sectors = fat_sectors_count();
 
-    for (index = superblock.pFATSectorStart; index < superblock.DataSectorStart; index++) {
-        int fat_index = (index - superblock.pFATSectorStart) * SECTOR_SIZE/4;
-        
-        can_read_write = read_sector(index, sector_content);
-        
-        if (can_read_write != SUCCESS) return ERROR;
+    // allocate the necessary memory for a local instance of FAT, its
+    // dirty and resident sector flags only once since FAT size never
+    // changes (pages of in-memory FAT never touched are never committed)
+    if (mount->fat == NULL) {
+        mount->fat = malloc(SECTOR_SIZE * fat_sectors);
+        mount->fat_dirty = calloc(fat_sectors, sizeof(BYTE));
+        mount->fat_resident = calloc(fat_sectors, sizeof(BYTE));
 
-        memcpy(&local_fat[fat_index], sector_content, SECTOR_SIZE);
+        if (mount->fat == NULL || mount->fat_dirty == NULL || mount->fat_resident == NULL) return ERROR;
     }
 
+    // no sector is resident yet so nothing is dirty
+    memset(mount->fat_dirty, FALSE, fat_sectors);
+    memset(mount->fat_resident, FALSE, fat_sectors);
+
+    return SUCCESS;
+}
+
+/**
+ * Read count FAT sectors starting at first into in-memory FAT with a single
+ * request and mark them as resident. Allocator lock must be held and
+ * none of them may be resident.
+ *
+ * on error - returns ERROR if sectors cannot be read otherwise SUCCESS.
+**/
+static int fat_read_range(DWORD first, DWORD count) {
+    Mount *mount = current_mount();
+
+    // calculates the number of entries per sector on FAT
+    DWORD entries_per_sector = SECTOR_SIZE / FAT_ENTRY_SIZE;
+
+    if (read_sectors(mount->super.pFATSectorStart + first, count, (unsigned char *) &mount->fat[first * entries_per_sector]) != SUCCESS)
+        return ERROR;
+
+    DWORD index;
+
+    // readers check the flag without lock so publish entries first
+    for (index = first; index < first + count; index++)
+        __atomic_store_n(&mount->fat_resident[index], TRUE, __ATOMIC_RELEASE);
+
+    // free clusters of new sectors become visible to allocator
+    alloc_note_fat_loaded(first * entries_per_sector, count * entries_per_sector);
+
     return SUCCESS;
 }
 
+/**
+ * Make sure FAT sector holding entry of a cluster is in memory. A
+ * missing sector is read together with the missing sectors following
+ * it (up to fat_readahead option) since chains and allocator scans
+ * usually move forward.
+ *
+ * on error - returns ERROR if cluster is beyond FAT or its sector
+ *            cannot be read otherwise SUCCESS.
+**/
+int fat_page_in(DWORD cluster) {
+    Mount *mount = current_mount();
+
+    DWORD entries_per_sector = SECTOR_SIZE / FAT_ENTRY_SIZE;
+    DWORD fat_sectors = fat_sectors_count();
+    DWORD sector = cluster / entries_per_sector;
+
+    if (sector >= fat_sectors) return ERROR;
+
+    if (__atomic_load_n(&mount->fat_resident[sector], __ATOMIC_ACQUIRE)) return SUCCESS;
+
+    alloc_lock();
+
+    int result = SUCCESS;
+
+    // another thread may have read it while waiting
+    if (!mount->fat_resident[sector]) {
+        DWORD count = 1;
+
+        while (count < mount->options.fat_readahead && sector + count < fat_sectors && !mount->fat_resident[sector + count])
+            count++;
+
+        result = fat_read_range(sector, count);
+    }
+
+    alloc_unlock();
+
+    return result;
+}
+
+/**
+ * Read every FAT sector not resident yet into in-memory FAT, one request
+ * per run of missing sectors.
+ *
+ * on error - returns ERROR if a sector cannot be read otherwise SUCCESS.
+**/
+int fat_page_in_all(void) {
+    Mount *mount = current_mount();
+
+    DWORD fat_sectors = fat_sectors_count();
+    DWORD sector = 0;
+    int result = SUCCESS;
+
+    alloc_lock();
+
+    while (sector < fat_sectors && result == SUCCESS) {
+        if (mount->fat_resident[sector]) {
+            sector++;
+            continue;
+        }
+
+        DWORD count = 1;
+        while (sector + count < fat_sectors && !mount->fat_resident[sector + count])
+            count++;
+
+        result = fat_read_range(sector, count);
+        sector += count;
+    }
+
+    alloc_unlock();
+
+    return result;
+}
+
+/**
+ * Read FAT entry of a cluster paging its sector in on first touch.
+ *
+ * returns - FAT entry or END_OF_FILE if it cannot be read (so chain
+ *           walks stop there).
+**/
+DWORD get_value_from_fat(DWORD position) {
+    Mount *mount = current_mount();
+
+    if (fat_page_in(position) != SUCCESS) return END_OF_FILE;
+
+    return mount->fat[position];
+}
+
+/**
+ * Number of sectors occupied by FAT on disk.
+ *
+ * returns - number of FAT sectors.
+**/
+DWORD fat_sectors_count(void) {
+    Mount *mount = current_mount();
+
+    return mount->super.DataSectorStart - mount->super.pFATSectorStart;
+}
+
 /**
  * Save a dword on a given position of local FAT
  * Also update the FAT position on disk according to the local FAT
  *
+ * Only the FAT sector holding position is marked as dirty. If no batch
+ * is open it is written back right away, otherwise it is written once
+ * when the outermost batch ends.
+ *
  * Returns the result of write_sector (to raise an error, if necessary)
 **/
 int set_value_to_fat(int position, DWORD value) {
-    int index;
+    Mount *mount = current_mount();
+
     // calculates the number of entries per sector on FAT
     int entries_per_sector = SECTOR_SIZE / FAT_ENTRY_SIZE;
 
-	if (local_fat[position] == 0xFFFFFFFE)//we have to check if the current cluster isn't a bad one
+    // other entries of its sector are written back with it
+    if (fat_page_in(position) != SUCCESS) return ERROR;
+
+    alloc_lock();
+
+	if (mount->fat[position] == 0xFFFFFFFE) {//we have to check if the current cluster isn't a bad one
+		alloc_unlock();
 		return ERROR;
+	}
+
+    // keep free cluster bitmap in sync with this entry
+    alloc_note_fat_change(position, mount->fat[position], value);
 
     // save the value on local fat
-    local_fat[position] = value;    
+    mount->fat[position] = value;    
 
+    // a entry has 4 bytes; a sector has 256 bytes
+    // so we have 256/4 = 64 entries per sector
+    // and only the sector holding this entry needs to be written
+    mount->fat_dirty[position / entries_per_sector] = TRUE;
 
+    // inside a batch the sector is written when the batch ends
+    int result = mount->batch_depth > 0 ? SUCCESS : flush_fat();
 
-    // loop on FAT
-    for(index = superblock.pFATSectorStart; index < superblock.DataSectorStart; index++) {
-        // a entry has 4 bytes; a sector has 256 bytes
-        // so we have 256/4 = 64 entries per sector
-        // we can only write a sector each time, so we need to get
-        //     64 entries each time (a full sector) and write it
-        // therefore sector_index goes 0, 64, 128, 192, etc
-        int sector_index = (index - superblock.pFATSectorStart) * entries_per_sector;
-        if (write_sector(index, (unsigned char*)  &local_fat[sector_index]) == ERROR)
-            return ERROR;
+    alloc_unlock();
+
+    return result;
+}
+
+/**
+ * Open a FAT update batch. While a batch is open set_value_to_fat
+ * only marks sectors as dirty so a whole chain update touches each
+ * FAT sector on disk once. Batches may be nested. Allocator lock is
+ * held by the calling thread until the batch is closed.
+**/
+void fat_begin_batch(void) {
+    Mount *mount = current_mount();
+
+    alloc_lock();
+
+    mount->batch_depth++;
+}
+
+/**
+ * Close a FAT update batch flushing dirty FAT sectors when the
+ * outermost batch is closed.
+ *
+ * on error - returns ERROR if cant write a FAT sector otherwise SUCCESS.
+**/
+int fat_end_batch(void) {
+    Mount *mount = current_mount();
+
+    if (mount->batch_depth > 0)
+        mount->batch_depth--;
+
+    // an outer batch is still open so keep sectors dirty
+    int result = mount->batch_depth > 0 ? SUCCESS : flush_fat();
+
+    alloc_unlock();
+
+    return result;
+}
+
+/**
+ * Close a FAT update batch without writing anything back. Dirty FAT
+ * sectors stay in memory until next flush_fat (close2, fsync2, sync2,
+ * unmount or a batch closed by fat_end_batch).
+**/
+void fat_end_batch_deferred(void) {
+    Mount *mount = current_mount();
+
+    if (mount->batch_depth > 0)
+        mount->batch_depth--;
+
+    alloc_unlock();
+}
+
+/**
+ * Write every dirty FAT sector back to disk.
+ *
+ * on error - returns ERROR if cant write a FAT sector otherwise SUCCESS.
+**/
+int flush_fat(void) {
+    Mount *mount = current_mount();
+
+    // calculates the number of entries per sector on FAT
+    int entries_per_sector = SECTOR_SIZE / FAT_ENTRY_SIZE;
+
+    DWORD fat_sectors = fat_sectors_count();
+
+    DWORD index;
+
+    int result = SUCCESS;
+
+    alloc_lock();
+
+    // loop on FAT writing only sectors touched since last flush
+    for (index = 0; index < fat_sectors; index++) {
+        if (!mount->fat_dirty[index])
+            continue;
+
+        // disk FAT stops matching clean unmount summary from here on
+        if (alloc_summary_clear() != SUCCESS) {
+            result = ERROR;
+            break;
+        }
+
+        // sector_index goes 0, 64, 128, 192, etc
+        int sector_index = index * entries_per_sector;
+
+        if (write_sector(mount->super.pFATSectorStart + index, (unsigned char*) &mount->fat[sector_index]) != SUCCESS) {
+            result = ERROR;
+            break;
+        }
+
+        mount->fat_dirty[index] = FALSE;
     }
 
-    return SUCCESS;
+    alloc_unlock();
+
+    return result;
 }
 
 /**
- * Initialize curr_dir position to data sector after root sectors.
+ * Initialize current directory position to data sector after root sectors.
 **/
-int initialize_curr_dir(Superblock *superblock) {
-    curr_dir = superblock->DataSectorStart + superblock->RootDirCluster * superblock->SectorsPerCluster;
+int initialize_curr_dir(Superblock *block) {
+    set_curr_dir(block->DataSectorStart + block->RootDirCluster * block->SectorsPerCluster);
     return SUCCESS;
 }
 
-
 /**
-Initialize opened dir/files vector structs
+ * Change current directory pointer (a logical sector) atomically.
 **/
-void initialize_opened_structs()
-{
+void set_curr_dir(DWORD sector) {
+    Mount *mount = current_mount();
 
-	int i;
-	for (i = 0; i < MAX_OPENED_FILES; i++)
-		opened_files[i].is_used = FALSE;
-	for (i = 0; i < MAX_OPENED_DIRS; i++)
-		opened_dirs[i].is_used = FALSE;
+    __atomic_store_n(&mount->cwd_sector, sector, __ATOMIC_RELEASE);
 }
 
 
+/**
+Initialize opened dir/files vector structs
+**/
+
+
 /**
  * Read superblock from sector zero
  * 
  * on error - return -1 if cant read superblock from sector zero
 **/
 int initialize_superblock(void) {
-    // read first logical sector from disk
+    Mount *mount = current_mount();
+
+    BYTE buffer[SECTOR_SIZE];
+
+    // read first logical sector from disk (kept out of buffer cache since
+    // the clean unmount summary in its tail is written straight to disk)
     int can_read = read_sector(0, buffer);
 
     // something bad happened, disk may be corrupted
@@ -139,29 +426,29 @@ int initialize_superblock(void) {
     buffer_char = (char *) buffer;
 
     // fill fs id
-    strncpy(superblock.id, buffer_char, 4);
+    strncpy(mount->super.id, buffer_char, 4);
 
     // test fs id
-    if(strncmp(superblock.id, FS_ID, 4) != SUCCESS) {
+    if(strncmp(mount->super.id, FS_ID, 4) != SUCCESS) {
         return ERROR;
     }
 
     // fill fs version
-    superblock.version = *((WORD *) (buffer + 4));
+    mount->super.version = *((WORD *) (buffer + 4));
 
     // test fs version
-    if(superblock.version != FS_VERSION) {
+    if(mount->super.version != FS_VERSION) {
         return ERROR;
     }
 
     // fill fs parameters accordingly to specs
-    superblock.superblockSize    = *((WORD *)  (buffer + 6));
-    superblock.DiskSize          = *((DWORD *) (buffer + 8));
-    superblock.NofSectors        = *((DWORD *) (buffer + 12));
-    superblock.SectorsPerCluster = *((DWORD *) (buffer + 16));
-    superblock.pFATSectorStart   = *((DWORD *) (buffer + 20));
-    superblock.RootDirCluster    = *((DWORD *) (buffer + 24));
-    superblock.DataSectorStart   = *((DWORD *) (buffer + 28));
+    mount->super.superblockSize    = *((WORD *)  (buffer + 6));
+    mount->super.DiskSize          = *((DWORD *) (buffer + 8));
+    mount->super.NofSectors        = *((DWORD *) (buffer + 12));
+    mount->super.SectorsPerCluster = *((DWORD *) (buffer + 16));
+    mount->super.pFATSectorStart   = *((DWORD *) (buffer + 20));
+    mount->super.RootDirCluster    = *((DWORD *) (buffer + 24));
+    mount->super.DataSectorStart   = *((DWORD *) (buffer + 28));
 
     return SUCCESS;
 }
@@ -172,7 +459,9 @@ int initialize_superblock(void) {
  * returns - logical data cluster based on current directory.
 **/
 DWORD curr_data_cluster(void) {
-    return (curr_dir - superblock.DataSectorStart) / superblock.SectorsPerCluster;
+    Mount *mount = current_mount();
+
+    return (__atomic_load_n(&mount->cwd_sector, __ATOMIC_ACQUIRE) - mount->super.DataSectorStart) / mount->super.SectorsPerCluster;
 }
 
 /**
@@ -181,7 +470,9 @@ DWORD curr_data_cluster(void) {
  * returns - sector number.
 **/
 DWORD cluster_to_log_sector(DWORD cluster) {
-    return superblock.DataSectorStart + cluster * superblock.SectorsPerCluster;
+    Mount *mount = current_mount();
+
+    return mount->super.DataSectorStart + cluster * mount->super.SectorsPerCluster;
 }
 
 /**
@@ -203,751 +494,1602 @@ int records_per_sector(void) {
  * returns - TRUE if found FALSE otherwise.
 **/
 int lookup_descriptor_by_name(DWORD cluster, char *name, Record *record) {
-    // convert cluster to sector
-    int sector = cluster_to_log_sector(cluster);
-
-    // calculate number of records that fits in sector
-    int nr_of_records = records_per_sector();
-
-    // max number of sectors from current sector to reach
-    // clusters end boundary
-    // since a cluster is usually formated as four sectors we
-    // add SectorsPerCluster variable to our current sector variable
-    // to calculate its cluster boundary
-    int cluster_boundary = sector + superblock.SectorsPerCluster;
-
-    // while in boundary
-    while(sector <= cluster_boundary) {
-        // record counter
-        int i = 0;
-
-        // read our cluster sectors
-        if (read_sector(sector, buffer) != SUCCESS) return ERROR;
-
-        // loop through records of current sector
-        while(i < nr_of_records) {
-            Record desc;
-
-            // read our i(th) record from current sector
-            memcpy(&desc, buffer + (RECORD_SIZE * i), RECORD_SIZE);
-
-            // if record name equals to parameter name then we found our record
-            // also make sure this record is valid checking its typeval 
-            // typeval_invalido means that this record is empty
-            if (strcmp(desc.name, name) == 0 && desc.TypeVal != TYPEVAL_INVALIDO) {
-           
-                // store record and return true since we found it
-                memcpy(record, &desc, RECORD_SIZE);
-                return TRUE;
-            }
-
-            i++;
-        }
-
-        sector++;
-    }
-
-    // unable to find record in cluster
-    return FALSE;
+    return lookup_entry_by_name(cluster, name, record, NULL);
 }
 
 /**
- * Lookup a record returning a contiguous logical position 
- * of found record accumulating positions from previous
- * sectors util an entry with a given type
- * is found or end of cluster is reached
- *
- * e.g:
- * parent_dir      -> /dir1 -> sector 149 
- * child_record(0) -> .     -> sector 149 
- * child_record(1) -> ..    -> sector 149
- * child_record(2) -> dir2  -> sector 149
- * child_record(3) -> dir3  -> sector 149
- * child_record(4) -> this  -> sector 150
+ * Lookup record descriptor and its position by name in cluster. Result
+ * is answered from dentry cache when possible and from directory index
+ * otherwise, being stored in dentry cache afterwards (names not found are
+ * stored as negative entries).
  *
  * param cluster - logical cluster number
- * param type    - record type
- *
- * returns - contiguous record position in a cluster.
-**/
-DWORD lookup_cont_record_by_type(DWORD cluster, BYTE type) {
-    // convert cluster to sector
-    DWORD sector = cluster_to_log_sector(cluster);
-
-    // calculate number of records that fits in sector
-    int nr_of_records = records_per_sector();
-
-    // max number of sectors from current sector to reach
-    // clusters end boundary
-    // since a cluster is usually formated as four sectors we
-    // add SectorsPerCluster variable to our current sector variable
-    // to calculate its cluster boundary
-    int cluster_boundary = sector + superblock.SectorsPerCluster;
-
-    // while in boundary
-    while(sector <= cluster_boundary) {
-        // record counter
-        int i = 0;
-
-        // read our cluster sectors
-        if (read_sector(sector, buffer) != SUCCESS) return ERROR;
-
-        // loop through records of current sector
-        while(i < nr_of_records) {
-            Record desc;
-
-            // read our i(th) record from current sector
-            memcpy(&desc, buffer + (RECORD_SIZE * i), RECORD_SIZE);
-
-            // if record name equals to parameter name then we found our record
-            // also make sure this record is valid checking its typeval 
-            // typeval_invalido means that this record is empty
-            if (desc.TypeVal == type) {
-                
-                // find out which sector we are counting from a zero-based index
-                int curr_sector = (sector - cluster_boundary) + superblock.SectorsPerCluster;
-
-                // calculate continuous logical position of this record accumulating
-                // positions from previous sectors util a entry with a given condition
-                // is reached
-                // 
-                // e.g:
-                //
-                // curr_dir ->
-                // record(0) -> .    -> sector 1
-                // record(1) -> ..   -> sector 1
-                // record(2) -> dir2 -> sector 1
-                // record(3) -> dir3 -> sector 1
-                // record(4) -> this -> sector 2
-                return curr_sector * nr_of_records + i;
-            }
+ * param name    - record name that this function will try to match
+ * param record  - if matched then this variable will store record found during lookup
+ * param slot    - if not NULL and matched then receives record position in cluster
+ *
+ * returns - TRUE if found FALSE otherwise.
+ * on error - returns ERROR if cluster cannot be read.
+**/
+int lookup_entry_by_name(DWORD cluster, char *name, Record *record, DWORD *slot) {
+    // try dentry cache first
+    int cached = dcache_lookup(cluster, name, record, slot);
 
-            i++;
-        }
+    if (cached != ERROR) return cached;
 
-        sector++;
+    Record desc;
+    DWORD position = 0;
+
+    // hash lookup on directory index
+    int found = dir_index_lookup(cluster, name, &desc, &position);
+
+    if (found == ERROR) return ERROR;
+
+    if (found == FALSE) {
+        // remember that name is missing
+        dcache_insert(cluster, name, NULL, 0);
+
+        return FALSE;
     }
 
-    // unable to find record in cluster
-    return FALSE;
+    // remember it for next lookups
+    dcache_insert(cluster, name, &desc, position);
+
+    memcpy(record, &desc, RECORD_SIZE);
+
+    if (slot != NULL) *slot = position;
+
+    return TRUE;
 }
 
 /**
- * Lookup parent record descriptor by parent path.
+ * Locate a record slot of a directory on disk.
  *
- * eg.: name -> /dir1/file1.txt
- *
- * parent -> /dir
- * name   -> file1.txt
- *
- * param name    - parent path that this function will try to match (/dir in example above)
- * param record  - if matched then this variable will store record found during lookup
+ * param cluster - first cluster of directory
+ * param slot    - record position in directory
+ * param sector  - receives logical sector holding record
+ * param offset  - receives record offset inside sector
  *
- * returns - TRUE if found FALSE otherwise.
+ * on error - returns ERROR if slot is beyond directory chain otherwise SUCCESS.
 **/
-int lookup_parent_descriptor_by_name(char *name, Record *record) {
-    // calculate name length just one time to 
-    // reuse it later
-    int name_len = strlen(name) + 1;
-
-    // create an auxiliary array from name
-    // acting as a buffer to strtok without
-    // modifying external name variable passed
-    // as reference to this function
-    char aux_name[name_len];
+static int dir_record_location(DWORD cluster, DWORD slot, DWORD *sector, DWORD *offset) {
+    Mount *mount = current_mount();
 
-    strncpy(aux_name, name, name_len);
+    DWORD nr_of_records = records_per_sector();
+    DWORD per_cluster = nr_of_records * mount->super.SectorsPerCluster;
 
-    // if name equals to slash then it exists since 
-    // its on root path
-    if (strcmp(aux_name, "/") == 0) {
-        return TRUE;
-
-    // otherwise we must traverse all data sectors checking if path exists
-    } else {
-        // record type that will be reused while traversing
-        Record desc;
+    // cluster of chain holding slot (directory index skips the FAT walk)
+    DWORD data_cluster = dir_index_cluster_at(cluster, slot / per_cluster);
 
-        // calculate data cluster number from current directory
-        DWORD cluster = curr_data_cluster();
+    if (data_cluster == END_OF_FILE) return ERROR;
 
-        // tokenize name splitting by "/"
-        char *token = strtok(aux_name, "/");
+    DWORD position = slot % per_cluster;
 
-        // flag storing if name exists on disk 
-        int exists = TRUE;
+    *sector = cluster_to_log_sector(data_cluster) + position / nr_of_records;
+    *offset = (position % nr_of_records) * RECORD_SIZE;
 
-        do {
-            if (token != NULL) {
-                // look for name in first cluster storing descriptor
-                // in record pointer
-                exists = exists && lookup_descriptor_by_name(cluster, token, &desc);
+    return SUCCESS;
+}
 
-                // if record could was found in cluster then select
-                // next cluster in chain from firstCluster variable
-                // and mark exists flag as true
-                if (exists) cluster = desc.firstCluster;
+/**
+ * Read a single record of a directory.
+ *
+ * param cluster - first cluster of directory
+ * param slot    - record position in directory
+ * param record  - receives record
+ *
+ * on error - returns ERROR if record cannot be read otherwise SUCCESS.
+**/
+int read_dir_record(DWORD cluster, DWORD slot, Record *record) {
+    DWORD sector, offset;
 
-                // otherwise it was not found and we
-                // should mark exists flag as false
-                else exists = FALSE;
-            }
+    if (dir_record_location(cluster, slot, &sector, &offset) != SUCCESS) return ERROR;
 
-            // next token
-            token  = strtok(NULL, "/");
+    BYTE content[SECTOR_SIZE];
 
-        // while token is not null or exists flag is not false
-        // keep looping
-        } while(token != NULL && exists);
+    if (cache_read_sector(sector, content) != SUCCESS) return ERROR;
 
-        // if found store descriptor in record parameter
-        if (exists == TRUE) {
-            memcpy(record, &desc, RECORD_SIZE);
-        }
+    memcpy(record, content + offset, RECORD_SIZE);
 
-        // return lookup result
-        return exists;
-    }
+    return SUCCESS;
 }
 
 /**
- * Check wheter a given name exists.
+ * Write a single record of a directory keeping directory index and
+ * dentry cache in sync. Every change to a directory entry should go
+ * through this function.
  *
- * returns - physical cluster size.
- * on error - returns -1 if name does not exists or 0 if it exists.
+ * param cluster - first cluster of directory
+ * param slot    - record position in directory
+ * param record  - record to be written (TYPEVAL_INVALIDO frees slot)
+ *
+ * on error - returns ERROR if record cannot be written otherwise SUCCESS.
 **/
-int does_name_exists(char *name) {
-    // calculate name length just one time to 
-    // reuse it later
-    int name_len = strlen(name) + 1;
+int write_dir_record(DWORD cluster, DWORD slot, Record *record) {
+    DWORD sector, offset;
 
-    // create an auxiliary array from name
-    // acting as a buffer to strtok without
-    // modifying external name variable passed
-    // as reference to this function
-    char aux_name[name_len];
+    if (dir_record_location(cluster, slot, &sector, &offset) != SUCCESS) return ERROR;
 
-    strncpy(aux_name, name, name_len);
+    BYTE content[SECTOR_SIZE];
 
-    // if name equals to slash then it exists since 
-    // its on root path
-    if (strcmp(aux_name, "/") == 0) {
-        return TRUE;
+    if (cache_read_sector(sector, content) != SUCCESS) return ERROR;
 
-    // otherwise we must traverse all data sectors checking if path exists
-    } else {
-        // record type that will be reused while traversing
-        Record record;
+    Record old_record;
+    memcpy(&old_record, content + offset, RECORD_SIZE);
 
-        // if parent exists then this function call will
-        // return TRUE otherwise false
-        return lookup_parent_descriptor_by_name(name, &record);
-    }
+    memcpy(content + offset, record, RECORD_SIZE);
+
+    if (cache_write_sector(sector, content) != SUCCESS) return ERROR;
+
+    dir_index_note_change(cluster, slot, &old_record, record);
+
+    // names cached for both old and new record are stale
+    if (old_record.TypeVal != TYPEVAL_INVALIDO) dcache_invalidate(cluster, old_record.name);
+    if (record->TypeVal != TYPEVAL_INVALIDO) dcache_invalidate(cluster, record->name);
+
+    // so are directory clusters kept by readdir handles
+    invalidate_dir_buffers(cluster);
+
+    return SUCCESS;
+}
+
+/**
+ * Start walking components of a path. Components are handed out as
+ * slices of name so nothing is copied or allocated.
+**/
+void path_iter_init(PathIter *iter, const char *name) {
+    iter->cursor = name;
+    iter->part.name = name;
+    iter->part.len = 0;
 }
 
 /**
- * Last character in string.
+ * Move to next component of a path skipping repeated and trailing slashes.
  *
- * returns - last character in string or empty character (ie: (char) 0 ) if not possible
+ * eg.: name -> ../dir1//file1.txt/
+ *
+ *  ite(1): ..
+ *  ite(2): dir1
+ *  ite(3): file1.txt
+ *
+ * returns - TRUE if a component was found FALSE at end of path.
 **/
-char last_char(char *value) {
-    if (value == NULL) return '\0';
+int path_iter_next(PathIter *iter) {
+    const char *start = iter->cursor;
+
+    // skip separators before component
+    while (*start == '/') start++;
+
+    if (*start == '\0') {
+        iter->cursor = start;
+        return FALSE;
+    }
 
-    int value_len = strlen(value);
+    // component runs until next separator or end of path
+    const char *end = start;
+    while (*end != '\0' && *end != '/') end++;
 
-    int idx = value_len - 1;
+    iter->part.name = start;
+    iter->part.len = end - start;
+    iter->cursor = end;
 
-    return idx >= 0 ? value[idx] : (char) 0;
+    return TRUE;
 }
 
 /**
- * Prepend str2 in str1.
+ * Copy a path component into a terminated record name.
+ *
+ * on error - returns ERROR if component does not fit in a record name
+ *            otherwise SUCCESS.
 **/
-void str_prepend(char *str1, char *str2) {
-    char *tmp = strdup(str1);
+static int part_to_name(PathPart part, char *name) {
+    if (part.len > MAX_RECORD_NAME_LEN) return ERROR;
 
-    strncpy(str1, str2, strlen(str2) + 1);
+    memcpy(name, part.name, part.len);
+    name[part.len] = '\0';
 
-    strncat(str1, tmp, strlen(tmp));
+    return SUCCESS;
 }
 
 /**
- * Splits path name into head and tail parts storing
- * it on result parameter.
+ * Resolve a path in a single walk from root directory (absolute path) or
+ * current directory (relative path) down to its last component.
+ *
+ * Repeated and trailing slashes are ignored, "." components are skipped
+ * and ".." components follow the parent entry of each directory. A path
+ * made only of slashes names root directory itself (its "." entry).
+ *
+ * eg.: name -> /dir1/file1.txt
+ *
+ *  parent -> first cluster of /dir1
+ *  name   -> file1.txt
  *
- * eg.: path consisting of the following name will be split as:
- *  
- *  name -> /home/aluno/sisop/t2fs 
- *  
- *  tail -> /home/aluno/sisop 
- *  head -> t2fs
+ * param name   - absolute or relative path
+ * param result - receives parent directory, last component name and, if
+ *                last component exists, its record and slot
+ *
+ * returns  - TRUE if last component exists FALSE if only its parent does.
+ * on error - returns ERROR if path is empty or too long, a component does
+ *            not fit in a record name or a middle component is missing or
+ *            is not a directory.
 **/
-int path_from_name(char *name, Path *result) {
-    // if name is only slash then we dont need to worry
-    // about extracting path we can just set curr_dir to
-    // root dir cluster
-    if (strcmp(name, "/") == 0) {
-        strncpy(result->tail, "/", 1);
-
-        return SUCCESS;
-    }
+int resolve_path(const char *name, PathLookup *result) {
+    Mount *mount = current_mount();
 
-    // calculate name length
-    const int name_len = strlen(name);
-
-    // validate name length
-    if (name_len <= 0 || name_len >= MAX_PATH_SIZE) {
+    if (name == NULL || name[0] == '\0' || strnlen(name, MAX_PATH_SIZE) >= MAX_PATH_SIZE)
         return ERROR;
-    }
 
-    // allocate head, tail character
-    // arrays that will fill path struct later on
-    char head[name_len]; 
-    char tail[name_len];
-    char both[name_len];
-
-    // empty string arrays
-    head[0] = 0;
-    tail[0] = 0;
-    both[0] = 0;
-
-    // extract first and second character from name parameter
-    char fst_char_raw = name_len > 0 ? name[0] : (char) 0;
-    char snd_char_raw = name_len > 1 ? name[1] : (char) 0;
-
-    // is only .. without trailling slash
-    int parent_only = fst_char_raw == '.' && snd_char_raw == '.' && name_len == 2;
-
-    // check if name start with ../
-    int starts_with_dot2 = fst_char_raw == '.' && snd_char_raw == '.';
-
-    // check if name starts with ./
-    int starts_with_dot_slash = fst_char_raw == '.' && snd_char_raw == '/';
-
-    // remove .. or ./ from path if name parameter starts with it
-    char *sanitized_name = NULL;
-    if (starts_with_dot_slash) sanitized_name = name + 2;
-    else if (parent_only) sanitized_name = name + 2;
-    else if (starts_with_dot2) sanitized_name = name + 3;
-    else sanitized_name = name;
-
-    //  check if name starts with slash
-    int starts_with_slash = fst_char_raw == '/';
-
-    // after removing ./ or .. from name include it on tail so
-    // it can be used by tokenizer loop later
-    if (starts_with_dot2 || parent_only) strncat(tail, "../", 3);
-    else if (starts_with_dot_slash || !starts_with_slash) strncat(tail, "./", 2);
-
-    // create an auxiliary array from name
-    // acting as a buffer to strtok without
-    // modifying external name variable passed
-    // as reference to this function
-    char aux_token[strlen(sanitized_name)];
-    strcpy(aux_token, sanitized_name);
-
-    // tokenize name splitting by "/"
-    char *token = strtok(aux_token, "/");
-
-    // iterate through remaining path using tokenizer to 
-    // concating current head to tail until no 
-    // slash character is found
-    //
-    // eg.:
-    // 
-    // name -> /home/aluno/sisop/t2fs 
-    // ite(1): tail -> /home | head -> aluno
-    // ite(2): tail -> /home/aluno | head -> sisop
-    // ite(3): tail -> /home/aluno/sisop | head -> t2fs
-    do {
-        
-        if (token != NULL && strlen(head) >= 1) {
-            strncat(tail, head, strlen(head) + 1);
-        }
+    // absolute paths start at root directory
+    DWORD cluster = name[0] == '/' ? mount->super.RootDirCluster : curr_data_cluster();
 
-        if (token != NULL) {
-            strncpy(head, token, strlen(token) + 1);
-        }
+    PathIter iter;
+    path_iter_init(&iter, name);
 
-        token = strtok(NULL, "/");
+    // path made only of slashes names the directory itself
+    PathPart part = { ".", 1 };
+    int found = path_iter_next(&iter);
+    if (found) part = iter.part;
 
-        char tail_last_char = last_char(tail);
+    // walk every component but last, which must all be directories
+    while (found && path_iter_next(&iter)) {
+        int is_dot = part.len == 1 && part.name[0] == '.';
 
-        if (token != NULL && tail_last_char != '/') {
-            strncat(tail, "/", 1);
-        }
+        // "." keeps walk in same directory
+        if (!is_dot) {
+            Record dir;
+            DWORD slot;
 
-    } while (token != NULL);
+            if (part_to_name(part, result->name) != SUCCESS) return ERROR;
 
-    // fill result with generated data
-    // from tokenizer steps
-    strncpy(result->tail, tail, strlen(tail) + 1);
-    strncpy(result->head, head, strlen(head) + 1);
+            node_lock_shared(cluster);
+            int found_dir = lookup_entry_by_name(cluster, result->name, &dir, &slot);
+            node_unlock(cluster);
 
-    // concat tail
-    strncat(both, tail, strlen(tail) + 1);
+            if (found_dir != TRUE) return ERROR;
 
-    // calculate head length
-    int head_len = strlen(head);
+            // only directories can be walked through
+            if (dir.TypeVal != TYPEVAL_DIRETORIO) return ERROR;
 
-    // if path is relative we should not concat slashes at end=
+            cluster = dir.firstCluster;
+        }
 
-    // concat head if not empty and if tail is not slash-ending
-    if (head_len > 0) {
-        char tail_last_char = last_char(tail);
+        part = iter.part;
+    }
 
-        if (tail_last_char != '/') strncat(both, "/", 1);
+    result->parent = cluster;
 
-        strncat(both, head, strlen(head) + 1);
-    }
+    if (part_to_name(part, result->name) != SUCCESS) return ERROR;
 
-    // copy concatenation to both attribute in result structure
-    strncpy(result->both, both, strlen(both) + 1);
+    node_lock_shared(cluster);
+    int exists = lookup_entry_by_name(cluster, result->name, &result->record, &result->slot);
+    node_unlock(cluster);
 
-    return SUCCESS;
+    return exists;
 }
 
+/**
+ * Whether a directory is still alive, ie: its self pointer was not
+ * released by rmdir2. Directory node must be locked.
+**/
+static int is_live_dir(DWORD cluster) {
+    Record self;
+
+    if (read_dir_record(cluster, 0, &self) != SUCCESS) return FALSE;
+
+    return self.TypeVal == TYPEVAL_DIRETORIO && self.firstCluster == cluster && strcmp(self.name, ".") == 0;
+}
 
 /**
- * Lookup record descriptor by its cluster number.
- *
- * param cluster - logical cluster number
- * param record  - if matched then this variable will store record found during lookup
+ * Resolve a path like resolve_path and lock for writing its parent
+ * directory and, if last component exists, its node too. Path is
+ * resolved again whenever locked entry no longer matches the one found
+ * while walking (a concurrent change raced with this one).
  *
- * returns - TRUE if found FALSE otherwise.
+ * returns  - same as resolve_path. Nodes stay locked when TRUE or FALSE
+ *            is returned and are released by unlock_path.
+ * on error - returns ERROR if path cannot be resolved or parent directory
+ *            was removed meanwhile (nothing stays locked).
 **/
-int lookup_descriptor_by_cluster(DWORD cluster, Record *record) {
-    // find parent directory by .. logical reference
-    Record parent_dir;
-    lookup_descriptor_by_name(cluster, "..", &parent_dir);
+int lock_path(const char *name, PathLookup *result) {
+    while (TRUE) {
+        int exists = resolve_path(name, result);
 
-    // allocate a buffer for storing cluster content
-    unsigned char content[SECTOR_SIZE * superblock.SectorsPerCluster];
-    read_cluster(parent_dir.firstCluster, content);
+        if (exists == ERROR) return ERROR;
 
-    // loop thourgh parent directory to our entry
-    int i;
-    Record tmp_record;
-    for (i = 0; i < records_per_sector() * superblock.SectorsPerCluster; i++) {
+        DWORD target = exists == TRUE ? result->record.firstCluster : result->parent;
 
-        // calculate cluster position
-        int position_on_cluster = i * RECORD_SIZE;
+        node_lock_pair(result->parent, target);
 
-        // Copy the current record do parent dir to tmp_record
-        memcpy(&tmp_record, &content[position_on_cluster], RECORD_SIZE);
+        if (!is_live_dir(result->parent)) {
+            node_unlock_pair(result->parent, target);
+            return ERROR;
+        }
+
+        Record record;
+        DWORD slot;
+        int locked = lookup_entry_by_name(result->parent, result->name, &record, &slot);
 
-        // check if current entry is equals to cluster then we 
-        // have our record
-        if (tmp_record.firstCluster == cluster) {
-            memcpy(record, &tmp_record, RECORD_SIZE);
+        // same answer as walk so locked view is the one caller saw
+        if (locked == exists && (exists == FALSE || (record.firstCluster == target && slot == result->slot))) {
+            if (exists == TRUE) memcpy(&result->record, &record, RECORD_SIZE);
 
-            return SUCCESS;
+            return exists;
         }
 
-    }
+        node_unlock_pair(result->parent, target);
 
-    // unable to find record then return error
-    return ERROR;
+        if (locked == ERROR) return ERROR;
+    }
 }
 
 /**
- * Physical cluster size calculated by sector per cluster from superblock.
- * 
- * returns  - physical cluster size.
+ * Release nodes locked by lock_path.
+ *
+ * param exists - value returned by lock_path
 **/
-DWORD phys_cluster_size(void) {
-    return SECTOR_SIZE * superblock.SectorsPerCluster;
+void unlock_path(PathLookup *path, int exists) {
+    node_unlock_pair(path->parent, exists == TRUE ? path->record.firstCluster : path->parent);
 }
 
 /**
- * Convert logical FAT sector entry to physical sector entry.
- * 
- * returns  - physical sector entry in FAT.
+ * Prepend str2 in str1.
 **/
-DWORD fat_log_to_phys(DWORD lsector) {
-    return (lsector -1) * SECTOR_SIZE;
+void str_prepend(char *str1, char *str2) {
+    char *tmp = strdup(str1);
+
+    strncpy(str1, str2, strlen(str2) + 1);
+
+    strncat(str1, tmp, strlen(tmp));
 }
 
+
 /**
- * Convert phyisical FAT sector entry to logical sector entry.
- * 
- * returns  - logical sector entry in FAT.
+ * Find entry of a directory whose record starts at a given cluster.
+ *
+ * param dir     - first cluster of directory to search
+ * param cluster - first cluster of wanted record
+ * param record  - if found then receives record
+ * param slot    - if found then receives record position in directory
+ *
+ * returns - TRUE if found FALSE otherwise.
 **/
-DWORD fat_phys_to_log(DWORD psector) {
-    return superblock.pFATSectorStart + (DWORD)((double) psector / SECTOR_SIZE);
-}
+static int lookup_slot_by_cluster(DWORD dir, DWORD cluster, Record *record, DWORD *slot) {
+    DWORD position = 0;
 
-/**
- * Finds first free physical entry in FAT.
+    // walk valid entries only through directory index
+    while (dir_index_next_used(dir, position, &position) == TRUE) {
+        if (read_dir_record(dir, position, record) != SUCCESS) return FALSE;
+
+        // skip . and .. since they may point to the cluster too
+        if (record->firstCluster == cluster && strcmp(record->name, ".") != 0 && strcmp(record->name, "..") != 0) {
+            *slot = position;
+            return TRUE;
+        }
+
+        position++;
+    }
+
+    return FALSE;
+}
+
+/**
+ * Lookup record descriptor by its cluster number.
+ *
+ * param cluster - logical cluster number
+ * param record  - if matched then this variable will store record found during lookup
+ *
+ * returns - TRUE if found FALSE otherwise.
+**/
+int lookup_descriptor_by_cluster(DWORD cluster, Record *record) {
+    // find parent directory by .. logical reference
+    Record parent_dir;
+
+    node_lock_shared(cluster);
+    int found = lookup_descriptor_by_name(cluster, "..", &parent_dir);
+    node_unlock(cluster);
+
+    if (found != TRUE) return ERROR;
+
+    // loop thourgh parent directory to our entry
+    DWORD slot;
+
+    node_lock_shared(parent_dir.firstCluster);
+    found = lookup_slot_by_cluster(parent_dir.firstCluster, cluster, record, &slot);
+    node_unlock(parent_dir.firstCluster);
+
+    if (found == TRUE)
+        return SUCCESS;
+
+    // unable to find record then return error
+    return ERROR;
+}
+
+/**
+ * Store new size of a grown directory in its . record and in its entry
+ * inside parent directory. Directory node must be locked for writing.
+ * Parent entry is only updated when parent can be locked without
+ * waiting (waiting could deadlock against a thread walking down), the
+ * . record being the authoritative size.
+ *
+ * param cluster  - first cluster of directory
+ * param clusters - number of clusters in directory chain
+**/
+static void update_dir_size(DWORD cluster, DWORD clusters) {
+    Record record;
+    DWORD slot;
+
+    // self pointer is always first record
+    if (read_dir_record(cluster, 0, &record) == SUCCESS && strcmp(record.name, ".") == 0) {
+        record.clustersFileSize = clusters;
+        record.bytesFileSize = clusters * phys_cluster_size();
+        write_dir_record(cluster, 0, &record);
+    }
+
+    // root directory has no entry in a parent
+    Record parent;
+    if (lookup_descriptor_by_name(cluster, "..", &parent) != TRUE || parent.firstCluster == cluster)
+        return;
+
+    if (!node_trylock_exclusive(parent.firstCluster)) return;
+
+    if (lookup_slot_by_cluster(parent.firstCluster, cluster, &record, &slot) == TRUE) {
+        record.clustersFileSize = clusters;
+        record.bytesFileSize = clusters * phys_cluster_size();
+        write_dir_record(parent.firstCluster, slot, &record);
+    }
+
+    node_unlock(parent.firstCluster);
+}
+
+/**
+ * Find a free record slot in a directory growing it by one cluster
+ * along its FAT chain when every slot is taken. Directory node must be
+ * locked for writing.
+ *
+ * param cluster - first cluster of directory
+ * param slot    - receives free record position in directory
+ *
+ * on error - returns ERROR if disk is full or directory cannot be
+ *            written otherwise SUCCESS.
+**/
+int alloc_dir_slot(DWORD cluster, DWORD *slot) {
+    Mount *mount = current_mount();
+
+    if (dir_index_free_slot(cluster, slot) == SUCCESS) return SUCCESS;
+
+    // find last cluster of directory chain
+    DWORD clusters = 1;
+    DWORD last = cluster;
+    while (get_value_from_fat(last) != END_OF_FILE) {
+        last = get_value_from_fat(last);
+        clusters++;
+    }
+
+    // link a new cluster after last one
+    fat_begin_batch();
+    int allocated = alloc_chain(last, 1, NULL);
+    if (fat_end_batch() != SUCCESS || allocated != 1) return ERROR;
+
+    DWORD new_cluster = get_value_from_fat(last);
+
+    // new cluster may hold records from a released file or directory
+    unsigned char empty[SECTOR_SIZE * mount->super.SectorsPerCluster];
+    memset(empty, 0x00, sizeof(empty));
+
+    if (write_cluster(new_cluster, empty) != SUCCESS) return ERROR;
+
+    dir_index_extend(cluster, new_cluster);
+
+    update_dir_size(cluster, clusters + 1);
+
+    // first slot of new cluster is free
+    *slot = clusters * records_per_sector() * mount->super.SectorsPerCluster;
+
+    return SUCCESS;
+}
+
+/**
+ * Physical cluster size calculated by sector per cluster from superblock.
  * 
- * returns  - physical entry index since first sector in FAT.
- * on error - returns ERROR if cant read fat partition or theres no free entry.
+ * returns  - physical cluster size.
+**/
+DWORD phys_cluster_size(void) {
+    Mount *mount = current_mount();
+
+    return SECTOR_SIZE * mount->super.SectorsPerCluster;
+}
+
+/**
+ * Read logical cluster and saves its content to the result buffer
+ *
+ * on error - returns ERROR if cant read from cluster otherwise SUCCESS.
+**/
+int read_cluster(int cluster, unsigned char *result) {
+    return read_clusters(cluster, 1, result);
+}
+
+/**
+ * Writes content to logical cluster
+ *
+ * on error - returns ERROR if cant write to cluster otherwise SUCCESS.
+**/
+int write_cluster(int cluster, unsigned char *content) {
+    return write_clusters(cluster, 1, content);
+}
+
+/**
+ * Read count contiguous logical clusters starting at cluster with
+ * a single multi-sector disk request.
+ *
+ * on error - returns ERROR if cant read from clusters otherwise SUCCESS.
+**/
+int read_clusters(DWORD cluster, DWORD count, unsigned char *result) {
+    Mount *mount = current_mount();
+
+    DWORD index;
+
+    for (index = 0; index < count; index++) {
+        if (get_value_from_fat(cluster + index) == BAD_SECTOR)//testing if it is a bad block
+            return ERROR;
+    }
+
+    if (cache_read_sectors(cluster_to_log_sector(cluster), count * mount->super.SectorsPerCluster, result) != SUCCESS)
+        return ERROR;
+
+    return SUCCESS;
+}
+
+/**
+ * Write count contiguous logical clusters starting at cluster with
+ * a single multi-sector disk request.
+ *
+ * on error - returns ERROR if cant write to clusters otherwise SUCCESS.
+**/
+int write_clusters(DWORD cluster, DWORD count, unsigned char *content) {
+    Mount *mount = current_mount();
+
+    if (cache_write_sectors(cluster_to_log_sector(cluster), count * mount->super.SectorsPerCluster, content) != SUCCESS)
+        return ERROR;
+
+    return SUCCESS;
+}
+
+/**
+ * Cluster number at a given position of a FAT chain.
+ *
+ * param first - first cluster of chain
+ * param index - zero-based position in chain
+ *
+ * returns - cluster number or END_OF_FILE if chain is shorter than index.
+**/
+DWORD chain_cluster_at(DWORD first, DWORD index) {
+    DWORD cluster = first;
+
+    while (index > 0 && cluster != END_OF_FILE && cluster != FREE_CLUSTER) {
+        cluster = get_value_from_fat(cluster);
+        index--;
+    }
+
+    return index == 0 ? cluster : END_OF_FILE;
+}
+
+/**
+ * Build cluster array of an opened file chain. Chain is followed on FAT
+ * up to END_OF_FILE since record size may not yet account for clusters
+ * appended by an ongoing write.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+static int build_file_chain(OpenedFile *opened) {
+    DWORD capacity = opened->file.clustersFileSize > 0 ? opened->file.clustersFileSize : 1;
+
+    free(opened->chain);
+    opened->chain = malloc(capacity * sizeof(DWORD));
+    opened->chain_len = 0;
+
+    if (opened->chain == NULL) return ERROR;
+
+    DWORD cluster = opened->file.firstCluster;
+
+    while (cluster != END_OF_FILE && cluster != FREE_CLUSTER) {
+        // grow array when chain is longer than expected
+        if (opened->chain_len == capacity) {
+            DWORD *grown = realloc(opened->chain, capacity * 2 * sizeof(DWORD));
+
+            if (grown == NULL) {
+                free(opened->chain);
+                opened->chain = NULL;
+                opened->chain_len = 0;
+                return ERROR;
+            }
+
+            opened->chain = grown;
+            capacity *= 2;
+        }
+
+        opened->chain[opened->chain_len++] = cluster;
+        cluster = get_value_from_fat(cluster);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Cluster number at a given position of an opened file chain.
+ *
+ * Sequential access walks forward from the handle cursor so each new
+ * cluster costs one FAT step. Going backwards builds the cluster array
+ * of the handle once and answers from it afterwards.
+ *
+ * param handle - opened file handle
+ * param index  - zero-based position in chain
+ *
+ * returns - cluster number or END_OF_FILE if chain is shorter than index.
+**/
+DWORD file_cluster_at(OpenedFile *opened, DWORD index) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    DWORD epoch = __atomic_load_n(&handles->chain_epochs[opened->file.firstCluster % EPOCH_SLOTS], __ATOMIC_ACQUIRE);
+
+    // chain was cut or released since handle last used it
+    if (opened->chain_epoch != epoch) {
+        free(opened->chain);
+        opened->chain = NULL;
+        opened->chain_len = 0;
+
+        file_cursor_set(opened, 0, opened->file.firstCluster);
+        opened->chain_epoch = epoch;
+    }
+
+    // cursor is behind requested position so walk forward from it
+    if (index >= opened->cursor_index) {
+        DWORD from_index = opened->cursor_index;
+        DWORD from_cluster = opened->cursor_cluster;
+
+        // cluster array may let us start closer
+        if (opened->chain != NULL && opened->chain_len > 0 && opened->chain_len - 1 > from_index) {
+            from_index = index < opened->chain_len ? index : opened->chain_len - 1;
+            from_cluster = opened->chain[from_index];
+        }
+
+        DWORD cluster = chain_cluster_at(from_cluster, index - from_index);
+
+        if (cluster != END_OF_FILE) file_cursor_set(opened, index, cluster);
+
+        return cluster;
+    }
+
+    // going backwards so answer from cluster array
+    if (opened->chain == NULL && build_file_chain(opened) != SUCCESS)
+        return chain_cluster_at(opened->file.firstCluster, index);
+
+    if (index >= opened->chain_len) return END_OF_FILE;
+
+    file_cursor_set(opened, index, opened->chain[index]);
+
+    return opened->chain[index];
+}
+
+/**
+ * Move cursor of an opened file to a known chain position.
+**/
+void file_cursor_set(OpenedFile *opened, DWORD index, DWORD cluster) {
+    opened->cursor_index = index;
+    opened->cursor_cluster = cluster;
+}
+
+/**
+ * Make chain cursor and cluster array of every handle opened on the
+ * file starting at first_cluster stale, so they are reset on next use.
+ * Must be called whenever that chain is cut or released.
+**/
+void invalidate_file_cursors(DWORD first_cluster) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    __atomic_add_fetch(&handles->chain_epochs[first_cluster % EPOCH_SLOTS], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Make directory cluster kept by every handle opened on the directory
+ * starting at first_cluster stale. Must be called whenever one of its
+ * records is written.
+**/
+void invalidate_dir_buffers(DWORD first_cluster) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    __atomic_add_fetch(&handles->dir_epochs[first_cluster % EPOCH_SLOTS], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Number of physically contiguous clusters of a FAT chain starting
+ * at cluster (ie: cluster, cluster + 1, ... linked in this order).
+ *
+ * param cluster - first cluster of run
+ * param max     - max run length to report
+ *
+ * returns - run length (at least 1 when max is not zero).
+**/
+DWORD chain_run_length(DWORD cluster, DWORD max) {
+    DWORD length = 1;
+
+    if (max == 0) return 0;
+
+    while (length < max && get_value_from_fat(cluster + length - 1) == cluster + length)
+        length++;
+
+    return length;
+}
+
+/**
+ * Check if the max number of files was reached
+ * If the max num is reached, you can not open a new file
+ *
+ * Returns 0 if can open; -1 if can't
+**/
+int can_open() {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    return (__atomic_load_n(&handles->num_opened_files, __ATOMIC_RELAXED) < MAX_OPENED_FILES) ? SUCCESS : ERROR;
+}
+
+/**
+ * Chunk of a handle table holding a given index.
+ *
+ * param offset - receives index position inside chunk
+ *
+ * returns - chunk number.
+**/
+static int chunk_of(int index, int *offset) {
+    int position = index + HANDLE_TABLE_INITIAL;
+    int chunk = 31 - __builtin_clz(position) - HANDLE_TABLE_INITIAL_BITS;
+
+    *offset = position - (HANDLE_TABLE_INITIAL << chunk);
+
+    return chunk;
+}
+
+/**
+ * Grow a handle table by one chunk twice as large as the previous one.
+ * Entries already allocated never move, so handles in use by other
+ * threads stay valid. Table lock must be held.
+ *
+ * param chunks       - chunk array of table
+ * param capacity     - current number of slots
+ * param entry_size   - size of a table slot
+ * param max          - max number of slots
+ * param new_capacity - receives number of slots after growing
+ *
+ * returns  - index of first new slot.
+ * on error - returns ERROR if table reached max or memory cannot be allocated.
+**/
+static int grow_table(void **chunks, int capacity, size_t entry_size, int max, int *new_capacity) {
+    if (capacity >= max) return ERROR;
+
+    int offset;
+    int chunk = chunk_of(capacity, &offset);
+    int entries = HANDLE_TABLE_INITIAL << chunk;
+
+    if (entries > max - capacity) entries = max - capacity;
+
+    // new slots start zeroed (not used, generation 0)
+    void *grown = calloc(entries, entry_size);
+
+    if (grown == NULL) return ERROR;
+
+    chunks[chunk] = grown;
+    *new_capacity = capacity + entries;
+
+    return capacity;
+}
+
+/**
+ * Opened file at a table index.
+**/
+static OpenedFile *file_slot(int index) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    int offset;
+    int chunk = chunk_of(index, &offset);
+
+    return &handles->file_chunks[chunk][offset];
+}
+
+/**
+ * Opened directory at a table index.
+**/
+static OpenedDir *dir_slot(int index) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    int offset;
+    int chunk = chunk_of(index, &offset);
+
+    return &handles->dir_chunks[chunk][offset];
+}
+
+/**
+ * Create empty handle tables of current mount.
+ *
+ * on error - returns ERROR if memory cannot be allocated otherwise SUCCESS.
+**/
+int handles_create(void) {
+    struct HandleTables *handles = calloc(1, sizeof(struct HandleTables));
+
+    if (handles == NULL) return ERROR;
+
+    handles->free_file_slot = ERROR;
+    handles->free_dir_slot = ERROR;
+
+    pthread_mutex_init(&handles->files_lock, NULL);
+    pthread_mutex_init(&handles->dirs_lock, NULL);
+
+    current_mount()->handle_tables = handles;
+
+    return SUCCESS;
+}
+
+/**
+ * Release handle tables of current mount. Handles still opened are
+ * closed without writing anything back.
+**/
+void handles_destroy(void) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    if (handles == NULL) return;
+
+    int i;
+
+    for (i = 0; i < handles->files_capacity; i++) {
+        OpenedFile *opened = file_slot(i);
+
+        free(opened->chain);
+        free(opened->tail_data);
+        pthread_mutex_destroy(&opened->lock);
+    }
+
+    for (i = 0; i < handles->dirs_capacity; i++) {
+        OpenedDir *opened = dir_slot(i);
+
+        if (opened->is_used) path_release(opened->path);
+
+        free(opened->cluster_data);
+        pthread_mutex_destroy(&opened->lock);
+    }
+
+    for (i = 0; i < HANDLE_CHUNKS; i++) {
+        free(handles->file_chunks[i]);
+        free(handles->dir_chunks[i]);
+    }
+
+    pthread_mutex_destroy(&handles->files_lock);
+    pthread_mutex_destroy(&handles->dirs_lock);
+
+    free(handles);
+    current_mount()->handle_tables = NULL;
+}
+
+/**
+ * Take a free slot of opened files table growing it when needed. Table
+ * lock must be held.
+ *
+ * returns  - slot index.
+ * on error - returns ERROR if table cannot grow.
+**/
+static int take_file_slot(void) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    if (handles->free_file_slot == ERROR) {
+        int capacity;
+        int first = grow_table((void **) handles->file_chunks, handles->files_capacity, sizeof(OpenedFile), MAX_OPENED_FILES, &capacity);
+
+        if (first == ERROR) return ERROR;
+
+        // chain new slots into free list
+        int i;
+        for (i = first; i < capacity; i++) {
+            OpenedFile *opened = file_slot(i);
+
+            pthread_mutex_init(&opened->lock, NULL);
+            opened->index = i;
+            opened->next_free = i + 1 < capacity ? i + 1 : ERROR;
+        }
+
+        // handles may now reach new slots
+        __atomic_store_n(&handles->files_capacity, capacity, __ATOMIC_RELEASE);
+
+        handles->free_file_slot = first;
+    }
+
+    int index = handles->free_file_slot;
+    handles->free_file_slot = file_slot(index)->next_free;
+
+    return index;
+}
+
+/**
+ * Take a free slot of opened dirs table growing it when needed. Table
+ * lock must be held.
+ *
+ * returns  - slot index.
+ * on error - returns ERROR if table cannot grow.
+**/
+static int take_dir_slot(void) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    if (handles->free_dir_slot == ERROR) {
+        int capacity;
+        int first = grow_table((void **) handles->dir_chunks, handles->dirs_capacity, sizeof(OpenedDir), MAX_OPENED_DIRS, &capacity);
+
+        if (first == ERROR) return ERROR;
+
+        // chain new slots into free list
+        int i;
+        for (i = first; i < capacity; i++) {
+            OpenedDir *opened = dir_slot(i);
+
+            pthread_mutex_init(&opened->lock, NULL);
+            opened->index = i;
+            opened->next_free = i + 1 < capacity ? i + 1 : ERROR;
+        }
+
+        // handles may now reach new slots
+        __atomic_store_n(&handles->dirs_capacity, capacity, __ATOMIC_RELEASE);
+
+        handles->free_dir_slot = first;
+    }
+
+    int index = handles->free_dir_slot;
+    handles->free_dir_slot = dir_slot(index)->next_free;
+
+    return index;
+}
+
+/**
+ * Build handle from a table index and its slot generation.
+**/
+static int make_handle(int index, int generation) {
+    return ((generation & HANDLE_GENERATION_MASK) << HANDLE_INDEX_BITS) | index;
+}
+
+/**
+ * Split a handle checking it against table slot generation.
+ *
+ * returns  - table index.
+ * on error - returns ERROR if handle is out of table, slot is not used or
+ *            slot generation differs.
 **/
-DWORD phys_fat_first_fit(void) {
-    int sector = 0;
-    
-    // loop through fat sectors until end of fat (data sector is reached)
-    for (sector = superblock.pFATSectorStart; sector < superblock.DataSectorStart; sector++) {
-        int entry = 0;
-
-        // a sector has 256 bytes in total and will be read into
-        // buffer global var
-        const int can_read = read_sector(sector, buffer);
-        
-        // if we cannot read this sector for some reason
-        // something bad happened to disk and we should return error
-        if (can_read == ERROR) return ERROR;
-        
-        // a sector contains 64 entries made up of 4 bytes each
-        while (entry < SECTOR_SIZE) {
-        
-            // increment buffer by entry
-            const DWORD entry_pos = ((int) buffer) + entry;
-
-            // read current entry value
-            const DWORD entry_val = *(DWORD *) entry_pos;
-
-            // check if current entry points to a free cluster (represented by value 0x00000000)
-            if (entry_val == FREE_CLUSTER) {
-                // calculate initial point for each sector
-                // decrementing since sectors are zero based
-                // and superblock fat start is one based
-                // eg.: sector = 1
-                // (1 - 1) * 256 = 0
-                // eg.: sector = 2
-                // (2 - 1) * 256 = 256
-                const int cur_sector = fat_log_to_phys(sector);
-
-                // since entry are made up by 4 bytes we must
-                // divide it by fat entry size (4 bytes) to calculate
-                // current entry index
-                const int cur_entry = entry / FAT_ENTRY_SIZE;
-
-                // return entry index which is made by sector and entry summed up
-                return cur_sector + cur_entry;
-            }
+static int handle_index(int handle, int is_used, int generation) {
+    if (!is_used) return ERROR;
 
-            // increment entry by one
-            entry += FAT_ENTRY_SIZE;
-        }
+    if (((handle >> HANDLE_INDEX_BITS) & HANDLE_GENERATION_MASK) != (generation & HANDLE_GENERATION_MASK))
+        return ERROR;
+
+    return handle & ((1 << HANDLE_INDEX_BITS) - 1);
+}
+
+/**
+ * Lock opened file of a handle for exclusive use by calling thread.
+ *
+ * returns  - opened file (release with file_handle_release).
+ * on error - returns NULL if handle is not opened or is stale (its slot
+ *            was closed and reused).
+**/
+OpenedFile *file_handle_acquire(FILE2 handle) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    if (handle < 0) return NULL;
+
+    int index = handle & (MAX_OPENED_FILES - 1);
+
+    if (index >= __atomic_load_n(&handles->files_capacity, __ATOMIC_ACQUIRE)) return NULL;
+
+    OpenedFile *opened = file_slot(index);
+
+    pthread_mutex_lock(&opened->lock);
+
+    if (handle_index(handle, opened->is_used, opened->generation) == ERROR) {
+        pthread_mutex_unlock(&opened->lock);
+        return NULL;
     }
 
-    // unable to find a free cluster in fat
-    return ERROR;
+    return opened;
 }
 
 /**
- * Read logical cluster and saves its content to the result buffer
+ * Unlock opened file taken by file_handle_acquire.
+**/
+void file_handle_release(OpenedFile *opened) {
+    pthread_mutex_unlock(&opened->lock);
+}
+
+/**
+ * Lock opened directory of a handle for exclusive use by calling thread.
  *
- * on error - returns ERROR if cant read from cluster otherwise SUCCESS.
+ * returns  - opened directory (release with dir_handle_release).
+ * on error - returns NULL if handle is not opened or is stale.
 **/
-int read_cluster(int cluster, unsigned char *result) {
-    int starting_sector = superblock.DataSectorStart + cluster * superblock.SectorsPerCluster;
-    
-    int sector_index;
-    
-    int can_read_write = SUCCESS;
+OpenedDir *dir_handle_acquire(DIR2 handle) {
+    struct HandleTables *handles = current_mount()->handle_tables;
 
-	if (local_fat[cluster]== 0xFFFFFFFE)//testing if it is a bad block
-		return ERROR;
+    if (handle < 0) return NULL;
 
-    for(sector_index = 0; sector_index < superblock.SectorsPerCluster; sector_index++) {
-        can_read_write = read_sector(starting_sector + sector_index, &result[sector_index * SECTOR_SIZE]);
+    int index = handle & (MAX_OPENED_DIRS - 1);
 
-        if (can_read_write != SUCCESS) return ERROR;
+    if (index >= __atomic_load_n(&handles->dirs_capacity, __ATOMIC_ACQUIRE)) return NULL;
+
+    OpenedDir *opened = dir_slot(index);
+
+    pthread_mutex_lock(&opened->lock);
+
+    if (handle_index(handle, opened->is_used, opened->generation) == ERROR) {
+        pthread_mutex_unlock(&opened->lock);
+        return NULL;
     }
 
-    return SUCCESS;
+    return opened;
 }
 
 /**
- * Writes content to logical cluster
+ * Unlock opened directory taken by dir_handle_acquire.
+**/
+void dir_handle_release(OpenedDir *opened) {
+    pthread_mutex_unlock(&opened->lock);
+}
+
+/**
+ * Save a record on the list of opened files
  *
- * on error - returns ERROR if cant write to cluster otherwise SUCCESS.
+ * param parent_cluster - first cluster of directory holding the file entry
+ * param slot           - slot of the file entry in that directory
+ *
+ * Returns -1 on Error; handle of the opened file on Success
 **/
-int write_cluster(int cluster, unsigned char *content) {
-    int starting_sector = superblock.DataSectorStart + cluster * superblock.SectorsPerCluster;
-    
-    int sector_index;
+int save_as_opened(Record record, DWORD parent_cluster, DWORD slot) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    pthread_mutex_lock(&handles->files_lock);
+
+    // take first slot of free list
+    int i = can_open() == SUCCESS ? take_file_slot() : ERROR;
 
-    int can_read_write = SUCCESS;
+    OpenedFile *opened = i != ERROR ? file_slot(i) : NULL;
 
-    for(sector_index = 0; sector_index < superblock.SectorsPerCluster; sector_index++) {
-        can_read_write = write_sector(starting_sector + sector_index, &content[sector_index * SECTOR_SIZE]);
+    if (opened != NULL) {
+        // increase the opened files counter
+        handles->num_opened_files++;
 
-        if (can_read_write != SUCCESS) return ERROR;
+        // chain cuts of this file reach handle from now on
+        opened->open_cluster = record.firstCluster;
+        opened->cut_clusters = opened->cut_bytes = NO_CUT;
+        opened->is_released = FALSE;
     }
 
-    return SUCCESS;
+    pthread_mutex_unlock(&handles->files_lock);
+
+    if (opened == NULL) return ERROR;
+
+    pthread_mutex_lock(&opened->lock);
+
+    // copy to the free position found
+    memcpy(&(opened->file), &record, sizeof(Record));
+
+    // set current pointer on the start of the file
+    opened->current_pointer = 0;
+
+    // remember where the record lives on its parent directory
+    opened->parent_cluster = parent_cluster;
+    opened->slot = slot;
+
+    // chain cursor starts at first cluster
+    file_cursor_set(opened, 0, record.firstCluster);
+    opened->chain = NULL;
+    opened->chain_len = 0;
+    opened->chain_epoch = __atomic_load_n(&handles->chain_epochs[record.firstCluster % EPOCH_SLOTS], __ATOMIC_ACQUIRE);
+
+    // reads start with no history
+    readahead_reset(&opened->readahead);
+
+    // nothing written through handle yet
+    opened->tail_low = opened->tail_high = 0;
+    opened->record_dirty = FALSE;
+
+    // set the position as used
+    opened->is_used = TRUE;
+
+    int handle = make_handle(i, opened->generation);
+
+    pthread_mutex_unlock(&opened->lock);
+
+    return handle;
 }
 
 /**
- * Check if the max number of files was reached
- * If the max num is reached, you can not open a new file
+ * Close an opened file taken by file_handle_acquire putting its slot
+ * back in free list. Handle lock is released.
+**/
+void release_opened_file(OpenedFile *opened) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    opened->is_used = FALSE;
+
+    // release cluster array built by chain cursor
+    free(opened->chain);
+    opened->chain = NULL;
+    opened->chain_len = 0;
+
+    // and tail buffer (pending writes were flushed or dropped by caller)
+    free(opened->tail_data);
+    opened->tail_data = NULL;
+
+    // handles holding old generation become stale
+    opened->generation = (opened->generation + 1) & HANDLE_GENERATION_MASK;
+
+    pthread_mutex_unlock(&opened->lock);
+
+    pthread_mutex_lock(&handles->files_lock);
+
+    opened->open_cluster = FREE_CLUSTER;
+    opened->next_free = handles->free_file_slot;
+    handles->free_file_slot = opened->index;
+
+    handles->num_opened_files--;
+
+    pthread_mutex_unlock(&handles->files_lock);
+}
+
+/**
+ * Leave a chain cut on every handle opened on the file starting at
+ * first_cluster except one. Several cuts before a handle is used again
+ * add up to the smallest one.
+**/
+static void mark_cut(DWORD first_cluster, DWORD clusters, DWORD bytes, int is_released, OpenedFile *except) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    pthread_mutex_lock(&handles->files_lock);
+
+    int i;
+    for (i = 0; i < handles->files_capacity; i++) {
+        OpenedFile *opened = file_slot(i);
+
+        if (opened == except || opened->open_cluster != first_cluster) continue;
+
+        if (clusters < opened->cut_clusters) opened->cut_clusters = clusters;
+        if (bytes < opened->cut_bytes) opened->cut_bytes = bytes;
+        if (is_released) opened->is_released = TRUE;
+    }
+
+    pthread_mutex_unlock(&handles->files_lock);
+}
+
+/**
+ * Tell every handle opened on the file starting at first_cluster that
+ * its chain was released, so their pending writes are dropped instead
+ * of landing on clusters given to another file. File node must be
+ * locked for writing.
+**/
+void files_release_chain(DWORD first_cluster) {
+    mark_cut(first_cluster, 0, 0, TRUE, NULL);
+}
+
+/**
+ * Tell every handle opened on the file starting at first_cluster, but
+ * except, that its chain was cut keeping clusters clusters and bytes
+ * bytes. File node must be locked for writing.
+**/
+void files_cut_chain(DWORD first_cluster, DWORD clusters, DWORD bytes, OpenedFile *except) {
+    mark_cut(first_cluster, clusters, bytes, FALSE, except);
+}
+
+/**
+ * Apply to an opened file the cut left by files_cut_chain or
+ * files_release_chain since its last use: tail bytes past the cut are
+ * dropped and record shrinks to what was kept (its directory entry
+ * already says so). A released file drops every pending write. File
+ * node must be locked.
  *
- * Returns 0 if can open; -1 if can't
+ * returns - FALSE if file was released (handle can only be closed)
+ *           TRUE otherwise.
 **/
-int can_open() {
-    return (num_opened_files < MAX_OPENED_FILES) ? SUCCESS : ERROR;
+int file_apply_cut(OpenedFile *opened) {
+    if (opened->is_released) {
+        opened->tail_low = opened->tail_high = 0;
+        opened->record_dirty = FALSE;
+        return FALSE;
+    }
+
+    if (opened->cut_clusters == NO_CUT) return TRUE;
+
+    if (opened->tail_low != opened->tail_high) {
+        DWORD start = opened->tail_index * phys_cluster_size();
+
+        // tail cluster was released or its bytes are past new end
+        if (opened->tail_index >= opened->cut_clusters || start + opened->tail_low >= opened->cut_bytes)
+            opened->tail_low = opened->tail_high = 0;
+        else if (start + opened->tail_high > opened->cut_bytes)
+            opened->tail_high = opened->cut_bytes - start;
+    }
+
+    if (opened->file.bytesFileSize > opened->cut_bytes) opened->file.bytesFileSize = opened->cut_bytes;
+    if (opened->file.clustersFileSize > opened->cut_clusters) opened->file.clustersFileSize = opened->cut_clusters;
+
+    opened->cut_clusters = opened->cut_bytes = NO_CUT;
+
+    return TRUE;
 }
 
 /**
- * Save a record on the list of opened files
+ * Write the record of an opened file back to its directory slot.
+ * Nothing is written if the entry was deleted or replaced since open:
+ * a new file may take the same slot and first cluster, so its name must
+ * match as well.
  *
- * Returns -1 on Error; index of the opened file on Success
+ * param keep_larger - TRUE to keep size and cluster count of entry when
+ *                     larger (file grew through another handle), FALSE
+ *                     to store handle record as is (handle cut file)
+ *
+ * on error - returns ERROR if directory sector cannot be read or written
+ *            otherwise SUCCESS.
 **/
-int save_as_opened(Record record, char* path) {
-    if (can_open() == ERROR) {
+int update_opened_record(OpenedFile *opened, int keep_larger) {
+    Record current;
+
+    if (read_dir_record(opened->parent_cluster, opened->slot, &current) != SUCCESS)
         return ERROR;
+
+    // entry is gone or now names another file, keep only in-memory record
+    if (current.TypeVal == TYPEVAL_INVALIDO || current.firstCluster != opened->file.firstCluster ||
+        strncmp(current.name, opened->file.name, sizeof(current.name)) != 0)
+        return SUCCESS;
+
+    // cuts made through other handles were applied already, so a larger
+    // entry only holds growth this handle has not seen
+    if (keep_larger) {
+        if (current.bytesFileSize > opened->file.bytesFileSize)
+            opened->file.bytesFileSize = current.bytesFileSize;
+
+        if (current.clustersFileSize > opened->file.clustersFileSize)
+            opened->file.clustersFileSize = current.clustersFileSize;
     }
 
+    return write_dir_record(opened->parent_cluster, opened->slot, &opened->file);
+}
 
-    // save the record of file in the first free position of opened_files
-    int i;
-    for (i = 0; i < MAX_OPENED_FILES; i++) {
-        if (opened_files[i].is_used == FALSE) {
-            // copy to the free position found
-            memcpy(&(opened_files[i].file), &record, sizeof(Record));
-            
-            // set the position as used
-            opened_files[i].is_used = TRUE;
-            
-            // set current pointer on the start of the file
-            opened_files[i].current_pointer = 0;
-            
-            // set path to the record
-			strcpy(opened_files[i].path, path);
-            
-            // increase the opened files counter
-            num_opened_files++;
-            return i;
+/**
+ * Hand tail cluster of an opened file to buffer cache merging its dirty
+ * range into current cluster content. Cuts of its chain must have been
+ * applied (see file_apply_cut) so the cluster still belongs to the file.
+ * File node must be locked for writing.
+ *
+ * on error - returns ERROR if cluster cannot be read or written otherwise
+ *            SUCCESS (tail is dropped either way).
+**/
+static int flush_tail(OpenedFile *opened) {
+    int low = opened->tail_low;
+    int high = opened->tail_high;
+
+    if (low == high) return SUCCESS;
+
+    opened->tail_low = opened->tail_high = 0;
+
+    int cluster_size = phys_cluster_size();
+
+    // whole cluster was written so no merge is needed
+    if (low == 0 && high == cluster_size)
+        return write_cluster(opened->tail_cluster, opened->tail_data);
+
+    // other handles may have stored bytes in this cluster meanwhile so
+    // dirty range always goes over its current content
+    unsigned char content[cluster_size];
+
+    if (read_cluster(opened->tail_cluster, content) != SUCCESS) return ERROR;
+
+    memcpy(&content[low], &opened->tail_data[low], high - low);
+
+    return write_cluster(opened->tail_cluster, content);
+}
+
+/**
+ * Copy bytes into a cluster of an opened file through its tail buffer.
+ * Writes landing on the dirty range of tail (or right next to it) only
+ * touch handle memory, anything else hands current tail to buffer cache
+ * first. File node must be locked for writing.
+ *
+ * param index  - chain position of cluster
+ * param offset - offset of first byte inside cluster
+ *
+ * on error - returns ERROR if previous tail cannot be written or memory
+ *            cannot be allocated otherwise SUCCESS.
+**/
+int file_tail_write(OpenedFile *opened, DWORD index, DWORD cluster, int offset,
+                    const char *data, int size) {
+    int is_dirty = opened->tail_low != opened->tail_high;
+
+    // dirty range must stay a single run of bytes of a single cluster
+    if (is_dirty && (opened->tail_cluster != cluster || offset > opened->tail_high ||
+                     offset + size < opened->tail_low)) {
+        if (flush_tail(opened) != SUCCESS) return ERROR;
+
+        is_dirty = FALSE;
+    }
+
+    if (opened->tail_data == NULL && (opened->tail_data = malloc(phys_cluster_size())) == NULL)
+        return ERROR;
+
+    if (is_dirty) {
+        if (offset < opened->tail_low) opened->tail_low = offset;
+        if (offset + size > opened->tail_high) opened->tail_high = offset + size;
+    } else {
+        opened->tail_cluster = cluster;
+        opened->tail_index = index;
+        opened->tail_low = offset;
+        opened->tail_high = offset + size;
+    }
+
+    memcpy(&opened->tail_data[offset], data, size);
+
+    return SUCCESS;
+}
+
+/**
+ * Drop tail of an opened file when it is one of count clusters starting
+ * at chain position index (they were just overwritten whole).
+**/
+void file_tail_discard(OpenedFile *opened, DWORD index, DWORD count) {
+    if (opened->tail_low != opened->tail_high &&
+        opened->tail_index >= index && opened->tail_index < index + count)
+        opened->tail_low = opened->tail_high = 0;
+}
+
+/**
+ * Store pending writes of an opened file: tail cluster goes to buffer
+ * cache and changed record to its parent directory. Writes past a cut
+ * of the chain, or of a released file, are dropped. Handle lock must be
+ * held, file and parent nodes are locked here.
+ *
+ * on error - returns ERROR if cluster or record cannot be written
+ *            otherwise SUCCESS (pending writes are dropped either way).
+**/
+int file_flush_writes(OpenedFile *opened) {
+    int has_tail = opened->tail_low != opened->tail_high;
+
+    if (!has_tail && !opened->record_dirty) return SUCCESS;
+
+    DWORD first = opened->file.firstCluster;
+    DWORD parent = opened->record_dirty ? opened->parent_cluster : first;
+
+    int result = SUCCESS;
+
+    node_lock_pair(parent, first);
+
+    // a released file drops its pending writes here
+    if (file_apply_cut(opened)) {
+        if (flush_tail(opened) != SUCCESS) result = ERROR;
+
+        if (opened->record_dirty) {
+            opened->record_dirty = FALSE;
+
+            if (update_opened_record(opened, TRUE) != SUCCESS) result = ERROR;
         }
     }
-    
-    return ERROR;
+
+    node_unlock_pair(parent, first);
+
+    return result;
 }
 
+/**
+ * Store pending writes of every opened file of current mount. Calling
+ * thread must hold no handle lock.
+ *
+ * on error - returns ERROR if any file cannot be flushed otherwise SUCCESS.
+**/
+int files_flush_writes(void) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    int capacity = __atomic_load_n(&handles->files_capacity, __ATOMIC_ACQUIRE);
+    int result = SUCCESS;
+    int i;
+
+    for (i = 0; i < capacity; i++) {
+        OpenedFile *opened = file_slot(i);
+
+        pthread_mutex_lock(&opened->lock);
+
+        if (opened->is_used && file_flush_writes(opened) != SUCCESS) result = ERROR;
+
+        pthread_mutex_unlock(&opened->lock);
+    }
+
+    return result;
+}
 
+/*
+Similar to save_as_opened, only now returning a directory handler
+*/
 int save_as_opened_dir(Record record, char* pathname)
 {
+	struct HandleTables *handles = current_mount()->handle_tables;
 
-	int i;
-	if (num_opened_dirs >= MAX_OPENED_DIRS)
+	int address = findValidEntry(record, 0);
+	if (address == -1)
 		return ERROR;
-	else
-	{
 
-		int address = findValidEntry(record, 0);
-		if (address == -1)
-			return ERROR;
-
-
-		if (unusedDirHandles) //if a handle has been freed, we have to search the array for it 
-		{
-			for (i = 0; i < MAX_OPENED_DIRS; i++)
-				if (opened_dirs[i].is_used == FALSE)
-				{
-					opened_dirs[i].record = record;
-					opened_dirs[i].is_used = TRUE;
-					strcpy(opened_dirs[i].path, pathname);
-					opened_dirs[i].current_pointer = address;
-					num_opened_dirs++;
-					unusedDirHandles--;
-					return i;
-				}
-		}
-		else //else, it's the trivial case
-		{
-			i = num_opened_dirs;
-			opened_dirs[i].record = record;
-			opened_dirs[i].is_used = TRUE;
-			opened_dirs[i].current_pointer = address;
-			opened_dirs[i].path = malloc(MAX_PATH_SIZE * sizeof(char));
-			strcpy(opened_dirs[i].path, pathname);
-			num_opened_dirs++;
-			return i;
-		}
+	// store path out of line before taking a slot
+	char *stored_path = path_store(pathname);
+	if (stored_path == NULL)
+		return ERROR;
+
+	pthread_mutex_lock(&handles->dirs_lock);
+
+	// take first slot of free list
+	int i = handles->num_opened_dirs < MAX_OPENED_DIRS ? take_dir_slot() : ERROR;
+	if (i != ERROR)
+		handles->num_opened_dirs++;
+
+	pthread_mutex_unlock(&handles->dirs_lock);
+
+	if (i == ERROR)
+	{
+		path_release(stored_path);
+		return ERROR;
 	}
 
-	return ERROR;
+	OpenedDir *opened = dir_slot(i);
+
+	pthread_mutex_lock(&opened->lock);
+
+	opened->record = record;
+	opened->current_pointer = address;
+	opened->path = stored_path;
+
+	// directory cluster buffer is allocated on first readdir
+	opened->cluster_data = NULL;
+	opened->cluster_position = END_OF_FILE;
+	opened->dir_epoch = __atomic_load_n(&handles->dir_epochs[record.firstCluster % EPOCH_SLOTS], __ATOMIC_ACQUIRE);
+
+	opened->is_used = TRUE;
+
+	int handle = make_handle(i, opened->generation);
+
+	pthread_mutex_unlock(&opened->lock);
+
+	return handle;
+}
+
+/**
+ * Close an opened directory taken by dir_handle_acquire putting its
+ * slot back in free list. Handle lock is released.
+**/
+void release_opened_dir(OpenedDir *opened) {
+    struct HandleTables *handles = current_mount()->handle_tables;
+
+    opened->is_used = FALSE;
 
+    path_release(opened->path);
+    opened->path = NULL;
+
+    free(opened->cluster_data);
+    opened->cluster_data = NULL;
+
+    // handles holding old generation become stale
+    opened->generation = (opened->generation + 1) & HANDLE_GENERATION_MASK;
+
+    pthread_mutex_unlock(&opened->lock);
+
+    pthread_mutex_lock(&handles->dirs_lock);
+
+    opened->next_free = handles->free_dir_slot;
+    handles->free_dir_slot = opened->index;
+
+    handles->num_opened_dirs--;
+
+    pthread_mutex_unlock(&handles->dirs_lock);
+}
+
+/**
+ * Record at a slot of an opened directory taken from the directory
+ * cluster kept by its handle. A whole cluster is read only when slot
+ * lies outside the cluster already kept.
+ *
+ * returns  - record inside handle cluster buffer.
+ * on error - returns NULL if slot is past end of directory or its
+ *            cluster cannot be read.
+**/
+Record *opened_dir_record(OpenedDir *opened, DWORD slot) {
+    Mount *mount = current_mount();
+    struct HandleTables *handles = mount->handle_tables;
+
+    DWORD epoch = __atomic_load_n(&handles->dir_epochs[opened->record.firstCluster % EPOCH_SLOTS], __ATOMIC_ACQUIRE);
+
+    // a record of directory was written since cluster was read
+    if (opened->dir_epoch != epoch) {
+        opened->cluster_position = END_OF_FILE;
+        opened->dir_epoch = epoch;
+    }
+
+    DWORD per_cluster = records_per_sector() * mount->super.SectorsPerCluster;
+    DWORD position = slot / per_cluster;
+
+    if (opened->cluster_position != position) {
+        DWORD cluster = dir_index_cluster_at(opened->record.firstCluster, position);
+
+        // slot past end of directory chain
+        if (cluster == END_OF_FILE) return NULL;
+
+        if (opened->cluster_data == NULL) {
+            opened->cluster_data = malloc(phys_cluster_size());
+
+            if (opened->cluster_data == NULL) return NULL;
+        }
+
+        if (read_cluster(cluster, opened->cluster_data) != SUCCESS) {
+            opened->cluster_position = END_OF_FILE;
+            return NULL;
+        }
+
+        opened->cluster_position = position;
+    }
+
+    return (Record *) (opened->cluster_data + (slot % per_cluster) * RECORD_SIZE);
 }
 
+/**
+ * Finds first valid entry of a directory at or after a given address.
+ * Whole cluster chain of directory is considered and free slots are
+ * skipped through directory index.
+ *
+ * param record - directory record
+ * param end    - byte address (record position * RECORD_SIZE) where search starts
+ *
+ * returns - byte address of valid entry.
+ * on error - returns ERROR if there are no more valid entries.
+**/
 int findValidEntry(Record record, int end)
 {
-	int cluster_size = SECTOR_SIZE * superblock.SectorsPerCluster;
-	unsigned char result[cluster_size];
-	struct t2fs_record descriptor;
-	int address = end;
-	if (address >= cluster_size)
+	if (end < 0)
 		return ERROR;
-	if (address == ERROR)
-		return ERROR;
-	if (read_cluster(record.firstCluster, result) != SUCCESS) return ERROR;
-	// 64 = tamanho da estrutura t2fs_record
-	do
-	{
-		memcpy(&descriptor, &result[address], sizeof(descriptor));
-		address += 64;
-	} while (descriptor.TypeVal == TYPEVAL_INVALIDO && address <= cluster_size);
 
-	if (address >= cluster_size)
-	{
-		address = 0;
-		do
-		{
-			memcpy(&descriptor, &result[address], sizeof(descriptor));
-			address += 64;
-		} while (descriptor.TypeVal == TYPEVAL_INVALIDO && address <= cluster_size);
-		if (address >= cluster_size)
-			return ERROR;
-		else
-			return address;
-	}
-	else
-		return address;
+	DWORD slot;
+	if (dir_index_next_used(record.firstCluster, end / RECORD_SIZE, &slot) != TRUE)
+		return ERROR;
 
+	return slot * RECORD_SIZE;
 }
 
-Record* findLinkRecord(Record link)
-{
+/**
+ * Resolve path stored in a soft link. Relative targets are taken from
+ * current directory like any other path.
+ *
+ * returns  - same as resolve_path.
+**/
+int resolve_link(Record link, PathLookup *result) {
+    Mount *mount = current_mount();
 
-	Path* path;
-	path = malloc(sizeof(Path));
-	path = findLinkPath(link);
-	
-
-	if (path == NULL)
-		return NULL;
-
-	Record parent_dir;
-	lookup_parent_descriptor_by_name(path->tail, &parent_dir);
-
-	// find the record
-	Record* file = malloc(sizeof(Record));
-	if (!lookup_descriptor_by_name(parent_dir.firstCluster, path->head, file))
-		{ 
-		free(path);
-		return NULL;
-		}
-	else
-	{
-		free(path);
-		return file;
-	}
+    char target[SECTOR_SIZE * mount->super.SectorsPerCluster];
+
+    if (read_cluster(link.firstCluster, (unsigned char *) target) != SUCCESS) return ERROR;
+
+    // link content is zero padded but never trust it to be terminated
+    target[sizeof(target) - 1] = '\0';
+
+    return resolve_path(target, result);
 }
 
+/**
+ * Resolve path stored in a soft link and lock it like lock_path.
+ *
+ * returns  - same as lock_path.
+**/
+int lock_link(Record link, PathLookup *result) {
+    Mount *mount = current_mount();
 
-Path* findLinkPath(Record link)
-{
-	unsigned char* name = malloc(sizeof(char) * phys_cluster_size());
-	if (read_cluster(link.firstCluster, name) != SUCCESS) return NULL;
-	Path* path = malloc(sizeof(Path));
-	if (path_from_name((char*)name, path) != SUCCESS) {
-		free(path);
-		return NULL;
-	}
-	return path;
+    char target[SECTOR_SIZE * mount->super.SectorsPerCluster];
+
+    if (read_cluster(link.firstCluster, (unsigned char *) target) != SUCCESS) return ERROR;
+
+    // link content is zero padded but never trust it to be terminated
+    target[sizeof(target) - 1] = '\0';
+
+    return lock_path(target, result);
 }
 
 
@@ -956,11 +2098,13 @@ Path* findLinkPath(Record link)
  * Helper functions to print data, fat and super blocks from disk.
 **/
 void print_fat() {
-    set_local_fat();
+    // may run before any call loaded current mount
+    if (mount_load(current_mount()) != SUCCESS) return;
+
     int i;
     printf("\n");
     for (i = 0; i < 20; i++) {
-        printf("%d: %02X\n", i, local_fat[i]);
+        printf("%d: %02X\n", i, get_value_from_fat(i));
     }
 }
 
@@ -978,7 +2122,9 @@ void print_descriptor(struct t2fs_record descriptor, int tab) {
  * Helper functions to print data, fat and super blocks from disk.
 **/
 void print_dir(DWORD cluster, int tab) {
-    int cluster_size = SECTOR_SIZE * superblock.SectorsPerCluster;
+    Mount *mount = current_mount();
+
+    int cluster_size = SECTOR_SIZE * mount->super.SectorsPerCluster;
     
     BYTE result[cluster_size];
     
@@ -986,19 +2132,27 @@ void print_dir(DWORD cluster, int tab) {
     
     int index; // Descriptor index
 
-    read_cluster(cluster, result);
+    // records read so far (. and .. are the first two of chain)
+    int position = 0;
 
-    // 64 = tamanho da estrutura t2fs_record
-    for(index = 0; index < cluster_size / 64; index++) {
-        memcpy(&descriptor, &result[index * 64], sizeof(descriptor));
-	
-        if (descriptor.TypeVal != TYPEVAL_INVALIDO) {
-            print_descriptor(descriptor, tab);
-        }
-        
-        if (descriptor.TypeVal == TYPEVAL_DIRETORIO && index > 1) {
-            print_dir(descriptor.firstCluster, tab+1);
+    // directory may span several clusters along its FAT chain
+    while (cluster != END_OF_FILE && cluster != FREE_CLUSTER && cluster != BAD_SECTOR) {
+        if (read_cluster(cluster, result) != SUCCESS) return;
+
+        // 64 = tamanho da estrutura t2fs_record
+        for(index = 0; index < cluster_size / 64; index++, position++) {
+            memcpy(&descriptor, &result[index * 64], sizeof(descriptor));
+
+            if (descriptor.TypeVal != TYPEVAL_INVALIDO) {
+                print_descriptor(descriptor, tab);
+            }
+
+            if (descriptor.TypeVal == TYPEVAL_DIRETORIO && position > 1) {
+                print_dir(descriptor.firstCluster, tab+1);
+            }
         }
+
+        cluster = get_value_from_fat(cluster);
     }
 }
 
@@ -1006,21 +2160,28 @@ void print_dir(DWORD cluster, int tab) {
  * Helper functions to print data, fat and super blocks from disk.
 **/
 void print_disk() {
+    Mount *mount = current_mount();
+
+    // may run before any call loaded current mount
+    if (mount_load(current_mount()) != SUCCESS) return;
+
     printf("\nDISK\n");
-    print_dir(superblock.RootDirCluster, 0);
+    print_dir(mount->super.RootDirCluster, 0);
 }
 
 /**
  * Helper functions to print data, fat and super blocks from disk.
 **/
 void print_superblock() {
+    Mount *mount = current_mount();
+
     printf("\nSUPERBLOCK\n");
-    printf("- id -> %.4s\n", superblock.id);
-    printf("- superblockSize -> %d\n", superblock.superblockSize);
-    printf("- DiskSize -> %d\n", superblock.DiskSize);
-    printf("- NofSectors -> %d\n", superblock.NofSectors);
-    printf("- SectorsPerCluster -> %d\n", superblock.SectorsPerCluster);
-    printf("- pFATSectorStart -> %d\n", superblock.pFATSectorStart);
-    printf("- RootDirCluster -> %d\n", superblock.RootDirCluster);
-    printf("- DataSectorStart -> %d\n", superblock.DataSectorStart);
+    printf("- id -> %.4s\n", mount->super.id);
+    printf("- superblockSize -> %d\n", mount->super.superblockSize);
+    printf("- DiskSize -> %d\n", mount->super.DiskSize);
+    printf("- NofSectors -> %d\n", mount->super.NofSectors);
+    printf("- SectorsPerCluster -> %d\n", mount->super.SectorsPerCluster);
+    printf("- pFATSectorStart -> %d\n", mount->super.pFATSectorStart);
+    printf("- RootDirCluster -> %d\n", mount->super.RootDirCluster);
+    printf("- DataSectorStart -> %d\n", mount->super.DataSectorStart);
 }
@@ -0,0 +1,88 @@
+#include <pthread.h>
+#include <stdint.h>
+#include "../include/fs_helper.h"
+#include "../include/fs_lock.h"
+
+// a node lock stripe kept on its own cache line
+typedef struct {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) NodeStripe;
+
+static NodeStripe stripes[NODE_LOCK_STRIPES] = {
+    [0 ... NODE_LOCK_STRIPES - 1] = { PTHREAD_RWLOCK_INITIALIZER }
+};
+
+/**
+ * Stripe index of a node. Stripes are shared by every mount so the
+ * current mount address is mixed in to keep same clusters of different
+ * images apart.
+**/
+static DWORD stripe_of(DWORD cluster) {
+    DWORD salt = (DWORD) ((uintptr_t) current_mount() >> 6);
+
+    return (((cluster ^ salt) * 2654435761u) >> 16) & (NODE_LOCK_STRIPES - 1);
+}
+
+/**
+ * Lock a node for reading.
+ *
+ * param cluster - first cluster of file or directory
+**/
+void node_lock_shared(DWORD cluster) {
+    pthread_rwlock_rdlock(&stripes[stripe_of(cluster)].lock);
+}
+
+/**
+ * Lock a node for writing.
+ *
+ * param cluster - first cluster of file or directory
+**/
+void node_lock_exclusive(DWORD cluster) {
+    pthread_rwlock_wrlock(&stripes[stripe_of(cluster)].lock);
+}
+
+/**
+ * Try to lock a node for writing without blocking.
+ *
+ * returns - TRUE if node was locked FALSE otherwise.
+**/
+int node_trylock_exclusive(DWORD cluster) {
+    return pthread_rwlock_trywrlock(&stripes[stripe_of(cluster)].lock) == 0;
+}
+
+/**
+ * Unlock a node locked by any function above.
+**/
+void node_unlock(DWORD cluster) {
+    pthread_rwlock_unlock(&stripes[stripe_of(cluster)].lock);
+}
+
+/**
+ * Lock two nodes for writing in stripe order so that callers locking
+ * the same pair in any order never deadlock. Nodes sharing a stripe are
+ * locked once.
+**/
+void node_lock_pair(DWORD first, DWORD second) {
+    DWORD a = stripe_of(first);
+    DWORD b = stripe_of(second);
+
+    if (a == b) {
+        pthread_rwlock_wrlock(&stripes[a].lock);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&stripes[a < b ? a : b].lock);
+    pthread_rwlock_wrlock(&stripes[a < b ? b : a].lock);
+}
+
+/**
+ * Unlock two nodes locked by node_lock_pair.
+**/
+void node_unlock_pair(DWORD first, DWORD second) {
+    DWORD a = stripe_of(first);
+    DWORD b = stripe_of(second);
+
+    pthread_rwlock_unlock(&stripes[a].lock);
+
+    if (a != b) pthread_rwlock_unlock(&stripes[b].lock);
+}
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../include/fs_helper.h"
+#include "../include/mount.h"
+#include "../include/apidisk.h"
+#include "../include/fat_alloc.h"
+#include "../include/buffer_cache.h"
+#include "../include/dentry_cache.h"
+#include "../include/dir_index.h"
+#include "../include/readahead.h"
+
+// options used when none are given
+#define DEFAULT_OPTIONS { NULL, BUFFER_CACHE_SECTORS, DENTRY_CACHE_ENTRIES, T2FS_BACKEND_DEFAULT, FAT_READAHEAD_SECTORS, \
+                          READAHEAD_MAX_CLUSTERS }
+
+// mount entered by calling thread (NULL means default mount)
+__thread Mount *thread_mount = NULL;
+
+// mount used by threads that entered none, loaded by t2fs_init or on
+// first call
+Mount default_mount = {
+    .disk_name = DEFAULT_DISK_NAME,
+    .options = DEFAULT_OPTIONS,
+    .load_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// disk name of default mount when set by mount_configure
+static char *default_disk_name = NULL;
+
+// options given to mounts created from now on
+static T2FS_OPTIONS mount_options = DEFAULT_OPTIONS;
+
+// mounts created by mount_create (flushed on exit)
+static Mount *mounts = NULL;
+
+// guards mounts list and mount_options
+static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Make calling thread work on a mount.
+ *
+ * returns - mount used before (give it back to mount_leave).
+**/
+Mount *mount_enter(Mount *mount) {
+    Mount *previous = thread_mount;
+
+    thread_mount = mount;
+
+    return previous;
+}
+
+/**
+ * Make calling thread work again on mount returned by mount_enter.
+**/
+void mount_leave(Mount *previous) {
+    thread_mount = previous;
+}
+
+/**
+ * Set options of default mount and of mounts created from now on. Zero
+ * fields (and NULL options) take default values.
+ *
+ * on error - returns ERROR if default mount is already loaded, an option
+ *            is invalid or memory cannot be allocated otherwise SUCCESS.
+**/
+int mount_configure(T2FS_OPTIONS *options) {
+    T2FS_OPTIONS resolved = DEFAULT_OPTIONS;
+
+    if (options != NULL) {
+        if (options->backend < T2FS_BACKEND_DEFAULT || options->backend > T2FS_BACKEND_MMAP)
+            return ERROR;
+
+        if (options->cache_sectors > 0) resolved.cache_sectors = options->cache_sectors;
+        if (options->dentry_entries > 0) resolved.dentry_entries = options->dentry_entries;
+        if (options->fat_readahead > 0) resolved.fat_readahead = options->fat_readahead;
+        if (options->data_readahead > 0) resolved.data_readahead = options->data_readahead;
+
+        resolved.backend = options->backend;
+    }
+
+    char *name = NULL;
+
+    if (options != NULL && options->disk_name != NULL) {
+        name = strdup(options->disk_name);
+
+        if (name == NULL) return ERROR;
+    }
+
+    pthread_mutex_lock(&default_mount.load_lock);
+
+    // options of a loaded mount never change
+    if (default_mount.is_loaded) {
+        pthread_mutex_unlock(&default_mount.load_lock);
+        free(name);
+        return ERROR;
+    }
+
+    default_mount.options = resolved;
+
+    free(default_disk_name);
+    default_disk_name = name;
+    default_mount.disk_name = name != NULL ? name : DEFAULT_DISK_NAME;
+
+    pthread_mutex_unlock(&default_mount.load_lock);
+
+    pthread_mutex_lock(&mounts_lock);
+    mount_options = resolved;
+    pthread_mutex_unlock(&mounts_lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Create a mount over a disk image. Nothing is read until the mount is
+ * first used.
+ *
+ * returns  - new mount.
+ * on error - returns NULL if memory cannot be allocated.
+**/
+Mount *mount_create(const char *disk_name) {
+    Mount *mount = calloc(1, sizeof(Mount));
+
+    if (mount == NULL) return NULL;
+
+    mount->disk_name = strdup(disk_name);
+
+    if (mount->disk_name == NULL) {
+        free(mount);
+        return NULL;
+    }
+
+    pthread_mutex_init(&mount->load_lock, NULL);
+
+    pthread_mutex_lock(&mounts_lock);
+
+    mount->options = mount_options;
+    mount->next = mounts;
+    mounts = mount;
+
+    pthread_mutex_unlock(&mounts_lock);
+
+    return mount;
+}
+
+/**
+ * Release image state of current mount without writing anything back.
+ * Every module state may be missing (mount only partially built).
+**/
+static void release_state(void) {
+    Mount *mount = current_mount();
+
+    handles_destroy();
+    alloc_destroy();
+    dir_index_destroy();
+    dcache_destroy();
+    cache_destroy();
+    disk_destroy();
+
+    free(mount->fat);
+    free(mount->fat_dirty);
+    free(mount->fat_resident);
+
+    mount->fat = NULL;
+    mount->fat_dirty = NULL;
+    mount->fat_resident = NULL;
+    mount->batch_depth = 0;
+}
+
+/**
+ * Build image state of current mount: module states first and then
+ * superblock, current directory, FAT and free cluster bitmap read from
+ * disk image.
+ *
+ * on error - returns ERROR if any step fails otherwise SUCCESS.
+**/
+static int build_state(void) {
+    Mount *mount = current_mount();
+
+    if (disk_create() != 0) return ERROR;
+
+    if (cache_create() != SUCCESS || dcache_create(mount->options.dentry_entries) != SUCCESS ||
+        dir_index_create() != SUCCESS || alloc_create() != SUCCESS ||
+        handles_create() != SUCCESS)
+        return ERROR;
+
+    // initialize buffer cache used by every sector access
+    if (cache_init(mount->options.cache_sectors) != SUCCESS) return ERROR;
+
+    if (initialize_superblock() != SUCCESS) return ERROR;
+
+    // initialize current directory poiting to data dir after root
+    // based on superblock structure
+    initialize_curr_dir(&mount->super);
+
+    if (set_local_fat() != SUCCESS) return ERROR;
+
+    // build free cluster bitmap from clean unmount summary or FAT
+    return alloc_init();
+}
+
+/**
+ * Build image state of a mount (superblock, FAT, caches and handle
+ * tables) unless already built. Safe to call from many threads.
+ *
+ * on error - returns ERROR if disk image cannot be read or is not a
+ *            T2FS image otherwise SUCCESS.
+**/
+int mount_load(Mount *mount) {
+    // fast path once mount is built
+    if (__atomic_load_n(&mount->is_loaded, __ATOMIC_ACQUIRE)) return SUCCESS;
+
+    pthread_mutex_lock(&mount->load_lock);
+
+    int result = SUCCESS;
+
+    // another thread may have built it while waiting
+    if (!mount->is_loaded) {
+        Mount *previous = mount_enter(mount);
+
+        result = build_state();
+
+        if (result == SUCCESS) __atomic_store_n(&mount->is_loaded, TRUE, __ATOMIC_RELEASE);
+        else release_state();
+
+        mount_leave(previous);
+    }
+
+    pthread_mutex_unlock(&mount->load_lock);
+
+    return result;
+}
+
+/**
+ * Write back pending writes of opened files and dirty FAT and cache
+ * sectors of a loaded mount, store its clean unmount summary and make
+ * everything durable.
+ *
+ * on error - returns ERROR if a sector cannot be written otherwise SUCCESS.
+**/
+static int flush_mount(Mount *mount) {
+    if (!__atomic_load_n(&mount->is_loaded, __ATOMIC_ACQUIRE)) return SUCCESS;
+
+    Mount *previous = mount_enter(mount);
+
+    int result = SUCCESS;
+
+    // writes still held by opened files go first
+    if (files_flush_writes() != SUCCESS) result = ERROR;
+
+    // summary is only stored over a FAT fully written back
+    if (flush_fat() != SUCCESS) result = ERROR;
+    else if (alloc_summary_write() != SUCCESS) result = ERROR;
+
+    if (cache_flush() != SUCCESS) result = ERROR;
+    if (sync_disk() != 0) result = ERROR;
+
+    mount_leave(previous);
+
+    return result;
+}
+
+/**
+ * Write back dirty state of a mount and release its image state, leaving
+ * it ready to be loaded again.
+ *
+ * on error - returns ERROR if dirty sectors cannot be written otherwise
+ *            SUCCESS (state is released either way).
+**/
+static int unload(Mount *mount) {
+    int result = flush_mount(mount);
+
+    if (mount->is_loaded) {
+        Mount *previous = mount_enter(mount);
+
+        release_state();
+
+        mount_leave(previous);
+
+        __atomic_store_n(&mount->is_loaded, FALSE, __ATOMIC_RELEASE);
+    }
+
+    return result;
+}
+
+/**
+ * Write back dirty state of a mount and release it. Handles opened on
+ * it become invalid. Must not race with other calls on the mount.
+ *
+ * on error - returns ERROR if dirty sectors cannot be written otherwise
+ *            SUCCESS (mount is released either way).
+**/
+int mount_destroy(Mount *mount) {
+    pthread_mutex_lock(&mounts_lock);
+
+    Mount **link = &mounts;
+
+    while (*link != NULL && *link != mount)
+        link = &(*link)->next;
+
+    if (*link == mount) *link = mount->next;
+
+    pthread_mutex_unlock(&mounts_lock);
+
+    int result = unload(mount);
+
+    pthread_mutex_destroy(&mount->load_lock);
+
+    free((char *) mount->disk_name);
+    free(mount);
+
+    return result;
+}
+
+/**
+ * Write back pending writes of opened files and dirty FAT and cache
+ * sectors of every loaded mount and store their clean unmount summaries.
+**/
+void mount_flush_all(void) {
+    flush_mount(&default_mount);
+
+    pthread_mutex_lock(&mounts_lock);
+
+    Mount *mount;
+    for (mount = mounts; mount != NULL; mount = mount->next)
+        flush_mount(mount);
+
+    pthread_mutex_unlock(&mounts_lock);
+}
+
+/**
+ * Destroy every mount created by mount_create and unload default mount
+ * restoring default options. Must not race with other calls.
+ *
+ * on error - returns ERROR if dirty sectors of any mount cannot be
+ *            written otherwise SUCCESS (mounts are released either way).
+**/
+int mount_shutdown(void) {
+    int result = SUCCESS;
+
+    // take whole list at once so mount_destroy finds nothing to unlink
+    pthread_mutex_lock(&mounts_lock);
+
+    Mount *mount = mounts;
+    mounts = NULL;
+
+    pthread_mutex_unlock(&mounts_lock);
+
+    while (mount != NULL) {
+        Mount *next = mount->next;
+
+        if (mount_destroy(mount) != SUCCESS) result = ERROR;
+
+        mount = next;
+    }
+
+    pthread_mutex_lock(&default_mount.load_lock);
+
+    if (unload(&default_mount) != SUCCESS) result = ERROR;
+
+    pthread_mutex_unlock(&default_mount.load_lock);
+
+    // next t2fs_init (or first call) starts from defaults
+    if (mount_configure(NULL) != SUCCESS) result = ERROR;
+
+    return result;
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../include/fs_helper.h"
+#include "../include/path_arena.h"
+
+// smallest size class in bytes (must hold a free list pointer)
+#define ARENA_MIN_CLASS 32
+
+// number of size classes (32 bytes up to MAX_PATH_SIZE)
+#define ARENA_CLASSES 8
+
+// bytes reserved from system at a time
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// released strings of a size class linked through their first bytes
+typedef struct FreeString {
+    struct FreeString *next;
+} FreeString;
+
+// arena block list (kept only to know where bump allocation happens)
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+static ArenaBlock *blocks = NULL;
+
+static FreeString *free_lists[ARENA_CLASSES];
+
+// guards blocks and free lists
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Size class holding a string of given length (terminator included).
+ *
+ * returns - class number or ERROR if string is longer than MAX_PATH_SIZE.
+**/
+static int class_of(size_t length) {
+    size_t size = ARENA_MIN_CLASS;
+    int class = 0;
+
+    while (size < length) {
+        size <<= 1;
+        class++;
+    }
+
+    return class < ARENA_CLASSES ? class : ERROR;
+}
+
+/**
+ * Carve size bytes from current block taking a new block when needed.
+ *
+ * on error - returns NULL if memory cannot be allocated.
+**/
+static char *bump(size_t size) {
+    if (blocks == NULL || blocks->used + size > ARENA_BLOCK_SIZE) {
+        ArenaBlock *block = malloc(sizeof(ArenaBlock) + ARENA_BLOCK_SIZE);
+
+        if (block == NULL) return NULL;
+
+        block->next = blocks;
+        block->used = 0;
+        blocks = block;
+    }
+
+    char *result = blocks->data + blocks->used;
+    blocks->used += size;
+
+    return result;
+}
+
+/**
+ * Store a copy of a path in arena.
+ *
+ * returns  - arena copy of path.
+ * on error - returns NULL if memory cannot be allocated.
+**/
+char *path_store(const char *path) {
+    size_t length = strlen(path) + 1;
+
+    int class = class_of(length);
+
+    if (class == ERROR) return NULL;
+
+    char *result;
+
+    pthread_mutex_lock(&arena_lock);
+
+    // reuse a released string of the same class when possible
+    if (free_lists[class] != NULL) {
+        result = (char *) free_lists[class];
+        free_lists[class] = free_lists[class]->next;
+    } else {
+        result = bump((size_t) ARENA_MIN_CLASS << class);
+    }
+
+    pthread_mutex_unlock(&arena_lock);
+
+    if (result == NULL) return NULL;
+
+    memcpy(result, path, length);
+
+    return result;
+}
+
+/**
+ * Give back arena space of a path returned by path_store.
+**/
+void path_release(char *path) {
+    if (path == NULL) return;
+
+    int class = class_of(strlen(path) + 1);
+
+    if (class == ERROR) return;
+
+    FreeString *entry = (FreeString *) path;
+
+    pthread_mutex_lock(&arena_lock);
+
+    entry->next = free_lists[class];
+    free_lists[class] = entry;
+
+    pthread_mutex_unlock(&arena_lock);
+}
@@ -0,0 +1,91 @@
+#include "../include/fs_helper.h"
+#include "../include/readahead.h"
+#include "../include/buffer_cache.h"
+
+/**
+ * Largest window allowed on current mount. Besides data_readahead option
+ * window never takes more than a quarter of buffer cache, otherwise
+ * prefetched clusters would evict each other before being read.
+**/
+static DWORD max_window(void) {
+    Mount *mount = current_mount();
+
+    DWORD limit = mount->options.cache_sectors / 4 / mount->super.SectorsPerCluster;
+    if (limit == 0) limit = 1;
+
+    return mount->options.data_readahead < limit ? mount->options.data_readahead : limit;
+}
+
+/**
+ * Forget access history of a file (window closed, nothing prefetched).
+**/
+void readahead_reset(ReadaheadState *state) {
+    state->next_position = 0;
+    state->window = 0;
+    state->limit = 0;
+}
+
+/**
+ * Account a read of an opened file and prefetch clusters following it
+ * when reads are sequential. File node must be locked so that its chain
+ * cannot change meanwhile. Prefetching is only a hint: failures are
+ * ignored.
+ *
+ * param position  - byte offset where read started
+ * param size      - number of bytes read
+ * param file_size - file size in bytes
+ * param index     - a chain position at or before last cluster read
+ * param cluster   - cluster number at that chain position
+**/
+void readahead_after_read(ReadaheadState *state, DWORD position, DWORD size, DWORD file_size,
+                          DWORD index, DWORD cluster) {
+    Mount *mount = current_mount();
+
+    if (size == 0) return;
+
+    // a read starting anywhere else than where previous one ended
+    // shrinks window and drops what was prefetched for old position
+    if (position != state->next_position) {
+        state->next_position = position + size;
+        state->window /= 2;
+        state->limit = 0;
+        return;
+    }
+
+    state->next_position = position + size;
+
+    DWORD cluster_size = phys_cluster_size();
+
+    // chain position right after last cluster read and clusters in file
+    DWORD next = (position + size - 1) / cluster_size + 1;
+    DWORD clusters = (file_size + cluster_size - 1) / cluster_size;
+
+    // reader is still far enough from end of prefetched clusters
+    if (state->window > 0 && state->limit >= next + state->window / 2) return;
+
+    // each new window of a sustained stream is twice the previous one
+    DWORD max = max_window();
+
+    state->window = state->window == 0 ? READAHEAD_MIN_CLUSTERS : state->window * 2;
+    if (state->window > max) state->window = max;
+
+    DWORD from = state->limit > next ? state->limit : next;
+    DWORD to = next + state->window < clusters ? next + state->window : clusters;
+
+    if (from >= to || index > from) return;
+
+    DWORD current = chain_cluster_at(cluster, from - index);
+
+    // bring each contiguous run of window in with a single request
+    while (from < to && current != END_OF_FILE && current != FREE_CLUSTER && current != BAD_SECTOR) {
+        DWORD run = chain_run_length(current, to - from);
+
+        if (cache_prefetch_sectors(cluster_to_log_sector(current), run * mount->super.SectorsPerCluster) != SUCCESS)
+            break;
+
+        from += run;
+        current = get_value_from_fat(current + run - 1);
+    }
+
+    state->limit = from;
+}
@@ -1,229 +1,219 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <math.h>
 #include <signal.h>
+#include <sys/stat.h>
 #include "../include/apidisk.h"
 #include "../include/t2fs.h"
 #include "../include/fs_helper.h"
+#include "../include/fat_alloc.h"
+#include "../include/readahead.h"
+#include "../include/buffer_cache.h"
+#include "../include/dentry_cache.h"
+#include "../include/dir_index.h"
+#include "../include/fs_lock.h"
+#include "../include/mount.h"
 
 /**
- * Creates a new archive.
- * 
- * returns - File handle if possible (positive number) ERROR otherwise. 
- **/
-FILE2 create2 (char *filename) {
-    // extract path head and tail
-    Path *path = malloc(sizeof(Path));
-    if (path_from_name(filename, path) != SUCCESS) {
-        free(path);
-        return ERROR;
-    }
+ * Make sure mount used by calling thread is loaded. Default mount is
+ * read on first call unless t2fs_init (or AUTO_MOUNT) already did it.
+ *
+ * on error - returns ERROR if disk image cannot be mounted otherwise SUCCESS.
+**/
+static int ensure_mounted (void) {
+	return mount_load(current_mount());
+}
 
-    // return error if parent path does not exist
-    if (!does_name_exists(path->tail))
-        return ERROR;
+/**
+ * Create file record of a locked path (see lock_path) releasing the
+ * chain of a file with same name.
+ *
+ * param exists       - TRUE if a file with same name exists
+ * param created      - receives new file record
+ * param created_slot - receives new record position in parent directory
+ *
+ * on error - returns ERROR if disk is full or cannot be written otherwise SUCCESS.
+**/
+static int create_at (PathLookup *locked, int exists, Record *created, DWORD *created_slot) {
+    PathLookup path = *locked;
 
-    // get the descriptor for parent folder
-    Record parent_dir;
-    lookup_parent_descriptor_by_name(path->tail, &parent_dir);
+    // allocate first cluster of new file from free cluster bitmap
+    DWORD p_free_sector = alloc_cluster();
 
-    // find first free fat physical sector entry
-    int p_free_sector = phys_fat_first_fit();
+    // disk is full
+    if (p_free_sector == ERROR)
+        return ERROR;
     
     // create the record for the new file
     Record file;
     file.TypeVal = TYPEVAL_REGULAR;
     file.bytesFileSize = 0;
     file.clustersFileSize = 1;
-    strncpy(file.name, path->head, FILE_NAME_SIZE);
+    strcpy(file.name, path.name);
     file.firstCluster = p_free_sector;
 
     // Here we insert the entry of the file on the parent directory
-    
-    // buffer to read the content of parent dir cluster
-    unsigned char content[SECTOR_SIZE * superblock.SectorsPerCluster];
-    
-    if (read_cluster(parent_dir.firstCluster, content) != SUCCESS) return ERROR;
-
-    int i;
-
-    // flag to check if a space to write was found
-    int able_to_write = FALSE;
-
-    Record tmp_record;
-    for (i = 0; i < records_per_sector() * superblock.SectorsPerCluster; i++) {
-        int position_on_cluster = i * RECORD_SIZE;
 
-        // Copy the current record do parent dir to tmp_record
-        memcpy(&tmp_record, &content[position_on_cluster], RECORD_SIZE);
+    // file with same name found while resolving path
+    Record tmp_record = path.record;
+    DWORD slot = path.slot;
+
+    if (exists == TRUE) { //if file already exists, delete the content which belongs to the original
+        DWORD cluster_to_delete = tmp_record.firstCluster;
+
+        // release the whole chain writing each fat sector once
+        // since new record already owns a fresh first cluster (chain is
+        // followed to its end since handles may have linked clusters
+        // their records do not count yet)
+        fat_begin_batch();
+        while (cluster_to_delete != END_OF_FILE && cluster_to_delete != FREE_CLUSTER && cluster_to_delete != BAD_SECTOR) {
+            DWORD tmp_cluster = get_value_from_fat(cluster_to_delete);
+            if (alloc_release(cluster_to_delete) != SUCCESS) {
+                fat_end_batch();
+                return ERROR;
+            }
 
-        // Just need to check for duplications if it isn't invalid
-        if (tmp_record.TypeVal != TYPEVAL_INVALIDO) {
-           
-			if (strcmp(tmp_record.name, file.name) == 0) { //if file already exists, delete the content which belongs to the original
-				int clusterCounter;
-				int cluster_to_delete = tmp_record.firstCluster;
-				for (clusterCounter = 0; clusterCounter < tmp_record.clustersFileSize; clusterCounter++) {
-					int tmp_cluster = local_fat[cluster_to_delete];
-					if (clusterCounter == 0)
-					{
-						if (set_value_to_fat(cluster_to_delete, EOF) != SUCCESS)
-							return ERROR;
-					}
-					else
-					{
-						if (set_value_to_fat(cluster_to_delete, FREE_CLUSTER) != SUCCESS)
-							return ERROR;
-					}
-							
-					cluster_to_delete = tmp_cluster;
-				}
-				file.bytesFileSize = 0;
-				file.clustersFileSize = 1;
+            cluster_to_delete = tmp_cluster;
+        }
+        if (fat_end_batch() != SUCCESS)
+            return ERROR;
 
-				// copy the content of file to the actual position on cluster
-				memcpy(&content[position_on_cluster], &file, RECORD_SIZE);
+        // handles still opened on old chain must not follow it nor
+        // store their pending writes
+        invalidate_file_cursors(tmp_record.firstCluster);
+        files_release_chain(tmp_record.firstCluster);
 
-				// write the modified cluster (with the new file) 
-				write_cluster(parent_dir.firstCluster, content);
+    // otherwise take lowest free entry of parent directory (growing it if full)
+    } else if (alloc_dir_slot(path.parent, &slot) != SUCCESS) {
+        // parent directory cannot grow so give back allocated cluster
+        alloc_release(p_free_sector);
+        return ERROR;
+    }
 
-				// doesn't need to iterate anymore
-				able_to_write = TRUE;
+    // write the new file record (over the old one if it existed)
+    if (write_dir_record(path.parent, slot, &file) != SUCCESS) {
+        alloc_release(p_free_sector);
+        return ERROR;
+    }
 
-				break;
-            }
+    *created = file;
+    *created_slot = slot;
 
-        // If it's invalid = it's free (ie, we can write on it)
-        } 
-		else 
-		{
-            // copy the content of file to the actual position on cluster
-            memcpy(&content[position_on_cluster], &file, RECORD_SIZE);
-            
-            // write the modified cluster (with the new file) 
-            write_cluster(parent_dir.firstCluster, content);
-            
-            // doesn't need to iterate anymore
-            able_to_write = TRUE;
-            
-            break;
-        }
-    }
+    return SUCCESS;
+}
 
-    // parent directory is full
-    if (able_to_write == FALSE)
+/**
+ * Creates a new archive.
+ * 
+ * returns - File handle if possible (positive number) ERROR otherwise. 
+ **/
+FILE2 create2 (char *filename) {
+    if (ensure_mounted() != SUCCESS)
         return ERROR;
 
-    // sets EOF to the found free index of FAT
-    if (set_value_to_fat(p_free_sector, EOF) != SUCCESS)
-    	return ERROR;
+    // walk path once finding parent folder and a file with same name
+    // keeping both locked while the entry is replaced
+    PathLookup path;
+    int exists = lock_path(filename, &path);
 
-    // release resources for path
-    free(path);
+    // return error if parent path does not exist
+    if (exists == ERROR)
+        return ERROR;
 
-	// if possible, save as opened
-	// otherwise, returns a error
-	return save_as_opened(file, filename);
-}
+    Record file;
+    DWORD slot;
+    int created = create_at(&path, exists, &file, &slot);
 
-int delete2 (char *filename) {
-	// extract path head and tail
-    Path *path = malloc(sizeof(Path));
-    if (path_from_name(filename, path) != SUCCESS) {
-        free(path);
-        return ERROR;
-    }
+    unlock_path(&path, exists);
 
-    // return error if parent path does not exists
-    if (!does_name_exists(path->tail))
-        // path does not exists
+    if (created != SUCCESS)
         return ERROR;
 
-    // get the descriptor for parent folder
-    Record parent_dir;
-    lookup_parent_descriptor_by_name(path->tail, &parent_dir);
+    // if possible, save as opened
+    // otherwise, returns a error
+    return save_as_opened(file, path.parent, slot);
+}
 
-    // find the to-be-deleted file inside of parent dir
-	Record file;
-	if (!lookup_descriptor_by_name(parent_dir.firstCluster, path->head, &file))
-		// file does not exists
-		return ERROR;  
+/**
+ * Remove file entry of a locked path (see lock_path) releasing its chain.
+ *
+ * on error - returns ERROR if entry is not a file or link or disk cannot
+ *            be written otherwise SUCCESS.
+**/
+static int delete_at (PathLookup *path) {
+    Record file = path->record;
 
 	if (!(file.TypeVal == TYPEVAL_REGULAR || file.TypeVal == TYPEVAL_LINK))
 		// Is not a regular file or softlink
 		return ERROR;
 
 	// Here we delete the entry of the file on the parent directory
-    
-    // buffer to read the content of parent dir cluster
-    unsigned char content[SECTOR_SIZE * superblock.SectorsPerCluster];
-    if (read_cluster(parent_dir.firstCluster, content) != SUCCESS) return ERROR;
-
-    int i;
-
-    // flag to check if a space to write was found
-    int found = FALSE;
 
-    Record tmp_record;
-
-    for (i = 0; i < records_per_sector() * superblock.SectorsPerCluster; i++) {
-        int position_on_cluster = i * RECORD_SIZE;
-        // Copy the current record do parent dir to tmp_record
-        memcpy(&tmp_record, &content[position_on_cluster], RECORD_SIZE);
-        if (strcmp(tmp_record.name, file.name) == 0) {
-            // sets file type to invalid (ie, it is now a free entry)
-            file.TypeVal = TYPEVAL_INVALIDO;
-
-            memcpy(&content[position_on_cluster], &file, RECORD_SIZE);
-            
-            // write the modified cluster (without the file) 
-            write_cluster(parent_dir.firstCluster, content);
-            found = TRUE;
-        }
-    }
+    // sets file type to invalid (ie, it is now a free entry)
+    Record empty = file;
+    empty.TypeVal = TYPEVAL_INVALIDO;
 
-    if (found == FALSE)
-    	return ERROR;
+    if (write_dir_record(path->parent, path->slot, &empty) != SUCCESS)
+        return ERROR;
 
     // free the FAT entries that the file used to use
-    int fat_index;
-    int cluster_to_delete = file.firstCluster;
-    for (fat_index = 0; fat_index < file.clustersFileSize; fat_index++) {
-        int tmp_cluster = local_fat[cluster_to_delete];
-        if (set_value_to_fat(cluster_to_delete, FREE_CLUSTER) != SUCCESS)
+    DWORD cluster_to_delete = file.firstCluster;
+
+    // release the whole chain writing each fat sector once (followed
+    // to its end since handles may have linked clusters their records
+    // do not count yet)
+    fat_begin_batch();
+    while (cluster_to_delete != END_OF_FILE && cluster_to_delete != FREE_CLUSTER && cluster_to_delete != BAD_SECTOR) {
+        DWORD tmp_cluster = get_value_from_fat(cluster_to_delete);
+        if (set_value_to_fat(cluster_to_delete, FREE_CLUSTER) != SUCCESS) {
+            fat_end_batch();
         	return ERROR;
+        }
         cluster_to_delete = tmp_cluster;
     }
+    if (fat_end_batch() != SUCCESS)
+        return ERROR;
 
-    // release resources for path
-    free(path);
+    // handles still opened on this file must not follow released chain
+    // nor store their pending writes
+    invalidate_file_cursors(file.firstCluster);
+    files_release_chain(file.firstCluster);
 
     return SUCCESS;
 }
 
-FILE2 open2 (char *filename) {
-	// extract path head and tail
-    Path *path = malloc(sizeof(Path));
-    if (path_from_name(filename, path) != SUCCESS) {
-        free(path);
+int delete2 (char *filename) {
+    if (ensure_mounted() != SUCCESS)
+        return ERROR;
+
+    // find the to-be-deleted file and its record slot inside of parent dir
+    PathLookup path;
+    int exists = lock_path(filename, &path);
+
+    if (exists == ERROR)
         return ERROR;
-    }
 
-    // return error if parent path does not exists
-    if (!does_name_exists(path->tail))
-        // path does not exists
+    // file does not exist
+    int result = exists == TRUE ? delete_at(&path) : ERROR;
+
+    unlock_path(&path, exists);
+
+    return result;
+}
+
+FILE2 open2 (char *filename) {
+    if (ensure_mounted() != SUCCESS)
         return ERROR;
 
-    // get the descriptor for parent folder
-    Record parent_dir;
-    lookup_parent_descriptor_by_name(path->tail, &parent_dir);
+    // find the file and its record slot inside of parent dir
+    PathLookup path;
+    if (resolve_path(filename, &path) != TRUE)
+        // file or its parent does not exist
+        return ERROR;
 
-    // find the to-be-deleted file inside of parent dir
-	Record file;
-	if (!lookup_descriptor_by_name(parent_dir.firstCluster, path->head, &file))
-		// file does not exists
-		return ERROR;  
+    Record file = path.record;
 
 	if (!(file.TypeVal == TYPEVAL_REGULAR || file.TypeVal == TYPEVAL_LINK))
 		// Is not a regular file or softlink
@@ -231,371 +221,556 @@ FILE2 open2 (char *filename) {
 
 	if (file.TypeVal == TYPEVAL_LINK) //we must open the real file
 	{
-		Record* filefromlink = malloc(sizeof(Record));
-		filefromlink = findLinkRecord(file);
-		if (filefromlink == NULL)
+		// handle keeps parent and slot of real file
+		if (resolve_link(file, &path) != TRUE)
 			return ERROR;
-		if (filefromlink->TypeVal != TYPEVAL_REGULAR)
+
+		file = path.record;
+
+		if (file.TypeVal != TYPEVAL_REGULAR)
 			return ERROR;
-		else
-		{
-			char linkpath[phys_cluster_size()];
-			strcpy(linkpath, findLinkPath(file)->both);
-			file = *filefromlink;
-			free(filefromlink);
-			return save_as_opened(file, linkpath);
-		}
 	}
-	
-
-    // release resources for path
-    free(path);
 
 	// if possible, save as opened
 	// otherwise, returns a error
-	return save_as_opened(file, filename);
+	return save_as_opened(file, path.parent, path.slot);
 }
 
 int close2 (FILE2 handle) {
-	// Check if handle is inside of boundaries
-	if (handle < 0)
+	if (ensure_mounted() != SUCCESS)
 		return ERROR;
-	if (handle >= MAX_OPENED_FILES)
-		return ERROR;
-	// Check if the passed handle has a file 
-	if (opened_files[handle].is_used == FALSE)
+
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
 		return ERROR;
 
-	//opened_files[handle].file = (Record) NULL;
-	opened_files[handle].is_used = FALSE;
+	// pending writes and the fat sectors they changed reach disk image
+	// before slot is gone
+	int result = file_flush_writes(opened);
 
-	num_opened_files--;
-    return SUCCESS;
+	if (flush_fat() != SUCCESS)
+		result = ERROR;
+
+	// free slot and its cluster array
+	release_opened_file(opened);
+    return result;
 }
 
-int read2 (FILE2 handle, char *buffer, int size) {
-	// Check if handle is inside of boundaries
-	if (handle < 0)
-		return ERROR;
-	if (handle >= MAX_OPENED_FILES)
-		return ERROR;
-	// Check if the passed handle has a file 
-	if (opened_files[handle].is_used == FALSE)
+/**
+ * Read size bytes of an opened file starting at position. Current
+ * pointer of handle is not used nor moved. File node must be locked.
+ *
+ * param opened   - opened file (handle lock held)
+ * param position - byte offset where reading starts
+ *
+ * returns  - number of bytes read (0 at or after end of file).
+ * on error - returns ERROR if file chain cannot be read.
+**/
+static int read_at (OpenedFile *opened, char *buffer, int size, int position) {
+	// file was deleted or cut through another handle meanwhile
+	if (!file_apply_cut(opened))
 		return ERROR;
 
 	// get the file from the opened list
-	Record file = opened_files[handle].file; 
-    
-    int current_pointer = opened_files[handle].current_pointer;
-	
-	// creates a buffer to read the content
-	unsigned char content[file.clustersFileSize * SECTOR_SIZE * superblock.SectorsPerCluster];
-	
-	// read cluster by cluster and saves on the buffer
-	int read_index = file.firstCluster;
-	int i;
-	for (i = 0; i < file.clustersFileSize; i++) {
-		if (read_cluster(read_index, &content[i * SECTOR_SIZE * superblock.SectorsPerCluster]) != SUCCESS) return ERROR;
-		read_index = local_fat[read_index];
-	}
+	Record file = opened->file; 
+
+	if (size < 0)
+		return ERROR;
+
+	// nothing left to read after end of file
+	if (position >= file.bytesFileSize)
+		return 0;
 
 	// size = min(size, difference_lenght)
-	// where difference_length is the size of bytes from the current_pointer
+	// where difference_length is the size of bytes from the position
 	//		to the end of the file
-	int difference_length = file.bytesFileSize - current_pointer;
+	int difference_length = file.bytesFileSize - position;
 	size = difference_length < size ? difference_length : size;
 
-	// copy the read content to the buffer
-	memcpy(buffer, &content[current_pointer], size);
-    
-	// increases the current pointer
-	opened_files[handle].current_pointer += size;
+	int cluster_size = phys_cluster_size();
 
-    return size;
-}
+	// position of cluster holding first byte in chain
+	DWORD cluster_index = position / cluster_size;
 
-int write2 (FILE2 handle, char *buffer, int size) {
-	// Check if handle is inside of boundaries
-	if (handle < 0)
-		return ERROR;
-	
-    if (handle >= MAX_OPENED_FILES)
-		return ERROR;
-	
-    // Check if the passed handle has a file 
-	if (opened_files[handle].is_used == FALSE)
-		return ERROR;
+	// resolve it from handle cursor (one step for sequential reads)
+	DWORD cluster = file_cluster_at(opened, cluster_index);
 
-	// get the file from the opened list
-	Record file = opened_files[handle].file; 
-	int current_pointer = opened_files[handle].current_pointer;
-	int cluster_size = superblock.SectorsPerCluster * SECTOR_SIZE;
-	int size_with_write = current_pointer + size;
-	int content_size = cluster_size * file.clustersFileSize;
-	int total_bytes = file.bytesFileSize;
+	// offset of first byte inside its cluster
+	int offset = position % cluster_size;
 
-	if (size_with_write > file.bytesFileSize) {
-		content_size += size;
-		
-        // if this happens then total_bytes need to be updated
-		total_bytes = size_with_write;
-	}
+	// number of bytes already copied to caller buffer
+	int done = 0;
 
-	// total number of cluster = file size in bytes / cluster size in bytes
-	// ceil is used because if a cluster has 1024bytes and a file has 1025,
-	// then 2 clusters are necessary
-	int file_total_clusters = ceil(((float) total_bytes) / cluster_size);
-	
-	// here we find out how many clusters need be allocated
-	int file_clusters_to_alloc = file_total_clusters - file.clustersFileSize;
+	while (done < size) {
+		// chain ended before file size (corrupted chain)
+		if (cluster == END_OF_FILE || cluster == FREE_CLUSTER)
+			return ERROR;
 
-	// number of clusters really allocated
-	int file_clusters_allocated = 0;
+		if (offset == 0 && size - done >= cluster_size) {
+			// whole clusters are read straight into caller buffer
+			// using a single request per contiguous run
+			DWORD run = chain_run_length(cluster, (size - done) / cluster_size);
 
-	if (file_clusters_to_alloc > 0) {
-		int fat_last_index = file.firstCluster;
-		while (local_fat[fat_last_index] != EOF)
-			fat_last_index = local_fat[fat_last_index];
-		int fat_index;
-		for (fat_index = 0; fat_index < file_clusters_to_alloc; fat_index++) {
-			int new_fit = phys_fat_first_fit();
-			if (new_fit != ERROR) {
-				if (set_value_to_fat(fat_last_index, new_fit) != SUCCESS)
-					return ERROR;
-				
-                if (set_value_to_fat(new_fit, EOF) != SUCCESS)
-					return ERROR;
-				
-                fat_last_index = new_fit;
-				file_clusters_allocated++;
-			} else {
-				break;
-			}
+			if (read_clusters(cluster, run, (unsigned char *) &buffer[done]) != SUCCESS) return ERROR;
+
+			// keep cursor on last cluster read
+			file_cursor_set(opened, cluster_index + run - 1, cluster + run - 1);
+
+			done += run * cluster_size;
+			cluster_index += run;
+			cluster = get_value_from_fat(cluster + run - 1);
+		} else {
+			// partial cluster at head or tail of request
+			unsigned char content[cluster_size];
+
+			if (read_cluster(cluster, content) != SUCCESS) return ERROR;
+
+			int chunk = cluster_size - offset;
+			chunk = size - done < chunk ? size - done : chunk;
+
+			memcpy(&buffer[done], &content[offset], chunk);
+
+			// keep cursor on last cluster read
+			file_cursor_set(opened, cluster_index, cluster);
+
+			done += chunk;
+			offset = 0;
+			cluster_index++;
+			cluster = get_value_from_fat(cluster);
 		}
-		set_value_to_fat(fat_last_index, EOF);
 	}
 
-	// creates a buffer to read the content
-	unsigned char content[content_size];
-	
-	// read cluster by cluster and saves on the buffer
-	int read_index = file.firstCluster;
-	int index;
-	for (index = 0; index < file.clustersFileSize + file_clusters_allocated; index++) {
-		if (read_cluster(read_index, &content[index * SECTOR_SIZE * superblock.SectorsPerCluster]) != SUCCESS) return ERROR;
-		read_index = local_fat[read_index];
-	}
+	// prefetch what a sequential reader asks next (cursor sits on last
+	// cluster read)
+	readahead_after_read(&opened->readahead, position, size, file.bytesFileSize,
+	                     opened->cursor_index, opened->cursor_cluster);
 
-	// update the content
-	memcpy(&content[current_pointer], buffer, size);
-	
-	int write_index = file.firstCluster;
-	for (index = 0; index < file.clustersFileSize; index++) {
-		write_cluster(write_index, &content[index * SECTOR_SIZE * superblock.SectorsPerCluster]);
-		write_index = local_fat[write_index];
-	}
+    return size;
+}
 
-	// we need the path to get the parent folder
-	Path *path = malloc(sizeof(Path));
-    if (path_from_name(opened_files[handle].path, path) != SUCCESS) {
-        free(path);
-        return ERROR;
-    }
+/**
+ * Read from an opened file holding its node for reading so that chain
+ * cannot be cut meanwhile. Readers of other files never wait.
+**/
+static int locked_read (OpenedFile *opened, char *buffer, int size, int position) {
+	DWORD first = opened->file.firstCluster;
 
-	// we need the parent folder to update the record
-	Record parent_dir;
-    lookup_parent_descriptor_by_name(path->tail, &parent_dir);
-	
-	// Here we update the entry of the file on the parent directory
-    // buffer to read the content of parent dir cluster
-	unsigned char parent_content[SECTOR_SIZE * superblock.SectorsPerCluster];
-    if (read_cluster(parent_dir.firstCluster, parent_content) != SUCCESS) return ERROR;
+	node_lock_shared(first);
+	int result = read_at(opened, buffer, size, position);
+	node_unlock(first);
 
-    int i;
+	return result;
+}
 
-    Record tmp_record;
+int read2 (FILE2 handle, char *buffer, int size) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
 
-    for (i = 0; i < records_per_sector() * superblock.SectorsPerCluster; i++) {
-        int position_on_cluster = i * RECORD_SIZE;
-        // Copy the current record do parent dir to tmp_record
-        memcpy(&tmp_record, &parent_content[position_on_cluster], RECORD_SIZE);
-        if (strcmp(tmp_record.name, file.name) == 0) {
-        	// update the file size
-            file.bytesFileSize = total_bytes;
-            file.clustersFileSize = file.clustersFileSize + file_clusters_allocated;
-
-            // save the updated file
-            memcpy(&parent_content[position_on_cluster], &file, RECORD_SIZE);
-            
-            // write the file with differences 
-            write_cluster(parent_dir.firstCluster, parent_content);
-        }
-    }
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
+		return ERROR;
 
-    // update the register on opened_files
-    opened_files[handle].file = file;
+	// bytes still held by handle must be visible to the read
+	if (file_flush_writes(opened) != SUCCESS) {
+		file_handle_release(opened);
+		return ERROR;
+	}
 
-    // release resources for path
-    free(path);
+	int result = locked_read(opened, buffer, size, opened->current_pointer);
 
-    return size;
+	// increases the current pointer
+	if (result > 0)
+		opened->current_pointer += result;
+
+	file_handle_release(opened);
+
+	return result;
 }
 
-int seek2 (FILE2 handle, DWORD offset) {
-	// Check if handle is inside of boundaries
-	if (handle < 0)
+/**
+ * Read size bytes of a file starting at offset without using or moving
+ * its current pointer.
+ *
+ * returns  - number of bytes read (0 at or after end of file).
+ * on error - returns ERROR if handle or offset is invalid or file cannot be read.
+**/
+int pread2 (FILE2 handle, char *buffer, int size, DWORD offset) {
+	if (ensure_mounted() != SUCCESS)
 		return ERROR;
-	if (handle >= MAX_OPENED_FILES)
+
+	// positions are kept as int like current pointer
+	if (offset > INT_MAX)
 		return ERROR;
-	// Check if the passed handle has a file 
-	if (opened_files[handle].is_used == FALSE)
+
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
 		return ERROR;
 
-	// validate offset
-	if (offset < 0 && offset != -1) 
+	// bytes still held by handle must be visible to the read
+	if (file_flush_writes(opened) != SUCCESS) {
+		file_handle_release(opened);
 		return ERROR;
+	}
 
-	// update the current_pointer of the passed handle
-	opened_files[handle].current_pointer = (offset == -1) ? opened_files[handle].file.bytesFileSize : offset; 
+	int result = locked_read(opened, buffer, size, offset);
 
-	return SUCCESS;
-}
+	file_handle_release(opened);
 
-/**
- * Return author names.
- * 
- * returns - SUCCESS if possible FALSE otherwise. 
- **/
-int identify2 (char *name, int size) {
-    char *group = "Catarina Nogueira 00245534\nJoão Camargo 00274722\nArthur Balbao 00228702\n\0";
-    
-    if (size < strlen(group)) {
-        return ERROR;
-    }
-    
-    strncpy(name, group, size - 1);
-    
-    name[size] = '\0';
-    
-    return SUCCESS;
+	return result;
 }
 
 /**
- * Creates a new directory. 
+ * Link count more clusters after last one of an opened file reserving
+ * the whole extension as contiguous runs with a single allocator call.
+ * FAT sectors stay dirty until the file is closed or synced so appends
+ * write each of them once. Last new cluster, the one a growing write
+ * usually leaves partly filled, is zeroed in buffer cache so merging the
+ * handle tail into it reads nothing from disk. File record is not
+ * changed. File node must be locked for writing.
  *
- * param pathname - absolute or relative path for new directory
- * 
- * returns - SUCCESS if create FALSE otherwise.
+ * returns  - number of clusters linked (less than count if disk is full).
+ * on error - returns ERROR if chain is broken or FAT cannot be updated.
 **/
-int mkdir2 (char *pathname) {
-    // stores if read and write was successfull
-    int can_read_write = SUCCESS;
+static int extend_at (OpenedFile *opened, int count) {
+	// last cluster of chain (one step from cursor for appends)
+	DWORD last = file_cluster_at(opened, opened->file.clustersFileSize - 1);
 
-    // extract path head and tail
-    Path *path = malloc(sizeof(Path));
-    if (path_from_name(pathname, path) != SUCCESS) {
-        free(path);
-        return ERROR;
-    }
+	if (last == END_OF_FILE || last == FREE_CLUSTER)
+		return ERROR;
 
-    // unable to locate parent path in disk or
-    // current name exists in disk
-    // then return an error
-    if (!does_name_exists(path->tail)) {
-        return ERROR;
-    }
+	// chain may run past what record says, never link in the middle
+	DWORD next;
+	while ((next = get_value_from_fat(last)) != END_OF_FILE && next != FREE_CLUSTER && next != BAD_SECTOR)
+		last = next;
 
-    // current name exists in disk so we should
-    // return an error
-    if (does_name_exists(path->both)) {
-        return ERROR;
-    }
+	DWORD first;
 
-    // find first free fat physical sector entry
-    int p_free_sector = phys_fat_first_fit();
-    
-    // convert physical fat sector entry to logical fat sector entry
-    int l_fat_free_sector = fat_phys_to_log(p_free_sector);
+	fat_begin_batch();
+	int allocated = alloc_chain(last, count, &first);
+	fat_end_batch_deferred();
 
-    // read from logical sector and fill up buffer
-    can_read_write = read_sector(l_fat_free_sector, buffer);
+	if (allocated == ERROR)
+		return ERROR;
 
-    // something bad happened, disk may be corrupted
-    if (can_read_write != SUCCESS) {
-        return ERROR;
-    }
+	// only spares a read later so failing here is harmless
+	if (allocated > 0) {
+		unsigned char zeros[phys_cluster_size()];
+		memset(zeros, 0x00, sizeof(zeros));
 
-    // calculate cluster size from free physical sector entry
-    BYTE p_free_cluster = p_free_sector * superblock.SectorsPerCluster;
+		write_cluster(chain_cluster_at(first, allocated - 1), zeros);
+	}
 
-    // fill buffer area with END_OF_FILE marking last sector
-    // as END_OF_FILE (value 0xFFFFFFFF) since directories occupy 
-    // one cluster by specs
-    DWORD eof = END_OF_FILE;
-    memcpy(buffer + p_free_cluster, &eof, FAT_ENTRY_SIZE);
+	// cluster array of this handle no longer covers whole chain
+	free(opened->chain);
+	opened->chain = NULL;
+	opened->chain_len = 0;
 
-    // write this sector back to disk in FAT marking current
-    // fat entry as END_OF_FILE
-    can_read_write = write_sector(l_fat_free_sector, buffer);
+	return allocated;
+}
 
-    // something bad happened, disk may be corrupted
-    if (can_read_write != SUCCESS) return ERROR;
+/**
+ * Write size bytes to an opened file starting at position growing it
+ * when needed. Current pointer of handle is not used nor moved. Only
+ * file node must be locked for writing: the grown record is kept in the
+ * handle and stored in parent directory by file_flush_writes.
+ *
+ * param opened   - opened file (handle lock held)
+ * param position - byte offset where writing starts
+ *
+ * returns  - number of bytes written (less than size if disk gets full).
+ * on error - returns ERROR if nothing can be written or disk cannot be updated.
+**/
+static int write_at (OpenedFile *opened, char *buffer, int size, int position) {
+	if (size < 0)
+		return ERROR;
 
-    // create current directory (head from path_from_name func)
-    Record dir;
-    dir.TypeVal = TYPEVAL_DIRETORIO;
-    dir.bytesFileSize = phys_cluster_size();
-    dir.clustersFileSize = 1;
-    strncpy(dir.name, path->head, FILE_NAME_SIZE);
-    dir.firstCluster = p_free_sector;
+	// file was deleted or cut through another handle meanwhile
+	if (!file_apply_cut(opened))
+		return ERROR;
 
-    // find parent directory by tail
-    Record parent_dir;
-    lookup_parent_descriptor_by_name(path->tail, &parent_dir);
+	// get the file from the opened list
+	Record file = opened->file; 
+	int cluster_size = phys_cluster_size();
+	int size_with_write = position + size;
+	int total_bytes = file.bytesFileSize;
 
-    // convert parent_dir cluster to logical sector
-    DWORD l_parent_sector = cluster_to_log_sector(parent_dir.firstCluster);
+	// if this happens then total_bytes need to be updated
+	if (size_with_write > file.bytesFileSize)
+		total_bytes = size_with_write;
 
-    // find free entry within parent cluster
-    DWORD free_entry = lookup_cont_record_by_type(parent_dir.firstCluster, TYPEVAL_INVALIDO);
+	// total number of cluster = file size in bytes / cluster size in bytes
+	// rounded up because if a cluster has 1024bytes and a file has 1025,
+	// then 2 clusters are necessary
+	int file_total_clusters = (total_bytes + cluster_size - 1) / cluster_size;
+	
+	// here we find out how many clusters need be allocated
+	int file_clusters_to_alloc = file_total_clusters - file.clustersFileSize;
 
-    // calculate number of records per sector
-    int nr_of_records = records_per_sector();
+	// number of clusters really allocated
+	int file_clusters_allocated = 0;
 
-    // calculate free entry logical sector
-    DWORD l_free_entry_sector = free_entry / nr_of_records;
+	if (file_clusters_to_alloc > 0) {
+		file_clusters_allocated = extend_at(opened, file_clusters_to_alloc);
+		if (file_clusters_allocated == ERROR)
+			return ERROR;
 
-    // maps logical entry sector
-    DWORD l_parent_free_entry_sector = l_free_entry_sector + l_parent_sector;
+		// disk is full so write only what fits in clusters we own
+		if (file_clusters_allocated < file_clusters_to_alloc) {
+			int capacity = (file.clustersFileSize + file_clusters_allocated) * cluster_size;
 
-    // read from logical entry sector
-    can_read_write = read_sector(l_parent_free_entry_sector, buffer);
+			if (capacity <= position)
+				return ERROR;
 
-    // something bad happened, disk may be corrupted
-    if (can_read_write != SUCCESS) return ERROR;
+			size = capacity - position;
+			size_with_write = capacity;
+			total_bytes = size_with_write > file.bytesFileSize ? size_with_write : file.bytesFileSize;
+		}
+	}
 
-    // maps logical free entry to physical free entry
-    DWORD p_free_entry = (free_entry - l_free_entry_sector * superblock.SectorsPerCluster) * RECORD_SIZE;
+	// position of cluster holding first byte in chain
+	DWORD cluster_index = position / cluster_size;
 
-    // fill buffer phyisical entry position with directory content
-    memcpy(buffer + p_free_entry, &dir, RECORD_SIZE);
+	// resolve it from handle cursor (one step for sequential writes)
+	DWORD cluster = file_cluster_at(opened, cluster_index);
 
-    // write parent sector back to disk
-    can_read_write = write_sector(l_parent_free_entry_sector, buffer);
+	// offset of first byte inside its cluster
+	int offset = position % cluster_size;
 
-    // something bad happened, disk may be corrupted
-    if (can_read_write != SUCCESS) return ERROR;
+	// number of bytes already written from caller buffer
+	int done = 0;
 
-    // convert free physical fat sector to logical sector logical data sector
-    DWORD l_data_free_sector = cluster_to_log_sector(p_free_sector);
+	while (done < size) {
+		// chain ended before expected (corrupted chain)
+		if (cluster == END_OF_FILE || cluster == FREE_CLUSTER)
+			return ERROR;
 
-    // read logical free data sector to cleanup buffer
-    can_read_write = read_sector(l_data_free_sector, buffer);
+		if (offset == 0 && size - done >= cluster_size) {
+			// whole clusters are written straight from caller buffer
+			// using a single request per contiguous run (no read needed)
+			DWORD run = chain_run_length(cluster, (size - done) / cluster_size);
 
-    // something bad happened, disk may be corrupted
-    if (can_read_write != SUCCESS) return ERROR;
-    
-    // create self pointer '.'
+			if (write_clusters(cluster, run, (unsigned char *) &buffer[done]) != SUCCESS) return ERROR;
+
+			// bytes of handle tail in those clusters are superseded
+			file_tail_discard(opened, cluster_index, run);
+
+			// keep cursor on last cluster written
+			file_cursor_set(opened, cluster_index + run - 1, cluster + run - 1);
+
+			done += run * cluster_size;
+			cluster_index += run;
+			cluster = get_value_from_fat(cluster + run - 1);
+		} else {
+			// partial cluster at head or tail of request is kept in
+			// handle tail buffer so small writes to the same cluster
+			// are merged before reaching buffer cache
+			int chunk = cluster_size - offset;
+			chunk = size - done < chunk ? size - done : chunk;
+
+			if (file_tail_write(opened, cluster_index, cluster, offset, &buffer[done], chunk) != SUCCESS)
+				return ERROR;
+
+			// keep cursor on last cluster written
+			file_cursor_set(opened, cluster_index, cluster);
+
+			done += chunk;
+			offset = 0;
+			cluster_index++;
+			cluster = get_value_from_fat(cluster);
+		}
+	}
+
+	// record only changes when file grew
+	int is_changed = total_bytes != file.bytesFileSize || file_clusters_allocated > 0;
+
+	// update the file size
+	file.bytesFileSize = total_bytes;
+	file.clustersFileSize = file.clustersFileSize + file_clusters_allocated;
+
+    // update the register on opened file
+    opened->file = file;
+
+	// entry of the file on the parent directory is updated once when
+	// pending writes are flushed (see file_flush_writes)
+	if (is_changed)
+		opened->record_dirty = TRUE;
+
+    return size;
+}
+
+/**
+ * Write to an opened file holding its node for writing. Parent directory
+ * is not touched since the record is only stored on flush.
+**/
+static int locked_write (OpenedFile *opened, char *buffer, int size, int position) {
+	DWORD first = opened->file.firstCluster;
+
+	node_lock_exclusive(first);
+	int result = write_at(opened, buffer, size, position);
+	node_unlock(first);
+
+	return result;
+}
+
+int write2 (FILE2 handle, char *buffer, int size) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
+		return ERROR;
+
+	int result = locked_write(opened, buffer, size, opened->current_pointer);
+
+	// increases the current pointer
+	if (result > 0)
+		opened->current_pointer += result;
+
+	file_handle_release(opened);
+
+	return result;
+}
+
+/**
+ * Write size bytes to a file starting at offset without using or moving
+ * its current pointer.
+ *
+ * returns  - number of bytes written (less than size if disk gets full).
+ * on error - returns ERROR if handle or offset is invalid or nothing can be written.
+**/
+int pwrite2 (FILE2 handle, char *buffer, int size, DWORD offset) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	// positions are kept as int like current pointer so the
+	// whole write must end below INT_MAX
+	if (offset > (DWORD) INT_MAX - (size > 0 ? size : 0))
+		return ERROR;
+
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
+		return ERROR;
+
+	int result = locked_write(opened, buffer, size, offset);
+
+	file_handle_release(opened);
+
+	return result;
+}
+
+int seek2 (FILE2 handle, DWORD offset) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	// validate offset
+	if (offset < 0 && offset != -1) 
+		return ERROR;
+
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
+		return ERROR;
+
+	// update the current_pointer of the passed handle
+	opened->current_pointer = (offset == -1) ? opened->file.bytesFileSize : offset; 
+
+	file_handle_release(opened);
+
+	return SUCCESS;
+}
+
+/**
+ * Return author names.
+ * 
+ * returns - SUCCESS if possible FALSE otherwise. 
+ **/
+int identify2 (char *name, int size) {
+    char *group = "Catarina Nogueira 00245534\nJoão Camargo 00274722\nArthur Balbao 00228702\n\0";
+    
+    if (size < strlen(group)) {
+        return ERROR;
+    }
+    
+    strncpy(name, group, size - 1);
+    
+    name[size] = '\0';
+    
+    return SUCCESS;
+}
+
+/**
+ * Create directory entry and its first cluster for a locked path (see
+ * lock_path) whose last component does not exist.
+ *
+ * returns - SUCCESS if create ERROR otherwise.
+**/
+static int mkdir_at (PathLookup *locked) {
+    Mount *mount = current_mount();
+
+    PathLookup path = *locked;
+
+    // stores if read and write was successfull
+    int can_read_write = SUCCESS;
+
+    // scratch sector holding . and .. records
+    BYTE buffer[SECTOR_SIZE];
+
+    // allocate directory cluster from free cluster bitmap marking
+    // its fat entry as END_OF_FILE (value 0xFFFFFFFF) since directories
+    // start with a single cluster (alloc_dir_slot links more when full)
+    DWORD p_free_sector = alloc_cluster();
+
+    // disk is full
+    if (p_free_sector == ERROR) return ERROR;
+
+    // create current directory (last component of path)
+    Record dir;
+    dir.TypeVal = TYPEVAL_DIRETORIO;
+    dir.bytesFileSize = phys_cluster_size();
+    dir.clustersFileSize = 1;
+    strcpy(dir.name, path.name);
+    dir.firstCluster = p_free_sector;
+
+    // find lowest free entry within parent directory (growing it if full)
+    DWORD free_entry;
+    if (alloc_dir_slot(path.parent, &free_entry) != SUCCESS) {
+        // parent directory cannot grow so give back allocated cluster
+        alloc_release(p_free_sector);
+        return ERROR;
+    }
+
+    // write directory record into parent entry
+    can_read_write = write_dir_record(path.parent, free_entry, &dir);
+
+    // something bad happened, disk may be corrupted
+    if (can_read_write != SUCCESS) {
+        // no record points to new cluster so give it back
+        alloc_release(p_free_sector);
+        return ERROR;
+    }
+
+    // convert free physical fat sector to logical sector logical data sector
+    DWORD l_data_free_sector = cluster_to_log_sector(p_free_sector);
+
+    // allocated cluster may hold records from a released file or
+    // directory so clear it before writing . and .. entries
+    unsigned char empty[SECTOR_SIZE * mount->super.SectorsPerCluster];
+    memset(empty, 0x00, sizeof(empty));
+
+    if (write_cluster(p_free_sector, empty) != SUCCESS) return ERROR;
+
+    // names cached or indexed for a previous owner of this cluster are stale
+    dcache_invalidate_dir(p_free_sector);
+    dir_index_drop(p_free_sector);
+
+    memset(buffer, 0x00, SECTOR_SIZE);
+    
+    // create self pointer '.'
     Record self;
     self.TypeVal = TYPEVAL_DIRETORIO;
     strcpy(self.name, ".");
@@ -609,7 +784,7 @@ int mkdir2 (char *pathname) {
     strcpy(parent.name, "..");
     parent.bytesFileSize = phys_cluster_size();
     parent.clustersFileSize = 1;
-    parent.firstCluster = parent_dir.firstCluster;
+    parent.firstCluster = path.parent;
 
     // create add self pointer to buffer
     memcpy(buffer, &self, RECORD_SIZE);
@@ -618,79 +793,73 @@ int mkdir2 (char *pathname) {
     memcpy(buffer + RECORD_SIZE, &parent, RECORD_SIZE);
 
     // write buffer within logical data sector
-    write_sector(l_data_free_sector, buffer);
-
-    // refresh local fat
-    set_local_fat();
-
-    // release resources for path
-    free(path);
+    cache_write_sector(l_data_free_sector, buffer);
 
     return SUCCESS;
 }
 
 /**
- * Remove an existing directory. 
+ * Creates a new directory. 
  *
- * param pathname - absolute or relative path for directory
+ * param pathname - absolute or relative path for new directory
  * 
- * returns - SUCCESS if sucessfully removed FALSE otherwise.
+ * returns - SUCCESS if create FALSE otherwise.
 **/
-int rmdir2 (char *pathname) {
-    // extract path head and tail
-    Path *path = malloc(sizeof(Path));
-    if (path_from_name(pathname, path) != SUCCESS) {
-        free(path);
+int mkdir2 (char *pathname) {
+    if (ensure_mounted() != SUCCESS)
         return ERROR;
-    }
 
-    // return error if parent path does not exists
-    if (!does_name_exists(path->both)) {
+    // walk path once finding parent folder and checking new name
+    PathLookup path;
+    int exists = lock_path(pathname, &path);
+
+    // unable to locate parent path in disk
+    if (exists == ERROR)
         return ERROR;
-    }
 
-	int isLink = 0;
+    // current name exists in disk then return an error
+    int result = exists == FALSE ? mkdir_at(&path) : ERROR;
 
-    // get the descriptor for parent dir
-    Record parent_dir;
-    lookup_parent_descriptor_by_name(path->tail, &parent_dir);
+    unlock_path(&path, exists);
 
-    // find the to-be-deleted child dir
-    Record child_dir;    
-    lookup_descriptor_by_name(parent_dir.firstCluster, path->head, &child_dir);  
+    return result;
+}
+
+/**
+ * Remove an empty directory of a locked path (see lock_path) whose last
+ * component exists.
+ *
+ * returns - SUCCESS if sucessfully removed ERROR otherwise.
+**/
+static int rmdir_at (PathLookup *locked) {
+    Mount *mount = current_mount();
 
-	Record* temprec = NULL;
+    PathLookup path = *locked;
 
+    Record child_dir = path.record;
 
     // Check if this record is a trully directory
     if (child_dir.TypeVal != TYPEVAL_DIRETORIO) {
-		if (child_dir.TypeVal == TYPEVAL_LINK)
-		{
-			temprec = malloc(sizeof(Record));
-			temprec = findLinkRecord(child_dir);
-			if (temprec == NULL)
-				return ERROR;
-			if (temprec->TypeVal != TYPEVAL_DIRETORIO)
-				return ERROR;
-
-			path = findLinkPath(child_dir);
-			lookup_parent_descriptor_by_name(path->tail, &parent_dir);
-			isLink = 1;
-			child_dir = *temprec;
-		}
-		else
-			return ERROR;
+        return ERROR;
     }
 
+    // . and .. (and root, reached as /) are never removed
+    if (strcmp(path.name, ".") == 0 || strcmp(path.name, "..") == 0) return ERROR;
+
+    // directory may span several clusters so count its valid entries
+    // through directory index (only . and .. are allowed)
+    int entries = dir_index_entries(child_dir.firstCluster);
+    if (entries == ERROR || entries > 2) return ERROR;
+
     // allocate a buffer for storing temp child cluster content
-    unsigned char content[SECTOR_SIZE * superblock.SectorsPerCluster];
+    unsigned char content[SECTOR_SIZE * mount->super.SectorsPerCluster];
     if (read_cluster(child_dir.firstCluster, content) != SUCCESS) return ERROR;
 
     // loop thourgh children directory to check if its empty or not
     // marking its members (only . and ..) as free entriess
     int i;
     Record tmp_record;
-    for (i = 0; i < records_per_sector() * superblock.SectorsPerCluster; i++) {
+    for (i = 0; i < records_per_sector() * mount->super.SectorsPerCluster; i++) {
 
         // calculate cluster position
         int position_on_cluster = i * RECORD_SIZE;
@@ -723,124 +892,107 @@ int rmdir2 (char *pathname) {
     // write back to disk all free entries
     write_cluster(child_dir.firstCluster, content);
 
-    // read parent dir to temp buffer
-    if (read_cluster(parent_dir.firstCluster, content) != SUCCESS) return ERROR;
+    // mark child entry in parent directory as free
+    tmp_record = child_dir;
+    tmp_record.TypeVal = TYPEVAL_INVALIDO;
 
-    // find child entry in parent cluster and mark it as free
-    for (i = 0; i < records_per_sector() * superblock.SectorsPerCluster; i++) {
-        // calculate cluster position
-        int position_on_cluster = i * RECORD_SIZE;
+    if (write_dir_record(path.parent, path.slot, &tmp_record) != SUCCESS) return ERROR;
 
-        // Copy the current record do parent dir to tmp_record
-        memcpy(&tmp_record, &content[position_on_cluster], RECORD_SIZE);
+    // drop every name cached or indexed inside removed directory
+    dcache_invalidate_dir(child_dir.firstCluster);
+    dir_index_drop(child_dir.firstCluster);
 
-        if (strcmp(tmp_record.name, child_dir.name) == 0) {
-            tmp_record.TypeVal = TYPEVAL_INVALIDO;
+    // release whole cluster chain of child dir writing each fat sector once
+    DWORD cluster_to_delete = child_dir.firstCluster;
 
-            // copy current modified record back to buffer
-            memcpy(&content[position_on_cluster], &tmp_record, RECORD_SIZE);
+    fat_begin_batch();
+    while (cluster_to_delete != END_OF_FILE && cluster_to_delete != FREE_CLUSTER) {
+        DWORD tmp_cluster = get_value_from_fat(cluster_to_delete);
+        if (set_value_to_fat(cluster_to_delete, FREE_CLUSTER) != SUCCESS) {
+            fat_end_batch();
+            return ERROR;
         }
+        cluster_to_delete = tmp_cluster;
     }
-
-    // write back to disk all free entries
-    write_cluster(parent_dir.firstCluster, content);
-
-    // clear fat entry of child dir
-    if (set_value_to_fat(child_dir.firstCluster, FREE_CLUSTER) != SUCCESS) {
+    if (fat_end_batch() != SUCCESS)
         return ERROR;
-    }
-
-	if (isLink)
-		free(temprec);
 
     return SUCCESS;
 }
 
 /**
- * Change current directory to pathname. 
+ * Remove an existing directory. 
  *
- * param pathname - absolute or relative path
+ * param pathname - absolute or relative path for directory
  * 
- * returns - SUCCESS if directory was changed FALSE otherwise.
+ * returns - SUCCESS if sucessfully removed FALSE otherwise.
 **/
-int chdir2(char *pathname) {
-	// if pathname is only slash then we dont need to worry
-	// about extracting path we can just set curr_dir to
-	// root dir cluster
-
-	if (strcmp(pathname, "/") == 0) {
-		curr_dir = cluster_to_log_sector(superblock.RootDirCluster);
-
-		return SUCCESS;
-	}
-
-	// extract path head and tail
-	Path *path = malloc(sizeof(Path));
-	if (path_from_name(pathname, path) != SUCCESS) {
-		free(path);
-		return ERROR;
-	}
-
-
-
-	// check if path exist
-	int valid = does_name_exists(path->both);
-
-	// unable to locate parent path in disk or
-	// current name exists in disk
-	// then return an error
-	if (!valid) {
-		return ERROR;
-	}
+int rmdir2 (char *pathname) {
+    if (ensure_mounted() != SUCCESS)
+        return ERROR;
 
-	// find parent directory by tail
-	Record dir;
-	lookup_parent_descriptor_by_name(path->tail, &dir);
+    // find the to-be-deleted child dir and its slot inside of parent dir
+    // keeping both locked
+    PathLookup path;
+    int exists = lock_path(pathname, &path);
 
-	Record file;
-	lookup_descriptor_by_name(dir.firstCluster, path->head, &file);
+    if (exists == ERROR)
+        return ERROR;
 
-	if (file.TypeVal == TYPEVAL_LINK)
-	{
+    // a soft link is followed to the directory it names
+    if (exists == TRUE && path.record.TypeVal == TYPEVAL_LINK) {
+        Record link = path.record;
 
-		Path* pathfromlink = malloc(sizeof(Path));
-		pathfromlink = findLinkPath(file);
-		lookup_parent_descriptor_by_name(pathfromlink->both, &dir);
-		free(pathfromlink);
+        unlock_path(&path, exists);
 
-		// set current directory to path already found
-		curr_dir = cluster_to_log_sector(dir.firstCluster);
+        exists = lock_link(link, &path);
 
-		// free path pointer from memmory 
-		free(path);
+        if (exists == ERROR)
+            return ERROR;
+    }
 
-		return SUCCESS;
+    int result = exists == TRUE ? rmdir_at(&path) : ERROR;
 
-	}
+    unlock_path(&path, exists);
 
-	else
-	{
-		// find parent directory by tail
-		lookup_parent_descriptor_by_name(path->both, &dir);
+    return result;
+}
 
-		// set current directory to path already found
-		curr_dir = cluster_to_log_sector(dir.firstCluster);
+/**
+ * Change current directory to pathname. 
+ *
+ * param pathname - absolute or relative path
+ * 
+ * returns - SUCCESS if directory was changed FALSE otherwise.
+**/
+int chdir2(char *pathname) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
 
-		// free path pointer from memmory 
-		free(path);
+	// find directory record (a path made only of slashes gives root)
+	PathLookup path;
+	if (resolve_path(pathname, &path) != TRUE)
+		return ERROR;
 
-		return SUCCESS;
-	}
+	// follow soft link to its target
+	if (path.record.TypeVal == TYPEVAL_LINK && resolve_link(path.record, &path) != TRUE)
+		return ERROR;
 
+	if (path.record.TypeVal != TYPEVAL_DIRETORIO)
+		return ERROR;
 
+	// set current directory to path already found
+	set_curr_dir(cluster_to_log_sector(path.record.firstCluster));
 
+	return SUCCESS;
 }
 
+int getcwd2 (char *name, int size) {
+    Mount *mount = current_mount();
 
+    if (ensure_mounted() != SUCCESS)
+        return ERROR;
 
-
-
-int getcwd2 (char *name, int size) {
     // allocate name array that we will return at end
     char curr_name[MAX_PATH_SIZE];
 
@@ -851,7 +1003,7 @@ int getcwd2 (char *name, int size) {
     DWORD curr_cluster = curr_data_cluster();
 
     // allocate a buffer for storing temp child cluster content
-    unsigned char content[SECTOR_SIZE * superblock.SectorsPerCluster];
+    unsigned char content[SECTOR_SIZE * mount->super.SectorsPerCluster];
     if (read_cluster(curr_cluster, content) != SUCCESS) return ERROR;
     
     // name must be equal or greater than 2 since we must fill it with
@@ -861,7 +1013,7 @@ int getcwd2 (char *name, int size) {
     }
 
     // we are in root directory then we can return slash
-    if (curr_cluster == superblock.RootDirCluster) {
+    if (curr_cluster == mount->super.RootDirCluster) {
         name[0] = '/';
         name[1] = '\0';
         
@@ -880,8 +1032,15 @@ int getcwd2 (char *name, int size) {
 
     // loop thourgh children directory to check if its empty or not
     // marking its members (only . and ..) as free entriess
-    while (tmp_dir.firstCluster != superblock.RootDirCluster) {
-        lookup_descriptor_by_name(tmp_dir.firstCluster, "..", &tmp_dir);
+    while (tmp_dir.firstCluster != mount->super.RootDirCluster) {
+        DWORD child = tmp_dir.firstCluster;
+
+        node_lock_shared(child);
+        lookup_descriptor_by_name(child, "..", &tmp_dir);
+        node_unlock(child);
+
+        // root directory has no entry of its own to take a name from
+        if (tmp_dir.firstCluster == mount->super.RootDirCluster) break;
 
         // retrieve current directory record and store in tmp_dir
         lookup_descriptor_by_cluster(tmp_dir.firstCluster, &tmp_dir);
@@ -897,65 +1056,40 @@ int getcwd2 (char *name, int size) {
     // store curr_name length
     int curr_name_len = strlen(curr_name);
 
-    // curr_name legth cannot be greater than size parameter
-    if (curr_name_len > size) {
+    // curr_name and its terminator must fit in size parameter
+    if (curr_name_len >= size) {
         return ERROR;
     }
 
     // store curr_name in name parameter
-    strncpy(name, curr_name, curr_name_len);
+    strncpy(name, curr_name, curr_name_len + 1);
 
     return SUCCESS;
 }
 
 DIR2 opendir2 (char *pathname) {
-	// extract path head and tail
-	Path *path = malloc(sizeof(Path));
-	path_from_name(pathname, path);
-
-	// return error if parent path does not exists
-	if (!does_name_exists(path->tail))
-		// path does not exists
+	if (ensure_mounted() != SUCCESS)
 		return ERROR;
 
-	// get the descriptor for parent folder
-	Record parent_dir;
-	lookup_parent_descriptor_by_name(path->tail, &parent_dir);
-
-	// find the to-be-deleted file inside of parent dir
-	Record dirdesc;
-	if (!lookup_descriptor_by_name(parent_dir.firstCluster, path->head, &dirdesc))
-		// file does not exists
-		return ERROR;
-	if (!(dirdesc.TypeVal == TYPEVAL_DIRETORIO || dirdesc.TypeVal == TYPEVAL_LINK))
-	{
-		// It's not a directory or a softlink to one
-		free(path);
+	// find directory record (a path made only of slashes gives root)
+	PathLookup path;
+	if (resolve_path(pathname, &path) != TRUE)
+		// path does not exists
 		return ERROR;
 
-	}
-
+	Record dirdesc = path.record;
 
-
-	if (dirdesc.TypeVal == TYPEVAL_LINK) //we must open the real file
+	if (dirdesc.TypeVal == TYPEVAL_LINK) //we must open the real directory
 	{
-		Record* filefromlink = malloc(sizeof(Record));
-		filefromlink = findLinkRecord(dirdesc);
-		if (filefromlink == NULL)
+		if (resolve_link(dirdesc, &path) != TRUE)
 			return ERROR;
 
-		if (filefromlink->TypeVal != TYPEVAL_DIRETORIO)
-			return ERROR;
-		else
-		{
-			char linkpath[phys_cluster_size()];
-			strcpy(linkpath, findLinkPath(dirdesc)->both);
-			dirdesc = *filefromlink;
-			free(filefromlink);
-			return save_as_opened_dir(dirdesc, linkpath);
-		}
+		dirdesc = path.record;
 	}
 
+	if (dirdesc.TypeVal != TYPEVAL_DIRETORIO)
+		// It's not a directory or a softlink to one
+		return ERROR;
 
 	// if possible, save as opened dir
 	// otherwise, returns an error
@@ -963,191 +1097,182 @@ DIR2 opendir2 (char *pathname) {
 }
 
 int readdir2(DIR2 handle, DIRENT2 *dentry) {
-	// Check if handle is inside of boundaries
-	if (handle < 0)
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	// a single entry batch
+	if (readdirn2(handle, dentry, 1) != 1)
 		return ERROR;
-	if (handle >= MAX_OPENED_DIRS)
+
+	return SUCCESS;
+}
+
+/**
+ * Read up to max entries of an opened directory starting at its current
+ * position. Records are decoded from the directory cluster kept by the
+ * handle so each cluster is read once per listing.
+ *
+ * returns  - number of entries read (0 when there are no more entries).
+ * on error - returns ERROR if handle is invalid or directory cannot be read.
+**/
+int readdirn2(DIR2 handle, DIRENT2 *dentries, int max) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	if (dentries == NULL || max < 0)
 		return ERROR;
-	// Check if the passed handle has a dir
-	if (opened_dirs[handle].is_used == FALSE)
+
+	// check handle (rejecting stale ones) and lock it
+	OpenedDir *opened = dir_handle_acquire(handle);
+	if (opened == NULL)
 		return ERROR;
 
 	//get dir
-	Record dir = opened_dirs[handle].record;
+	Record dir = opened->record;
 
+	int count = 0;
 
+	// records are not written while directory is held for reading
+	node_lock_shared(dir.firstCluster);
 
-	const int bufferSize = phys_cluster_size();
-	// creates a buffer to read the content
-	unsigned char result[bufferSize];
-	int address = opened_dirs[handle].current_pointer;
-	
-	struct t2fs_record descriptor;
-	if (read_cluster(dir.firstCluster, result) != SUCCESS) return ERROR;
-	if ((address >= (phys_cluster_size() - 64)) || address < 0) //if address is higher than the last possible entry, we must return an error.
-		return ERROR;
+	// negative address means no more valid entries
+	while (count < max && opened->current_pointer >= 0) {
+		int address = opened->current_pointer;
 
-	address = findValidEntry(dir, address); //find the next valid entry
-	if (address == ERROR)
-	{
-		return ERROR;
-	}
-	
-	memcpy(&descriptor, &result[address], sizeof(descriptor));
+		// read entry from cluster kept by handle
+		Record *descriptor = opened_dir_record(opened, address / RECORD_SIZE);
+		if (descriptor == NULL) {
+			if (count == 0)
+				count = ERROR;
+			break;
+		}
 
-	if (descriptor.TypeVal == TYPEVAL_DIRETORIO || descriptor.TypeVal == TYPEVAL_LINK || descriptor.TypeVal == TYPEVAL_REGULAR)
+		// entry may have been removed after cursor moved to it
+		if (descriptor->TypeVal == TYPEVAL_DIRETORIO || descriptor->TypeVal == TYPEVAL_LINK || descriptor->TypeVal == TYPEVAL_REGULAR)
 		{
-		dentry->fileSize = descriptor.bytesFileSize;
-		dentry->fileType = descriptor.TypeVal; 
-		strcpy(dentry->name, descriptor.name);
-		address = findValidEntry(dir, address);
-		opened_dirs[handle].current_pointer = address;
-		return SUCCESS;
+			dentries[count].fileSize = descriptor->bytesFileSize;
+			dentries[count].fileType = descriptor->TypeVal;
+			strcpy(dentries[count].name, descriptor->name);
+			count++;
 		}
-	else
-		return ERROR;
+
+		//find the next valid entry
+		opened->current_pointer = findValidEntry(dir, address + RECORD_SIZE);
+	}
+
+	node_unlock(dir.firstCluster);
+
+	dir_handle_release(opened);
+
+	return count;
 }
 
 int closedir2 (DIR2 handle) {
-		// Check if handle is inside of boundaries
-		if (handle < 0)
-			return ERROR;
-		if (handle >= MAX_OPENED_DIRS)
+		if (ensure_mounted() != SUCCESS)
 			return ERROR;
-		// Check if the passed handle has a dir
-		if (opened_dirs[handle].is_used == FALSE)
+
+		// check handle (rejecting stale ones) and lock it
+		OpenedDir *opened = dir_handle_acquire(handle);
+		if (opened == NULL)
 			return ERROR;
-		opened_dirs[handle].is_used = FALSE;
-		unusedDirHandles++;
-		num_opened_dirs--;
+		release_opened_dir(opened);
 		return SUCCESS;
 	}
 
 
 
-int ln2(char *linkname, char *filename) {
+/**
+ * Create soft link entry and its content for a locked path (see
+ * lock_path) whose last component does not exist.
+ *
+ * returns - SUCCESS if link was created ERROR otherwise.
+**/
+static int link_at(PathLookup *locked, char *filename) {
+	PathLookup path = *locked;
 
-	if (sizeof(filename) >= phys_cluster_size())//if path size bigger than a cluster, we must return an error.
-		return ERROR;
+	// allocate link cluster from free cluster bitmap
+	DWORD p_free_sector = alloc_cluster();
 
-	// extract path head and tail
-	Path *linkpath = malloc(sizeof(Path));
-	if (path_from_name(linkname, linkpath) != SUCCESS) {
-		free(linkpath);
-		return ERROR;
-	}
-
-	// extract path head and tail
-	Path *filepath = malloc(sizeof(Path));
-	if (path_from_name(filename, filepath) != SUCCESS) {
-		free(filepath);
-		return ERROR;
-	}
-
-	// return error if file does not exist.
-	if (!does_name_exists(filepath->both))
-		return ERROR;
-
-	// return error if parent path does not exist
-	if (!does_name_exists(linkpath->tail))
+	// disk is full
+	if (p_free_sector == ERROR)
 		return ERROR;
 
-	// get the descriptor for parent folder
-	Record parent_dir;
-	lookup_parent_descriptor_by_name(linkpath->tail, &parent_dir);
-
-	// find first free fat physical sector entry
-	int p_free_sector = phys_fat_first_fit();
-
 	Record link;
 	link.TypeVal = TYPEVAL_LINK;
 	link.bytesFileSize = phys_cluster_size();
 	link.clustersFileSize = 1;
-	strncpy(link.name, linkpath->head, FILE_NAME_SIZE);
+	strcpy(link.name, path.name);
 
 	link.firstCluster = p_free_sector;
 
 
 	unsigned char linkContent[link.bytesFileSize];
 
-	memcpy(linkContent, filepath->both, link.bytesFileSize);
-
-
-	// buffer to read the content of parent dir cluster
-	unsigned char content[SECTOR_SIZE * superblock.SectorsPerCluster];
-
-	if (read_cluster(parent_dir.firstCluster, content) != SUCCESS) return ERROR;
+	memset(linkContent, 0x00, link.bytesFileSize);
+	memcpy(linkContent, filename, strlen(filename) + 1);
 
-	int i;
+	DWORD slot;
 
-	// flag to check if a space to write was found
-	int able_to_write = FALSE;
-
-	Record tmp_record;
-	for (i = 0; i < records_per_sector() * superblock.SectorsPerCluster; i++) {
-		int position_on_cluster = i * RECORD_SIZE;
-
-		// Copy the current record do parent dir to tmp_record
-		memcpy(&tmp_record, &content[position_on_cluster], RECORD_SIZE);
+	// take a free entry (growing parent if full) or give back allocated cluster
+	if (alloc_dir_slot(path.parent, &slot) != SUCCESS) {
+		alloc_release(p_free_sector);
+		return ERROR;
+	}
 
-		// Just need to check for duplications if it isn't invalid
-		if (tmp_record.TypeVal != TYPEVAL_INVALIDO) {
-			if (strcmp(tmp_record.name, link.name) == 0)  //if file already exists, delete the content which belongs to the original
-			{
-				return ERROR;
-			}
-		
-			// If it's invalid = it's free (ie, we can write on it)
-		}
-		else {
-			// copy the content of file to the actual position on cluster
-			memcpy(&content[position_on_cluster], &link, RECORD_SIZE);
+	// write link record into parent entry
+	if (write_dir_record(path.parent, slot, &link) != SUCCESS) {
+		alloc_release(p_free_sector);
+		return ERROR;
+	}
 
-			// write the modified cluster (with the new file) 
-			write_cluster(parent_dir.firstCluster, content);
+	write_cluster(link.firstCluster, linkContent);
 
-			// doesn't need to iterate anymore
-			able_to_write = TRUE;
-		
-			break;
-		}
-	}
+	return SUCCESS;
 
+}
 
+int ln2(char *linkname, char *filename) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
 
-	// parent directory is full
-	if (able_to_write == FALSE)
+	// link content is the target path and must fit in a cluster
+	if (strlen(filename) >= phys_cluster_size())
 		return ERROR;
 
-	write_cluster(link.firstCluster, linkContent);
+	// return error if file does not exist.
+	PathLookup target;
+	if (resolve_path(filename, &target) != TRUE)
+		return ERROR;
 
-	// sets EOF to the found free index of FAT
-	if (set_value_to_fat(p_free_sector, EOF) != SUCCESS)
+	// return error if parent path does not exist or link name is taken
+	PathLookup path;
+	int exists = lock_path(linkname, &path);
+	if (exists == ERROR)
 		return ERROR;
 
-	// release resources for path
-	free(linkpath);
-	free(filepath);
+	int result = exists == FALSE ? link_at(&path, filename) : ERROR;
 
-	return SUCCESS;
+	unlock_path(&path, exists);
 
+	return result;
 }
 
 
 
-int truncate2 (FILE2 handle) {
-	// Check if handle is inside of boundaries
-	if (handle < 0)
-		return ERROR;
-	if (handle >= MAX_OPENED_FILES)
-		return ERROR;
-	// Check if the passed handle has a file 
-	if (opened_files[handle].is_used == FALSE)
+/**
+ * Cut an opened file at its current pointer. File node and its parent
+ * directory must be locked for writing.
+ *
+ * on error - returns ERROR if FAT or directory cannot be written otherwise SUCCESS.
+**/
+static int truncate_at (OpenedFile *opened) {
+	// chain may have been released since pending writes were flushed
+	if (!file_apply_cut(opened))
 		return ERROR;
 
 	// get the file from the opened list
-	Record file = opened_files[handle].file;
-	int current_pointer = opened_files[handle].current_pointer;
+	Record file = opened->file;
+	int current_pointer = opened->current_pointer;
 	unsigned int cluster_size = phys_cluster_size();
 	int newSize = current_pointer - 1;
 
@@ -1162,52 +1287,528 @@ int truncate2 (FILE2 handle) {
 
 	// free the FAT entries that the file used to use
 	int clusterCounter;
-	int cluster_to_delete = file.firstCluster;
-	for (clusterCounter = 0; clusterCounter < file.clustersFileSize; clusterCounter++) {
-		int tmp_cluster = local_fat[cluster_to_delete];
+	DWORD cluster_to_delete = file.firstCluster;
+
+	// cut the chain writing each fat sector once (followed to its end
+	// since other handles may have linked clusters not counted here)
+	fat_begin_batch();
+	for (clusterCounter = 0; cluster_to_delete != END_OF_FILE && cluster_to_delete != FREE_CLUSTER &&
+	     cluster_to_delete != BAD_SECTOR; clusterCounter++) {
+		DWORD tmp_cluster = get_value_from_fat(cluster_to_delete);
 		if(clusterCounter >= newFileClusters)
-			if (set_value_to_fat(cluster_to_delete, FREE_CLUSTER) != SUCCESS)
+			if (set_value_to_fat(cluster_to_delete, FREE_CLUSTER) != SUCCESS) {
+				fat_end_batch();
 				return ERROR;
+			}
 			if(clusterCounter == newFileClusters -1)
-				if (set_value_to_fat(cluster_to_delete, EOF) != SUCCESS)
+				if (set_value_to_fat(cluster_to_delete, EOF) != SUCCESS) {
+					fat_end_batch();
 					return ERROR;
+				}
 		cluster_to_delete = tmp_cluster;
 	}
+	if (fat_end_batch() != SUCCESS)
+		return ERROR;
+
+	// chain was cut so cursors past new end are stale and other
+	// handles drop pending writes past it
+	invalidate_file_cursors(file.firstCluster);
+	files_cut_chain(file.firstCluster, newFileClusters, newSize, opened);
+
 	file.bytesFileSize = newSize;
 	file.clustersFileSize = newFileClusters;
 
 	
-	Path *path = malloc(sizeof(Path));
-	if (path_from_name(opened_files[handle].path, path) != SUCCESS) {
-		free(path);
+	// update the register on opened file
+	opened->file = file;
+
+	// update the entry of the file on the parent directory through
+	// parent cluster and slot kept by handle
+	if (update_opened_record(opened, FALSE) != SUCCESS)
+		return ERROR;
+
+    return SUCCESS;
+}
+
+int truncate2 (FILE2 handle) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
+		return ERROR;
+
+	// chain is cut after pending writes land where they belong
+	if (file_flush_writes(opened) != SUCCESS) {
+		file_handle_release(opened);
 		return ERROR;
 	}
 
-	// get the descriptor for parent folder
-	Record parent_dir;
-	lookup_parent_descriptor_by_name(path->tail, &parent_dir);
+	DWORD parent = opened->parent_cluster;
+	DWORD first = opened->file.firstCluster;
 
-	// Here we update the entry of the file on the parent directory
-// buffer to read the content of parent dir cluster
-	unsigned char parent_content[SECTOR_SIZE * superblock.SectorsPerCluster];
-	if (read_cluster(parent_dir.firstCluster, parent_content) != SUCCESS) return ERROR;
+	// chain and entry of file both change
+	node_lock_pair(parent, first);
+	int result = truncate_at(opened);
+	node_unlock_pair(parent, first);
 
-	int i;
+	file_handle_release(opened);
 
-	Record tmp_record;
+	return result;
+}
 
-	for (i = 0; i < records_per_sector() * superblock.SectorsPerCluster; i++) {
-		int position_on_cluster = i * RECORD_SIZE;
-		// Copy the current record do parent dir to tmp_record
-		memcpy(&tmp_record, &parent_content[position_on_cluster], RECORD_SIZE);
-		if (strcmp(tmp_record.name, file.name) == 0) {
-			// save the updated file
-			memcpy(&parent_content[position_on_cluster], &file, RECORD_SIZE);
+/**
+ * Grow chain of an opened file so that it holds size bytes with a single
+ * allocator call, leaving file size as is. Later writes up to size then
+ * allocate nothing. File node must be locked for writing.
+ *
+ * on error - returns ERROR if disk is full or FAT cannot be updated
+ *            otherwise SUCCESS.
+**/
+static int reserve_at (OpenedFile *opened, DWORD size) {
+	// file was deleted or cut through another handle meanwhile
+	if (!file_apply_cut(opened))
+		return ERROR;
 
-			// write the file with differences 
-			write_cluster(parent_dir.firstCluster, parent_content);
-		}
+	DWORD cluster_size = phys_cluster_size();
+	DWORD clusters = (size + cluster_size - 1) / cluster_size;
+
+	if (clusters <= opened->file.clustersFileSize)
+		return SUCCESS;
+
+	int wanted = clusters - opened->file.clustersFileSize;
+	int allocated = extend_at(opened, wanted);
+
+	if (allocated == ERROR)
+		return ERROR;
+
+	// record keeps every linked cluster even when disk got full
+	opened->file.clustersFileSize += allocated;
+	opened->record_dirty = TRUE;
+
+	return allocated == wanted ? SUCCESS : ERROR;
+}
+
+/**
+ * Reserve chain of a file handle for size bytes (see reserve_at).
+**/
+static int reserve_handle (FILE2 handle, DWORD size) {
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
+		return ERROR;
+
+	DWORD first = opened->file.firstCluster;
+
+	node_lock_exclusive(first);
+	int result = reserve_at(opened, size);
+	node_unlock(first);
+
+	file_handle_release(opened);
+
+	return result;
+}
+
+/**
+ * Copy of the record kept by a file handle.
+ *
+ * on error - returns ERROR if handle is not opened otherwise SUCCESS.
+**/
+static int handle_record (FILE2 handle, Record *record) {
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
+		return ERROR;
+
+	*record = opened->file;
+
+	file_handle_release(opened);
+
+	return SUCCESS;
+}
+
+/**
+ * Buffer moving COPY_CHUNK_CLUSTERS clusters per request. Chunks start
+ * on cluster boundaries so reads and writes of whole clusters go
+ * straight between it and disk one contiguous run per request.
+ *
+ * returns  - buffer (release with free) and its size in chunk_size.
+ * on error - returns NULL if memory cannot be allocated.
+**/
+static char *alloc_chunk (int *chunk_size) {
+	*chunk_size = COPY_CHUNK_CLUSTERS * phys_cluster_size();
+
+	return malloc(*chunk_size);
+}
+
+/**
+ * Copy a file into another one (created, or reset if it exists) moving
+ * whole clusters at a time. Destination chain is reserved up front.
+ *
+ * returns - SUCCESS if file was copied ERROR otherwise.
+**/
+int copy2 (char *src, char *dst) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	FILE2 source = open2(src);
+	if (source < 0)
+		return ERROR;
+
+	Record record;
+	PathLookup path;
+
+	// creating destination over source would release the chain being
+	// copied
+	if (handle_record(source, &record) != SUCCESS ||
+	    (resolve_path(dst, &path) == TRUE && path.record.firstCluster == record.firstCluster)) {
+		close2(source);
+		return ERROR;
 	}
 
-    return SUCCESS;
-}
\ No newline at end of file
+	FILE2 target = create2(dst);
+	if (target < 0) {
+		close2(source);
+		return ERROR;
+	}
+
+	int chunk_size;
+	char *chunk = alloc_chunk(&chunk_size);
+
+	int result = chunk != NULL ? reserve_handle(target, record.bytesFileSize) : ERROR;
+
+	while (result == SUCCESS) {
+		int count = read2(source, chunk, chunk_size);
+
+		if (count == 0)
+			break;
+
+		if (count < 0 || write2(target, chunk, count) != count)
+			result = ERROR;
+	}
+
+	free(chunk);
+
+	if (close2(source) != SUCCESS)
+		result = ERROR;
+
+	if (close2(target) != SUCCESS)
+		result = ERROR;
+
+	return result;
+}
+
+/**
+ * Copy a file of host file system into T2FS (destination is created, or
+ * reset if it exists) moving whole clusters at a time. Destination chain
+ * is reserved up front from host file size.
+ *
+ * returns - SUCCESS if file was copied ERROR otherwise.
+**/
+int import2 (char *host_path, char *t2fs_path) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	FILE *source = fopen(host_path, "rb");
+	if (source == NULL)
+		return ERROR;
+
+	struct stat info;
+
+	// file sizes are kept as int like current pointer
+	if (fstat(fileno(source), &info) != 0 || info.st_size > INT_MAX) {
+		fclose(source);
+		return ERROR;
+	}
+
+	FILE2 target = create2(t2fs_path);
+	if (target < 0) {
+		fclose(source);
+		return ERROR;
+	}
+
+	int chunk_size;
+	char *chunk = alloc_chunk(&chunk_size);
+
+	int result = chunk != NULL ? reserve_handle(target, info.st_size) : ERROR;
+
+	while (result == SUCCESS) {
+		int count = fread(chunk, 1, chunk_size, source);
+
+		if (count > 0 && write2(target, chunk, count) != count)
+			result = ERROR;
+
+		if (count < chunk_size)
+			break;
+	}
+
+	if (ferror(source))
+		result = ERROR;
+
+	free(chunk);
+	fclose(source);
+
+	if (close2(target) != SUCCESS)
+		result = ERROR;
+
+	return result;
+}
+
+/**
+ * Copy a T2FS file to host file system (destination is created, or
+ * truncated if it exists) moving whole clusters at a time.
+ *
+ * returns - SUCCESS if file was copied ERROR otherwise.
+**/
+int export2 (char *t2fs_path, char *host_path) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	FILE2 source = open2(t2fs_path);
+	if (source < 0)
+		return ERROR;
+
+	FILE *target = fopen(host_path, "wb");
+	if (target == NULL) {
+		close2(source);
+		return ERROR;
+	}
+
+	int chunk_size;
+	char *chunk = alloc_chunk(&chunk_size);
+
+	int result = chunk != NULL ? SUCCESS : ERROR;
+
+	while (result == SUCCESS) {
+		int count = read2(source, chunk, chunk_size);
+
+		if (count == 0)
+			break;
+
+		if (count < 0 || fwrite(chunk, 1, count, target) != (size_t) count)
+			result = ERROR;
+	}
+
+	free(chunk);
+	close2(source);
+
+	if (fclose(target) != 0)
+		result = ERROR;
+
+	return result;
+}
+
+/**
+ * Store pending writes of an opened file and write every dirty FAT and
+ * buffer cache sector back to disk making sure disk persisted them.
+ * Buffer cache does not track which file a sector belongs to so sectors
+ * of other files are written too.
+ *
+ * returns - SUCCESS if everything was written ERROR otherwise.
+**/
+int fsync2 (FILE2 handle) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	// check handle (rejecting stale ones) and lock it
+	OpenedFile *opened = file_handle_acquire(handle);
+	if (opened == NULL)
+		return ERROR;
+
+	int result = file_flush_writes(opened);
+
+	file_handle_release(opened);
+
+	if (result != SUCCESS || flush_fat() != SUCCESS || cache_flush() != SUCCESS || sync_disk() != SUCCESS)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+/**
+ * Write every dirty FAT and buffer cache sector back to disk and make
+ * sure disk persisted them.
+ *
+ * returns - SUCCESS if everything was written ERROR otherwise.
+**/
+int sync2 (void) {
+	if (ensure_mounted() != SUCCESS)
+		return ERROR;
+
+	// writes still held by opened files go first
+	if (files_flush_writes() != SUCCESS)
+		return ERROR;
+
+	if (flush_fat() != SUCCESS)
+		return ERROR;
+
+	if (cache_flush() != SUCCESS)
+		return ERROR;
+
+	if (sync_disk() != SUCCESS)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+/**
+ * Initialize library with given options (NULL for defaults) and load
+ * default mount.
+ *
+ * returns - SUCCESS if default mount was loaded ERROR if it could not be
+ *           read or library was already initialized.
+**/
+int t2fs_init (T2FS_OPTIONS *options) {
+	if (mount_configure(options) != SUCCESS)
+		return ERROR;
+
+	return mount_load(&default_mount);
+}
+
+/**
+ * Write back every dirty sector of every mount, release mounts created
+ * by t2fs_mount and unload default mount.
+ *
+ * returns - SUCCESS if everything was written ERROR otherwise.
+**/
+int t2fs_shutdown (void) {
+	return mount_shutdown();
+}
+
+/**
+ * Mount a disk image. Image is only read on first call made on mount.
+ *
+ * returns  - new mount.
+ * on error - returns NULL if memory cannot be allocated.
+**/
+T2FS_MOUNT *t2fs_mount (char *path) {
+	if (path == NULL)
+		return NULL;
+
+	return mount_create(path);
+}
+
+/**
+ * Write back every dirty sector of a mount and release it. Default
+ * mount stays loaded for the whole process lifetime.
+ *
+ * returns - SUCCESS if everything was written ERROR otherwise.
+**/
+int t2fs_umount (T2FS_MOUNT *mount) {
+	if (mount == NULL || mount == &default_mount)
+		return ERROR;
+
+	return mount_destroy(mount);
+}
+
+// run an API call on a mount: calling thread works on it during the
+// call (which loads it on first use)
+#define ON_MOUNT(mount, call) ({                                \
+	__typeof__(call) _result = ERROR;                           \
+	if ((mount) != NULL) {                                      \
+		Mount *_previous = mount_enter(mount);                  \
+		_result = call;                                         \
+		mount_leave(_previous);                                 \
+	}                                                           \
+	_result;                                                    \
+})
+
+/**
+ * Mount variants: each one runs its counterpart above on given mount.
+**/
+FILE2 create2_m (T2FS_MOUNT *mount, char *filename) {
+	return ON_MOUNT(mount, create2(filename));
+}
+
+int delete2_m (T2FS_MOUNT *mount, char *filename) {
+	return ON_MOUNT(mount, delete2(filename));
+}
+
+FILE2 open2_m (T2FS_MOUNT *mount, char *filename) {
+	return ON_MOUNT(mount, open2(filename));
+}
+
+int close2_m (T2FS_MOUNT *mount, FILE2 handle) {
+	return ON_MOUNT(mount, close2(handle));
+}
+
+int read2_m (T2FS_MOUNT *mount, FILE2 handle, char *buffer, int size) {
+	return ON_MOUNT(mount, read2(handle, buffer, size));
+}
+
+int write2_m (T2FS_MOUNT *mount, FILE2 handle, char *buffer, int size) {
+	return ON_MOUNT(mount, write2(handle, buffer, size));
+}
+
+int pread2_m (T2FS_MOUNT *mount, FILE2 handle, char *buffer, int size, DWORD offset) {
+	return ON_MOUNT(mount, pread2(handle, buffer, size, offset));
+}
+
+int pwrite2_m (T2FS_MOUNT *mount, FILE2 handle, char *buffer, int size, DWORD offset) {
+	return ON_MOUNT(mount, pwrite2(handle, buffer, size, offset));
+}
+
+int truncate2_m (T2FS_MOUNT *mount, FILE2 handle) {
+	return ON_MOUNT(mount, truncate2(handle));
+}
+
+int seek2_m (T2FS_MOUNT *mount, FILE2 handle, DWORD offset) {
+	return ON_MOUNT(mount, seek2(handle, offset));
+}
+
+int mkdir2_m (T2FS_MOUNT *mount, char *pathname) {
+	return ON_MOUNT(mount, mkdir2(pathname));
+}
+
+int rmdir2_m (T2FS_MOUNT *mount, char *pathname) {
+	return ON_MOUNT(mount, rmdir2(pathname));
+}
+
+int chdir2_m (T2FS_MOUNT *mount, char *pathname) {
+	return ON_MOUNT(mount, chdir2(pathname));
+}
+
+int getcwd2_m (T2FS_MOUNT *mount, char *pathname, int size) {
+	return ON_MOUNT(mount, getcwd2(pathname, size));
+}
+
+DIR2 opendir2_m (T2FS_MOUNT *mount, char *pathname) {
+	return ON_MOUNT(mount, opendir2(pathname));
+}
+
+int readdir2_m (T2FS_MOUNT *mount, DIR2 handle, DIRENT2 *dentry) {
+	return ON_MOUNT(mount, readdir2(handle, dentry));
+}
+
+int readdirn2_m (T2FS_MOUNT *mount, DIR2 handle, DIRENT2 *dentries, int max) {
+	return ON_MOUNT(mount, readdirn2(handle, dentries, max));
+}
+
+int closedir2_m (T2FS_MOUNT *mount, DIR2 handle) {
+	return ON_MOUNT(mount, closedir2(handle));
+}
+
+int ln2_m (T2FS_MOUNT *mount, char *linkname, char *filename) {
+	return ON_MOUNT(mount, ln2(linkname, filename));
+}
+
+int copy2_m (T2FS_MOUNT *mount, char *src, char *dst) {
+	return ON_MOUNT(mount, copy2(src, dst));
+}
+
+int import2_m (T2FS_MOUNT *mount, char *host_path, char *t2fs_path) {
+	return ON_MOUNT(mount, import2(host_path, t2fs_path));
+}
+
+int export2_m (T2FS_MOUNT *mount, char *t2fs_path, char *host_path) {
+	return ON_MOUNT(mount, export2(t2fs_path, host_path));
+}
+
+int fsync2_m (T2FS_MOUNT *mount, FILE2 handle) {
+	return ON_MOUNT(mount, fsync2(handle));
+}
+
+int sync2_m (T2FS_MOUNT *mount) {
+	return ON_MOUNT(mount, sync2());
+}